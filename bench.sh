@@ -0,0 +1,249 @@
+#!/bin/sh
+#
+# Benchmark managera: buduje manager i mkfile, uruchamia obciążenia i zapisuje
+# wyniki w formacie TSV (obciążenie, parametr, miara, wartość, jednostka).
+#
+# Użycie: ./bench.sh [-o wyniki.tsv] [-b baza.tsv] [-t procent] [obciążenie...]
+#   -o  plik wyników (domyślnie bench.out/results.tsv)
+#   -b  porównaj z zapisanymi wcześniej wynikami; kod wyjścia 2 przy regresji
+#   -t  próg regresji w procentach (domyślnie 10)
+# Obciążenia: format small large lookup aging (domyślnie wszystkie).
+#
+# Parametry przez zmienne środowiska (wartości domyślne poniżej). Kolejność
+# operacji w aging zależy tylko od BENCH_SEED, więc przebiegi są powtarzalne.
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2 -pthread}
+BENCH_DIR=${BENCH_DIR:-bench.out}
+BENCH_SEED=${BENCH_SEED:-1}
+BENCH_REPEAT=${BENCH_REPEAT:-3}
+BENCH_FORMAT_SIZES=${BENCH_FORMAT_SIZES:-"16M 256M 1G"}
+BENCH_SMALL_COUNT=${BENCH_SMALL_COUNT:-1000}
+BENCH_SMALL_SIZE=${BENCH_SMALL_SIZE:-4096}
+BENCH_LARGE_MB=${BENCH_LARGE_MB:-64}
+BENCH_LOOKUP_COUNTS=${BENCH_LOOKUP_COUNTS:-"100 1000 10000"}
+BENCH_LOOKUPS=${BENCH_LOOKUPS:-2000}
+BENCH_AGING_OPS=${BENCH_AGING_OPS:-3000}
+
+out=""
+baseline=""
+threshold=10
+while getopts "o:b:t:" opt; do
+    case $opt in
+        o) out=$OPTARG ;;
+        b) baseline=$OPTARG ;;
+        t) threshold=$OPTARG ;;
+        *) sed -n '3,10p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift `expr $OPTIND - 1`
+workloads=${*:-"format small large lookup aging"}
+
+src=`cd "\`dirname "$0"\`" && pwd`
+mkdir -p "$BENCH_DIR" || exit 1
+W=`cd "$BENCH_DIR" && pwd`
+out=${out:-$W/results.tsv}
+M=$W/manager
+
+echo "=== Budowanie manager i mkfile ($CC $CFLAGS) ===" >&2
+$CC $CFLAGS -o "$W/manager" "$src/manager.c" || exit 1
+$CC -O2 -o "$W/mkfile" "$src/mkfile.c" || exit 1
+
+# Czas w nanosekundach; bez %N (np. na minixie) z dokładnością do sekundy.
+now() {
+    t=`date +%s%N 2>/dev/null`
+    case $t in
+        *N*|"") echo "`date +%s`000000000" ;;
+        *) echo "$t" ;;
+    esac
+}
+
+# elapsed <start> -> sekundy jako liczba zmiennoprzecinkowa
+elapsed() {
+    awk -v a="$1" -v b="`now`" 'BEGIN { printf "%.6f", (b - a) / 1e9 }'
+}
+
+# Najlepszy (najmniejszy) z BENCH_REPEAT czasów polecenia, w sekundach, do
+# zmiennej t. Wywoływane bez `...`, bo exit w podpowłoce nie przerwałby
+# pomiarów - przy błędzie polecenia zwraca 1, a wywołujący kończy skrypt.
+best() {
+    t=""
+    i=0
+    while [ $i -lt "$BENCH_REPEAT" ]; do
+        [ -n "$setup" ] && eval "$setup"
+        s=`now`
+        eval "$@" >/dev/null 2>&1 || { echo "Błąd: $*" >&2; return 1; }
+        e=`elapsed $s`
+        t=`awk -v a="$t" -v e="$e" 'BEGIN { print (a == "" || e < a) ? e : a }'`
+        i=`expr $i + 1`
+    done
+}
+
+report() {
+    printf '%s\t%s\t%s\t%s\t%s\n' "$1" "$2" "$3" "$4" "$5" >> "$out"
+    printf '  %-8s %-10s %-16s %14s %s\n' "$1" "$2" "$3" "$4" "$5" >&2
+}
+
+rate() {
+    awk -v n="$1" -v t="$2" 'BEGIN { printf "%.2f", (t > 0) ? n / t : 0 }'
+}
+
+# kbRate <KiB> <sekundy> -> MB/s
+kbRate() {
+    awk -v n="$1" -v t="$2" 'BEGIN { printf "%.2f", (t > 0) ? n / 1024 / t : 0 }'
+}
+
+# Losowe dane (dd z /dev/urandom) - mkfile daje same zera, które przy
+# kompresji i dziurach nie mierzą kopiowania danych.
+randomFile() {
+    dd if=/dev/urandom of="$1" bs=1024 count="$2" 2>/dev/null
+}
+
+benchFormat() {
+    echo "=== format: czas create dla rozmiarów $BENCH_FORMAT_SIZES ===" >&2
+    for size in $BENCH_FORMAT_SIZES; do
+        setup="rm -f '$W/fmt.img'"
+        best "'$M' create '$W/fmt.img' $size" || exit 1
+        report format "$size" create_time "$t" s
+    done
+    rm -f "$W/fmt.img"
+}
+
+benchSmall() {
+    n=$BENCH_SMALL_COUNT
+    echo "=== small: $n plików po $BENCH_SMALL_SIZE B (tryb wsadowy) ===" >&2
+    rm -rf "$W/small" && mkdir -p "$W/small"
+    kb=`expr \( $BENCH_SMALL_SIZE + 1023 \) / 1024`
+    i=0
+    : > "$W/small.in"
+    : > "$W/small.out"
+    while [ $i -lt $n ]; do
+        randomFile "$W/small/f$i" $kb
+        echo "copyin $W/small/f$i f$i" >> "$W/small.in"
+        echo "copyout f$i $W/small/o$i" >> "$W/small.out"
+        i=`expr $i + 1`
+    done
+    disk=`expr \( $n \* $kb + 16384 \) \* 2`K
+    setup="rm -f '$W/small.img'; '$M' create '$W/small.img' $disk 4096 `expr $n + 64` >/dev/null"
+    best "'$M' batch '$W/small.img' '$W/small.in'" || exit 1
+    report small "$n" copyin_files `rate $n $t` files/s
+    report small "$n" copyin_tput `kbRate \`expr $n \* $kb\` $t` MB/s
+    setup=""
+    best "'$M' batch '$W/small.img' '$W/small.out'" || exit 1
+    report small "$n" copyout_files `rate $n $t` files/s
+    report small "$n" copyout_tput `kbRate \`expr $n \* $kb\` $t` MB/s
+    cmp -s "$W/small/f0" "$W/small/o0" || { echo "Błąd: small f0 różni się po copyout" >&2; exit 1; }
+    rm -rf "$W/small" "$W/small.img" "$W/small.in" "$W/small.out"
+}
+
+benchLarge() {
+    mb=$BENCH_LARGE_MB
+    echo "=== large: plik $mb MiB (losowy i z samych zer) ===" >&2
+    randomFile "$W/large.rnd" `expr $mb \* 1024`
+    "$W/mkfile" "$W/large.zero" `expr $mb \* 1048576` >/dev/null
+    for kind in rnd zero; do
+        setup="rm -f '$W/large.img'; '$M' create '$W/large.img' `expr $mb \* 2 + 16`M 4096 >/dev/null"
+        best "'$M' copyin '$W/large.img' '$W/large.$kind' big" || exit 1
+        report large "${mb}M_$kind" copyin_tput `rate $mb $t` MB/s
+        setup="rm -f '$W/large.out'"
+        best "'$M' copyout '$W/large.img' big '$W/large.out'" || exit 1
+        report large "${mb}M_$kind" copyout_tput `rate $mb $t` MB/s
+        cmp -s "$W/large.$kind" "$W/large.out" || { echo "Błąd: large.$kind różni się po copyout" >&2; exit 1; }
+    done
+    rm -f "$W/large.rnd" "$W/large.zero" "$W/large.out" "$W/large.img"
+}
+
+# Czas wyszukania pliku po nazwie w katalogu z n plikami: BENCH_LOOKUPS
+# copyout jednoblokowych plików o losowych nazwach w jednym procesie.
+benchLookup() {
+    echo "=== lookup: katalog z $BENCH_LOOKUP_COUNTS plikami ===" >&2
+    randomFile "$W/tiny" 1
+    for n in $BENCH_LOOKUP_COUNTS; do
+        rm -f "$W/lookup.img"
+        "$M" create "$W/lookup.img" `expr $n \* 2 + 4096`K 1024 `expr $n + 16` >/dev/null || exit 1
+        awk -v n=$n -v f="$W/tiny" 'BEGIN { for (i = 0; i < n; i++) print "copyin " f " file" i }' > "$W/lookup.in"
+        "$M" batch "$W/lookup.img" "$W/lookup.in" >/dev/null || exit 1
+        awk -v n=$n -v k=$BENCH_LOOKUPS -v seed=$BENCH_SEED -v o="$W/lookup.out" \
+            'BEGIN { srand(seed); for (i = 0; i < k; i++) print "copyout file" int(rand() * n) " " o }' > "$W/lookup.cmd"
+        setup=""
+        best "'$M' batch '$W/lookup.img' '$W/lookup.cmd'" || exit 1
+        report lookup "$n" lookup_latency `awk -v t=$t -v k=$BENCH_LOOKUPS 'BEGIN { printf "%.2f", t * 1e6 / k }'` us
+    done
+    rm -f "$W/tiny" "$W/lookup.img" "$W/lookup.in" "$W/lookup.cmd" "$W/lookup.out"
+}
+
+# Starzenie: losowe copyin/rm (rozmiary 1 KiB .. 1 MiB) na dysku zapełnionym
+# w ~70%, potem copyin dużego pliku - ile fragmentów dostaje i jak szybko.
+benchAging() {
+    ops=$BENCH_AGING_OPS
+    echo "=== aging: $ops losowych copyin/rm (seed $BENCH_SEED) ===" >&2
+    mkdir -p "$W/aging"
+    for kb in 1 4 16 64 256 1024; do
+        randomFile "$W/aging/s$kb" $kb
+    done
+    randomFile "$W/aging/big" 16384
+    awk -v ops=$ops -v seed=$BENCH_SEED -v d="$W/aging" 'BEGIN {
+        srand(seed)
+        split("1 4 16 64 256 1024", sizes, " ")
+        used = 0; limit = 0.7 * 65536; n = 0
+        for (i = 0; i < ops; i++) {
+            if (n > 0 && (used > limit || rand() < 0.4)) {
+                j = int(rand() * n); n--
+                print "rm a" id[j]; used -= kb[j]
+                id[j] = id[n]; kb[j] = kb[n]
+            } else {
+                s = sizes[int(rand() * 6) + 1]
+                print "copyin " d "/s" s " a" i
+                id[n] = i; kb[n] = s; n++; used += s
+            }
+        }
+    }' > "$W/aging.cmd"
+    rm -f "$W/aging.img"
+    "$M" create "$W/aging.img" 64M 4096 8192 >/dev/null || exit 1
+    s=`now`
+    "$M" batch "$W/aging.img" "$W/aging.cmd" >/dev/null 2>&1 || { echo "Błąd: aging batch" >&2; exit 1; }
+    t=`elapsed $s`
+    report aging "$ops" churn_ops `rate $ops $t` ops/s
+    report aging "$ops" avg_fragments `"$M" ls "$W/aging.img" |
+        awk -F'fragmentsCount=' 'NF > 1 { f += $2; n++ } END { printf "%.2f", n ? f / n : 0 }'` frags/file
+    s=`now`
+    "$M" copyin "$W/aging.img" "$W/aging/big" bigAfterAging >/dev/null || exit 1
+    t=`elapsed $s`
+    report aging "$ops" big_copyin_tput `rate 16 $t` MB/s
+    report aging "$ops" big_fragments `"$M" ls "$W/aging.img" |
+        grep "'bigAfterAging'" | sed 's/.*fragmentsCount=//'` frags
+    rm -rf "$W/aging" "$W/aging.img" "$W/aging.cmd"
+}
+
+printf '# workload\tparam\tmetric\tvalue\tunit\n' > "$out"
+for w in $workloads; do
+    case $w in
+        format) benchFormat ;;
+        small) benchSmall ;;
+        large) benchLarge ;;
+        lookup) benchLookup ;;
+        aging) benchAging ;;
+        *) echo "Nieznane obciążenie: $w" >&2; exit 1 ;;
+    esac
+done
+echo "Wyniki zapisane w $out" >&2
+
+[ -z "$baseline" ] && exit 0
+
+# Porównanie z bazą: dla s, us i frag mniej znaczy lepiej, dla reszty więcej.
+echo "=== Porównanie z $baseline (próg ${threshold}%) ===" >&2
+awk -F'\t' -v thr="$threshold" '
+    /^#/ { next }
+    NR == FNR { base[$1 FS $2 FS $3] = $4; next }
+    {
+        key = $1 FS $2 FS $3
+        if (!(key in base) || base[key] == 0) { printf "  %-8s %-10s %-16s %14s (brak w bazie)\n", $1, $2, $3, $4; next }
+        change = ($4 - base[key]) * 100 / base[key]
+        worse = ($5 == "s" || $5 == "us" || $5 ~ /^frags/) ? change : -change
+        mark = ""
+        if (worse > thr) { mark = "  REGRESJA"; bad++ }
+        else if (worse < -thr) mark = "  poprawa"
+        printf "  %-8s %-10s %-16s %14s -> %-14s %+7.1f%%%s\n", $1, $2, $3, base[key], $4, change, mark
+    }
+    END { exit bad ? 2 : 0 }
+' "$baseline" "$out" >&2
@@ -0,0 +1,104 @@
+#!/bin/sh
+#
+# Test odtwarzania dziennika: buduje manager z -DMYFS_CRASH_TEST i zabija go
+# (SIGKILL) po utrwaleniu N-tej transakcji w dzienniku, a przed zapisem
+# metadanych na miejsce (MYFS_CRASH_AFTER_LOG=N). Następne polecenie musi
+# odtworzyć transakcję, fsck nie może znaleźć problemów, a pliki muszą mieć
+# zawartość sprzed awarii albo po zakończonej transakcji.
+#
+# Użycie: ./crashtest.sh
+# Każdy przypadek idzie raz przez pread/pwrite i raz z --mmap. Katalog
+# roboczy: CRASH_DIR (domyślnie crash.out).
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2 -pthread}
+CRASH_DIR=${CRASH_DIR:-crash.out}
+
+src=`cd "\`dirname "$0"\`" && pwd`
+mkdir -p "$CRASH_DIR" || exit 1
+W=`cd "$CRASH_DIR" && pwd`
+img=$W/crash.img
+
+echo "=== Budowanie manager ($CC $CFLAGS -DMYFS_CRASH_TEST) ===" >&2
+$CC $CFLAGS -DMYFS_CRASH_TEST -o "$W/manager" "$src/manager.c" || exit 1
+
+fail() {
+    echo "BŁĄD ($mode): $*" >&2
+    exit 1
+}
+
+m() {
+    "$W/manager" $mode "$@"
+}
+
+# crash N polecenie [argumenty] - polecenie ma zginąć po N-tej transakcji,
+# a następne otwarcie dysku odtworzyć ją z dziennika.
+crash() {
+    n=$1
+    shift
+    env MYFS_CRASH_AFTER_LOG=$n "$W/manager" $mode "$@" >/dev/null 2>&1
+    [ $? -gt 128 ] || fail "'$*' nie zostało przerwane po transakcji $n"
+    m ls "$img" 2>&1 | grep -q "Odtworzono" || fail "po przerwanym '$*' dziennik nie został odtworzony"
+    m fsck "$img" >/dev/null || fail "fsck po przerwanym '$*'"
+}
+
+# same nazwa plik - plik na dysku ma taką zawartość jak plik lokalny
+same() {
+    m copyout "$img" "$1" "$W/out" >/dev/null && cmp -s "$W/out" "$2" || fail "zła zawartość '$1'"
+}
+
+dd if=/dev/urandom of="$W/a" bs=1000 count=300 2>/dev/null
+dd if=/dev/urandom of="$W/b" bs=1000 count=100 2>/dev/null
+dd if=/dev/urandom of="$W/small" bs=1000 count=3 2>/dev/null
+cat "$W/a" "$W/b" > "$W/ab"
+i=1
+while [ $i -le 400 ]; do
+    echo "copyin $W/small s$i"
+    i=`expr $i + 1`
+done > "$W/batch.txt"
+
+for mode in "" --mmap; do
+    echo "=== Tryb: ${mode:-pread/pwrite} ===" >&2
+    rm -f "$img"
+    m create "$img" 8M >/dev/null || fail "create"
+
+    crash 1 copyin "$img" "$W/a" a
+    same a "$W/a"
+
+    crash 1 append "$img" a "$W/b"
+    same a "$W/ab"
+
+    crash 1 rm "$img" a
+    m ls "$img" | grep -q "nazwa='a'" && fail "plik 'a' nie został usunięty"
+
+    # Wsad zatwierdza zmiany grupami; przerywamy go po drugiej grupie.
+    crash 2 batch "$img" "$W/batch.txt"
+    files=`m ls "$img" | grep -c "nazwa='s"`
+    [ "$files" -gt 0 ] && [ "$files" -lt 400 ] || fail "po przerwanym wsadzie jest $files plików"
+    for name in `m ls "$img" | sed -n "s/.*nazwa='\(s[0-9]*\)'.*/\1/p"`; do
+        same "$name" "$W/small"
+    done
+
+    # rm we wsadzie: zwolnienie bloków musi trafić do tej samej transakcji.
+    echo "rm $name" > "$W/rm.txt"
+    crash 1 batch "$img" "$W/rm.txt"
+    m ls "$img" | grep -q "nazwa='$name'" && fail "plik '$name' nie został usunięty"
+
+    # Defrag: przeniesienie bloków, i-węzeł i zwolnienie starych bloków
+    # trafiają do jednej transakcji, więc pliki są całe po każdej z nich.
+    for name in `m ls "$img" | sed -n "s/.*nazwa='\(s[0-9]*[13579]\)'.*/\1/p"`; do
+        echo "rm $name"
+    done > "$W/holes.txt"
+    echo "copyin $W/a a" >> "$W/holes.txt"
+    m batch "$img" "$W/holes.txt" >/dev/null || fail "przygotowanie defrag"
+    crash 1 defrag "$img"
+    same a "$W/a"
+    crash 1 defrag "$img"
+    same a "$W/a"
+    m defrag "$img" >/dev/null || fail "defrag"
+    same a "$W/a"
+    for name in `m ls "$img" | sed -n "s/.*nazwa='\(s[0-9]*\)'.*/\1/p"`; do
+        same "$name" "$W/small"
+    done
+done
+echo "CRASHTEST OK"
@@ -0,0 +1,79 @@
+/*
+ * libmyfs - dostęp do plików na obrazie dysku bez wywoływania managera.
+ *
+ * Implementacja jest w manager.c; z -DMYFS_LIBRARY plik nie ma main i
+ * można go dołączyć do własnego programu. Wewnętrzne symbole są wtedy
+ * ukryte, a objcopy robi z nich symbole lokalne, żeby nie zderzały się
+ * z nazwami programu:
+ *
+ *     gcc -std=gnu99 -O2 -pthread -DMYFS_LIBRARY -c manager.c -o libmyfs.o
+ *     objcopy --localize-hidden libmyfs.o
+ *
+ * Obraz jest otwierany raz (myfsMount), a metadane trzymane w pamięci aż
+ * do myfsSync/myfsUnmount. Funkcje przy błędzie zwracają -1 (albo NULL)
+ * i ustawiają errno. Uchwyty nie są bezpieczne dla wątków - jeden
+ * montaż powinien być używany przez jeden wątek naraz.
+ */
+#ifndef LIBMYFS_H
+#define LIBMYFS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MYFS_RDONLY 0
+#define MYFS_RDWR 1
+#define MYFS_CREATE 2
+#define MYFS_NAME_LEN 128
+
+#if defined(__GNUC__)
+#define MYFS_API __attribute__((visibility("default")))
+#else
+#define MYFS_API
+#endif
+
+typedef struct MyfsMount MyfsMount;
+typedef struct MyfsFile MyfsFile;
+
+typedef struct {
+    char name[MYFS_NAME_LEN];
+    int inode;
+    int64_t size;
+    int64_t blocks;     /* zajęte bloki danych, bez dziur */
+    int fragments;
+    int compressed;
+} MyfsStat;
+
+/* Otwiera obraz diskFile (MYFS_RDONLY albo MYFS_RDWR). */
+MYFS_API MyfsMount *myfsMount(const char *diskFile, int flags);
+
+/* Zatwierdza zmiany metadanych (jedną transakcją dziennika). */
+MYFS_API int myfsSync(MyfsMount *mount);
+
+/* Zatwierdza zmiany i zamyka obraz; otwarte pliki trzeba zamknąć wcześniej. */
+MYFS_API int myfsUnmount(MyfsMount *mount);
+
+/* Otwiera plik name; z MYFS_CREATE tworzy pusty, jeśli go nie ma. */
+MYFS_API MyfsFile *myfsOpen(MyfsMount *mount, const char *name, int flags);
+
+MYFS_API int myfsClose(MyfsFile *file);
+
+/* Czyta do len bajtów od offset; zwraca liczbę bajtów (0 za końcem pliku). */
+MYFS_API ssize_t myfsPread(MyfsFile *file, void *buf, size_t len, int64_t offset);
+
+/*
+ * Zapisuje len bajtów od offset, w razie potrzeby powiększając plik
+ * (całe bloki między końcem a offset zostają dziurą i czytają się jako
+ * zera). Pliki skompresowane są tylko do odczytu.
+ */
+MYFS_API ssize_t myfsPwrite(MyfsFile *file, const void *buf, size_t len, int64_t offset);
+
+MYFS_API int myfsFstat(MyfsFile *file, MyfsStat *st);
+MYFS_API int myfsStat(MyfsMount *mount, const char *name, MyfsStat *st);
+
+/*
+ * Kolejne pliki katalogu: *cursor zaczyna od 0, zwraca 1 i wypełnia st,
+ * a 0 po ostatnim pliku.
+ */
+MYFS_API int myfsReaddir(MyfsMount *mount, int *cursor, MyfsStat *st);
+
+#endif
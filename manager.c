@@ -1,28 +1,208 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>   
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include "libmyfs.h"
+#if defined(MYFS_CRASH_TEST)
+#include <signal.h>
+#endif
+#if !defined(__minix)
+#include <sys/mman.h>
+#include <pthread.h>
+#define HAVE_MMAP 1
+#define HAVE_PTHREAD 1
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_CRC32C_ARM 1
+#endif
+#if defined(__linux__) && defined(HAVE_MMAP) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#if defined(MYFS_LIBRARY) && defined(__GNUC__)
+/* W bibliotece na zewnątrz widać tylko funkcje z libmyfs.h (MYFS_API). */
+#pragma GCC visibility push(hidden)
+#endif
 
-#define MAGIC_STR "MYFS"
-#define BLOCK_SIZE 512
-#define MAX_INODES 128
+#define MAGIC_STR "MYF2"
+#define LEGACY_MAGIC_STR "MYFS"
+#define FS_VERSION 13
+#define DEFAULT_BLOCK_SIZE 4096
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE (1 << 20)
+#define LEGACY_BLOCK_SIZE 512
+#define DEFAULT_MAX_INODES 65536
+#define MAX_INODE_COUNT (1 << 24)
 #define MAX_FRAGS 16
-#define MAX_NAME_LEN 128
+#define MAX_NAME_LEN MYFS_NAME_LEN
+#define COPY_BUF_SIZE (1 << 20)
+#define COPY_BUF_ALIGN 4096
+#define COPY_JOB_BYTES (8 << 20)
+#define STREAM_MAX_GROW (64 << 20)
+#define COPY_MANY_GROUP 256
+#define MAX_COPY_THREADS 8
+#define IO_QUEUE_DEPTH 32
+#define MAX_IO_QUEUE_DEPTH 256
+#define COMPRESS_CHUNK (64 << 10)
+#define MAX_COMPRESS_CHUNK (1 << 24)
+#define CHUNK_RAW 0x80000000u
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define INODE_COMPRESSED 1
+#define INODE_INLINE 2
 
 
 typedef struct {
-    int startBlock;   
-    int blockCount;   
+    int64_t startBlock;   
+    int64_t blockCount;   
 } Fragment;
 
+/* startBlock fragmentu, który jest dziurą: blockCount bloków samych zer bez miejsca na dysku. */
+#define HOLE_BLOCK -2
+
 typedef struct {
     int isUsed;                            
     char fileName[MAX_NAME_LEN]; 
-    int  fileSize;               
+    int flags;
+    int64_t fileSize;               
     Fragment fragments[MAX_FRAGS];  
     int   fragmentsCount;             
+    int   nextFree;
+    int64_t extentBlock;
 } Inode;
 
+/*
+ * Plik z INODE_INLINE ma dane (fileSize bajtów, najwyżej INLINE_MAX) w
+ * samym i-węźle, w miejscu tablicy fragments, a fragmentsCount == 0.
+ * Nie zajmuje bloków, a odczyt nie wymaga dostępu do obszaru danych.
+ */
+#define INLINE_MAX ((int64_t)sizeof(((Inode *)0)->fragments))
+#define INLINE_DATA(ino) ((char *)(ino)->fragments)
+
+/*
+ * Fragmenty ponad MAX_FRAGS trzymane są w łańcuchu bloków ekstentów
+ * (Inode.extentBlock wskazuje pierwszy). Każdy blok to nagłówek i tyle
+ * struktur Fragment, ile się zmieści; fragmentsCount liczy wszystkie.
+ */
+typedef struct {
+    int64_t next;
+    int32_t count;
+    int32_t reserved;
+} ExtentBlockHeader;
+
+/*
+ * Plik z INODE_COMPRESSED: bloki zawierają nagłówek, tablicę długości
+ * kawałków (uint32, CHUNK_RAW dla kawałka zapisanego bez kompresji) i
+ * kolejne kawałki. Każdy kawałek to chunkSize bajtów pliku (ostatni
+ * krótszy) skompresowane niezależnie, więc można je rozpakowywać w
+ * dowolnej kolejności; fileSize to rozmiar po rozpakowaniu.
+ */
+typedef struct {
+    int32_t chunkSize;
+    int32_t reserved;
+    int64_t chunkCount;
+} CompressedHeader;
+
+/* Fragment i i-węzeł formatu "MYFS": pola 32-bitowe, bez nextFree. */
+typedef struct {
+    int startBlock;   
+    int blockCount;   
+} LegacyFragment;
+
+typedef struct {
+    int isUsed;                            
+    char fileName[MAX_NAME_LEN]; 
+    int  fileSize;               
+    LegacyFragment fragments[MAX_FRAGS];  
+    int   fragmentsCount;             
+} LegacyInode;
+
+/*
+ * Slot tablicy haszującej katalogu (adresowanie otwarte, próbkowanie
+ * liniowe). entry == 0 oznacza pusty slot, DIR_SLOT_DELETED usunięty
+ * wpis, a w pozostałych przypadkach entry - 1 to numer i-węzła.
+ */
+typedef struct {
+    int entry;
+    unsigned int hash;
+} DirSlot;
+
+#define DIR_SLOT_DELETED -1
+#define DIRTY_CHUNK 4096
+#define WAL_MAGIC_STR "WAL1"
+#define WAL_APPLIED 0
+#define WAL_COMMITTED 1
+#define MIN_WAL_SIZE (64 << 10)
+#define MAX_WAL_SIZE (16 << 20)
+#define REF_COUNT_MAX 255
+#define FINGERPRINT_PROBE 8
+#define OWNER_SHARED -2
+
+/*
+ * Superblok: wszystkie przesunięcia i liczniki bloków są 64-bitowe,
+ * rozmiar bloku i liczba i-węzłów są wybierane przy tworzeniu dysku.
+ * I-węzły od inodesInitialized w górę nie były jeszcze używane - na
+ * dysku są zerami i nie należą do listy wolnych.
+ */
+typedef struct {
+    char signature[4];      
+    int  version;
+    int  blockSize;
+    int  inodeCount;
+    int64_t blockCount;    
+    int64_t freeBlocks;    
+    int64_t inodeTableOffset;  
+    int64_t blockBitmapOffset; 
+    int64_t dataOffset;        
+    int64_t freeExtentOffset;
+    int64_t freeExtentCapacity;
+    int64_t freeExtentCount;
+    int64_t dirHashOffset;
+    int  freeExtentValid;
+    int  dirHashSize;
+    int  freeInodeHead;
+    int  inodesInitialized;
+    int64_t walOffset;
+    int64_t walSize;
+    int64_t refCountOffset;
+    int64_t fingerprintOffset;
+    int64_t fingerprintCount;
+    int64_t sharedBlocks;
+    int64_t savedBlocks;
+    int64_t checksumOffset;
+} SuperBlock;
+
+/*
+ * Wpis indeksu odcisków (deduplikacja): skrót zawartości bloku i numer
+ * bloku + 1 (zero oznacza pusty wpis). Indeks jest tylko podpowiedzią -
+ * przed współdzieleniem blok jest zawsze porównywany bajt po bajcie.
+ */
+typedef struct {
+    uint64_t hash;
+    int64_t blockPlusOne;
+} Fingerprint;
+
+/* Format "MYFS": bitmapa z jednym bajtem na blok, bez pola wersji. */
 typedef struct {
     char signature[4];      
     int  blockCount;    
@@ -31,596 +211,5857 @@ typedef struct {
     int  inodeTableOffset;  
     int  blockBitmapOffset; 
     int  dataOffset;        
-} SuperBlock;
+} LegacySuperBlock;
+
+/*
+ * Bitmapa bloków: jeden bit na blok (1 = zajęty), na dysku zajmuje
+ * BITMAP_BYTES bajtów. W pamięci trzymana jako tablica słów 64-bitowych,
+ * bit b leży w słowie b / 64 na pozycji b % 64, co na maszynach
+ * little-endian odpowiada bajtowemu układowi na dysku. Bity za ostatnim
+ * blokiem są zawsze ustawione, więc nigdy nie wyglądają na wolne.
+ */
+#define BITMAP_BYTES(n) (((size_t)(n) + 7) / 8)
+#define BITMAP_WORDS(n) (((size_t)(n) + 63) / 64)
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+/*
+ * Statystyki operacji (--stats, polecenie stats): liczniki wywołań
+ * systemowych wejścia/wyjścia, skoków, bajtów obrazu, przejrzanych bajtów
+ * bitmapy i i-węzłów oraz fragmentów czytanych i zapisywanych plików,
+ * a dla faz histogramy czasów w przedziałach [2^b, 2^(b+1)) ns. Liczniki
+ * są zbierane zawsze (także przez wątki kopiujące), czasy tylko przy
+ * włączonych statystykach.
+ */
+#define STATS_OFF 0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+#define PHASE_LOOKUP 0
+#define PHASE_ALLOC 1
+#define PHASE_TRANSFER 2
+#define PHASE_COMMIT 3
+#define PHASE_COUNT 4
+#define HISTOGRAM_BUCKETS 40
+
+typedef struct {
+    int64_t count;
+    int64_t totalNanos;
+    int64_t maxNanos;
+    int64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+typedef struct {
+    int64_t syscalls;
+    int64_t seeks;
+    int64_t bytesRead;
+    int64_t bytesWritten;
+    int64_t bitmapBytesScanned;
+    int64_t inodesVisited;
+    int64_t files;
+    int64_t fragments;
+    int64_t maxFragments;
+    int64_t nextOffset;
+    Histogram phases[PHASE_COUNT];
+} Stats;
+
+const char *phaseNames[PHASE_COUNT] = { "lookup", "alloc", "transfer", "commit" };
+Stats globalStats;
+int globalStatsFormat = STATS_OFF;
+
+void statAdd(int64_t *counter, int64_t n) {
+#if defined(HAVE_PTHREAD)
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+#else
+    *counter += n;
+#endif
+}
+
+void statMax(int64_t *value, int64_t n) {
+#if defined(HAVE_PTHREAD)
+    int64_t old = __atomic_load_n(value, __ATOMIC_RELAXED);
+    while (n > old && !__atomic_compare_exchange_n(value, &old, n, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+#else
+    if (n > *value) *value = n;
+#endif
+}
+
+/* Dostęp do obrazu; jeżeli nie zaczyna się tam, gdzie skończył poprzedni, liczy się jako skok. */
+void statDiskIo(int write, off_t offset, size_t len) {
+    statAdd(write ? &globalStats.bytesWritten : &globalStats.bytesRead, (int64_t)len);
+#if defined(HAVE_PTHREAD)
+    int64_t previous = __atomic_exchange_n(&globalStats.nextOffset, (int64_t)offset + (int64_t)len, __ATOMIC_RELAXED);
+#else
+    int64_t previous = globalStats.nextOffset;
+    globalStats.nextOffset = (int64_t)offset + (int64_t)len;
+#endif
+    if (previous != (int64_t)offset) statAdd(&globalStats.seeks, 1);
+}
+
+/* Plik przeczytany lub zapisany w count fragmentach. */
+void statFile(int count) {
+    statAdd(&globalStats.files, 1);
+    statAdd(&globalStats.fragments, count);
+    statMax(&globalStats.maxFragments, count);
+}
+
+int64_t nowNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Początek mierzonej fazy; 0, gdy statystyki są wyłączone. */
+int64_t phaseStart(void) {
+    return globalStatsFormat != STATS_OFF ? nowNanos() : 0;
+}
+
+void phaseEnd(int phase, int64_t started) {
+    if (started == 0) return;
+    int64_t nanos = nowNanos() - started;
+    int bucket = nanos > 1 ? 63 - __builtin_clzll((uint64_t)nanos) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS) bucket = HISTOGRAM_BUCKETS - 1;
+    Histogram *h = &globalStats.phases[phase];
+    statAdd(&h->count, 1);
+    statAdd(&h->totalNanos, nanos);
+    statMax(&h->maxNanos, nanos);
+    statAdd(&h->buckets[bucket], 1);
+}
+
+/* Górna granica przedziału histogramu, w którym leży kwantyl q (nie więcej niż maksimum). */
+int64_t histogramQuantile(const Histogram *h, double q) {
+    int64_t rank = (int64_t)(q * h->count + 0.5);
+    int64_t seen = 0;
+    if (rank < 1) rank = 1;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            int64_t upper = (int64_t)2 << b;
+            return upper < h->maxNanos ? upper : h->maxNanos;
+        }
+    }
+    return h->maxNanos;
+}
+
+/* Wypisuje statystyki polecenia command na stderr (tekstowo albo jako jeden obiekt JSON). */
+void printStats(const char *command, int status, int64_t elapsedNanos) {
+    const Stats *s = &globalStats;
+    if (globalStatsFormat == STATS_JSON) {
+        fprintf(stderr, "{\"command\":\"%s\",\"status\":%d,\"elapsedNanos\":%" PRId64 ",\"counters\":{"
+                "\"syscalls\":%" PRId64 ",\"seeks\":%" PRId64 ",\"bytesRead\":%" PRId64 ",\"bytesWritten\":%" PRId64
+                ",\"bitmapBytesScanned\":%" PRId64 ",\"inodesVisited\":%" PRId64 ",\"files\":%" PRId64
+                ",\"fragments\":%" PRId64 ",\"maxFragments\":%" PRId64 "},\"phases\":{",
+                command, status, elapsedNanos, s->syscalls, s->seeks, s->bytesRead, s->bytesWritten,
+                s->bitmapBytesScanned, s->inodesVisited, s->files, s->fragments, s->maxFragments);
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            const Histogram *h = &s->phases[p];
+            fprintf(stderr, "%s\"%s\":{\"count\":%" PRId64 ",\"totalNanos\":%" PRId64 ",\"maxNanos\":%" PRId64
+                    ",\"p50Nanos\":%" PRId64 ",\"p99Nanos\":%" PRId64 ",\"histogram\":[",
+                    p ? "," : "", phaseNames[p], h->count, h->totalNanos, h->maxNanos,
+                    histogramQuantile(h, 0.5), histogramQuantile(h, 0.99));
+            int first = 1;
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                if (h->buckets[b] == 0) continue;
+                fprintf(stderr, "%s[%" PRId64 ",%" PRId64 "]", first ? "" : ",",
+                        b ? (int64_t)1 << b : 0, h->buckets[b]);
+                first = 0;
+            }
+            fprintf(stderr, "]}");
+        }
+        fprintf(stderr, "}}\n");
+        return;
+    }
+    fprintf(stderr, "Statystyki polecenia %s (wynik %d, czas %.3f ms):\n", command, status, elapsedNanos / 1e6);
+    fprintf(stderr, "  wywołania systemowe:      %" PRId64 "\n", s->syscalls);
+    fprintf(stderr, "  skoki w obrazie:          %" PRId64 "\n", s->seeks);
+    fprintf(stderr, "  odczytane bajty obrazu:   %" PRId64 "\n", s->bytesRead);
+    fprintf(stderr, "  zapisane bajty obrazu:    %" PRId64 "\n", s->bytesWritten);
+    fprintf(stderr, "  przejrzane bajty bitmapy: %" PRId64 "\n", s->bitmapBytesScanned);
+    fprintf(stderr, "  odwiedzone i-węzły:       %" PRId64 "\n", s->inodesVisited);
+    fprintf(stderr, "  pliki: %" PRId64 ", fragmentów: %" PRId64 " (średnio %.2f, najwięcej %" PRId64 ")\n",
+            s->files, s->fragments, s->files ? (double)s->fragments / s->files : 0.0, s->maxFragments);
+    fprintf(stderr, "  %-9s %8s %12s %12s %12s %12s %12s\n",
+            "faza", "liczba", "razem [ms]", "średnio [us]", "p50 [us]", "p99 [us]", "max [us]");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        const Histogram *h = &s->phases[p];
+        fprintf(stderr, "  %-9s %8" PRId64 " %12.3f %12.1f %12.1f %12.1f %12.1f\n", phaseNames[p], h->count,
+                h->totalNanos / 1e6, h->count ? h->totalNanos / 1e3 / h->count : 0.0,
+                histogramQuantile(h, 0.5) / 1e3, histogramQuantile(h, 0.99) / 1e3, h->maxNanos / 1e3);
+    }
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        const Histogram *h = &s->phases[p];
+        if (h->count == 0) continue;
+        fprintf(stderr, "  histogram %s:\n", phaseNames[p]);
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            if (h->buckets[b] == 0) continue;
+            int bar = (int)((h->buckets[b] * 40 + h->count - 1) / h->count);
+            fprintf(stderr, "    %10.1f .. %10.1f us %8" PRId64 " %.*s\n", (b ? (int64_t)1 << b : 0) / 1e3,
+                    ((int64_t)2 << b) / 1e3, h->buckets[b], bar, "########################################");
+        }
+    }
+}
 
 
-int readSuperBlock(FILE *fp, SuperBlock *superBlock) {
-    fseek(fp, 0, SEEK_SET);
-    if (fread(superBlock, sizeof(SuperBlock), 1, fp) != 1) {
+int readAt(int fd, void *buf, size_t len, off_t offset) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t r = pread(fd, p, len, offset);
+        statAdd(&globalStats.syscalls, 1);
+        if (r <= 0) return -1;
+        p += r;
+        len -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+int writeAt(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = pwrite(fd, p, len, offset);
+        statAdd(&globalStats.syscalls, 1);
+        if (w <= 0) return -1;
+        p += w;
+        len -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+/*
+ * Kopiuje len bajtów z inFd (od inOffset) do outFd (od outOffset) jak
+ * najmniejszą liczbą wywołań: na Linuksie przez copy_file_range (bez
+ * kopiowania przez przestrzeń użytkownika), a gdy jądro lub system
+ * plików tego nie obsługuje - przez duży wyrównany bufor i pread/pwrite.
+ */
+int copyRange(int inFd, off_t inOffset, int outFd, off_t outOffset, size_t len) {
+#if defined(__linux__)
+    while (len > 0) {
+        ssize_t n = copy_file_range(inFd, &inOffset, outFd, &outOffset, len, 0);
+        statAdd(&globalStats.syscalls, 1);
+        if (n > 0) {
+            len -= n;
+            continue;
+        }
+        if (n == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+            errno != EOPNOTSUPP && errno != EBADF) {
+            return -1;
+        }
+        break;
+    }
+    if (len == 0) return 0;
+#endif
+    size_t bufSize = (len < COPY_BUF_SIZE) ? len : COPY_BUF_SIZE;
+    void *buf = NULL;
+    if (posix_memalign(&buf, COPY_BUF_ALIGN, bufSize) != 0) return -1;
+    int rc = 0;
+    while (len > 0) {
+        size_t chunk = (len < bufSize) ? len : bufSize;
+        if (readAt(inFd, buf, chunk, inOffset) < 0 ||
+            writeAt(outFd, buf, chunk, outOffset) < 0) {
+            rc = -1;
+            break;
+        }
+        inOffset += chunk;
+        outOffset += chunk;
+        len -= chunk;
+    }
+    free(buf);
+    return rc;
+}
+
+int readSuperBlock(int fd, SuperBlock *superBlock) {
+    if (readAt(fd, superBlock, sizeof(SuperBlock), 0) < 0) {
+        return -1;
+    }
+    if (memcmp(superBlock->signature, LEGACY_MAGIC_STR, 4) == 0) {
+        fprintf(stderr, "Dysk w starym formacie (bitmapa bajtowa), użyj polecenia 'upgrade'.\n");
         return -1;
     }
     if (memcmp(superBlock->signature, MAGIC_STR, 4) != 0) {
-        fprintf(stderr, "Błędna sygnatura superbloku (nie 'MYFS').\n");
+        fprintf(stderr, "Błędna sygnatura superbloku (nie '%s').\n", MAGIC_STR);
+        return -1;
+    }
+    if (superBlock->version != FS_VERSION) {
+        fprintf(stderr, "Nieobsługiwana wersja formatu dysku: %d.\n", superBlock->version);
         return -1;
     }
     return 0;
 }
 
-int writeSuperBlock(FILE *fp, const SuperBlock *superBlock) {
-    fseek(fp, 0, SEEK_SET);
-    if (fwrite(superBlock, sizeof(SuperBlock), 1, fp) != 1) {
-        return -1;
+unsigned int hashName(const char *name) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < MAX_NAME_LEN && name[i]; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* FNV-1a 64-bitowy po dowolnych bajtach (suma kontrolna dziennika). */
+uint64_t checksum64(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * Skrót zawartości bloku do deduplikacji: cztery niezależne tory po 8
+ * bajtów (jak w xxHash64), które procesor liczy równolegle, a kompilator
+ * może zwektoryzować. Długość bloku jest zawsze wielokrotnością 32.
+ */
+uint64_t blockHash64(const void *data, size_t len) {
+    const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    const unsigned char *p = data;
+    uint64_t lane[4] = { prime1 + prime2, prime2, 0, 0 - prime1 };
+    for (size_t i = 0; i + 32 <= len; i += 32) {
+        for (int k = 0; k < 4; k++) {
+            uint64_t word;
+            memcpy(&word, p + i + 8 * k, 8);
+            lane[k] = rotl64(lane[k] + word * prime2, 31) * prime1;
+        }
+    }
+    uint64_t h = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18);
+    h ^= len;
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime1;
+    return h ^ (h >> 32);
+}
+
+/*
+ * CRC32C (Castagnoli) każdego bloku danych. Sprzętowo (SSE4.2 albo
+ * rozszerzenie CRC ARMv8) trzy bloki naraz, bo instrukcja crc32 ma
+ * opóźnienie 3 cykli, a niezależne strumienie się przeplatają;
+ * programowo - tablice slicing-by-8.
+ */
+uint32_t crc32cTable[8][256];
+int crc32cHardware = 0;
+
+void initCrc32c(void) {
+    if (crc32cTable[0][1] != 0) return;
+    for (int b = 0; b < 256; b++) {
+        uint32_t c = b;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+        }
+        crc32cTable[0][b] = c;
+    }
+    for (int b = 0; b < 256; b++) {
+        for (int t = 1; t < 8; t++) {
+            crc32cTable[t][b] = (crc32cTable[t - 1][b] >> 8) ^ crc32cTable[0][crc32cTable[t - 1][b] & 0xff];
+        }
+    }
+#if defined(HAVE_CRC32C_SSE42)
+    crc32cHardware = __builtin_cpu_supports("sse4.2");
+#elif defined(HAVE_CRC32C_ARM)
+    crc32cHardware = 1;
+#endif
+}
+
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc32cTable[7][lo & 0xff] ^ crc32cTable[6][(lo >> 8) & 0xff] ^
+              crc32cTable[5][(lo >> 16) & 0xff] ^ crc32cTable[4][lo >> 24] ^
+              crc32cTable[3][hi & 0xff] ^ crc32cTable[2][(hi >> 8) & 0xff] ^
+              crc32cTable[1][(hi >> 16) & 0xff] ^ crc32cTable[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(HAVE_CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+#endif
+uint32_t crc32cWords(uint32_t crc, const unsigned char *p, size_t len) {
+#if defined(HAVE_CRC32C_SSE42) || defined(HAVE_CRC32C_ARM)
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+#if defined(HAVE_CRC32C_SSE42)
+        c = _mm_crc32_u64(c, word);
+#else
+        c = __crc32cd((uint32_t)c, word);
+#endif
+    }
+    return crc32cSoftware((uint32_t)c, p, len);
+#else
+    return crc32cSoftware(crc, p, len);
+#endif
+}
+
+/* Trzy niezależne CRC po len bajtów (len podzielne przez 8) liczone na przemian. */
+#if defined(HAVE_CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+#endif
+void crc32cTriple(const unsigned char *a, const unsigned char *b, const unsigned char *c,
+                  size_t len, uint32_t *out) {
+#if defined(HAVE_CRC32C_SSE42) || defined(HAVE_CRC32C_ARM)
+    uint64_t ca = ~0u, cb = ~0u, cc = ~0u;
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t wa, wb, wc;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        memcpy(&wc, c + i, 8);
+#if defined(HAVE_CRC32C_SSE42)
+        ca = _mm_crc32_u64(ca, wa);
+        cb = _mm_crc32_u64(cb, wb);
+        cc = _mm_crc32_u64(cc, wc);
+#else
+        ca = __crc32cd((uint32_t)ca, wa);
+        cb = __crc32cd((uint32_t)cb, wb);
+        cc = __crc32cd((uint32_t)cc, wc);
+#endif
+    }
+    out[0] = ~(uint32_t)ca;
+    out[1] = ~(uint32_t)cb;
+    out[2] = ~(uint32_t)cc;
+#else
+    out[0] = ~crc32cSoftware(~0u, a, len);
+    out[1] = ~crc32cSoftware(~0u, b, len);
+    out[2] = ~crc32cSoftware(~0u, c, len);
+#endif
+}
+
+uint32_t crc32cUpdate(uint32_t crc, const void *data, size_t len) {
+    return crc32cHardware ? crc32cWords(crc, data, len) : crc32cSoftware(crc, data, len);
+}
+
+/*
+ * Sumy kontrolne kolejnych bloków z data (len bajtów); ostatni
+ * niepełny blok liczony jest tak, jakby był dopełniony zerami.
+ */
+void blockChecksums(const char *data, size_t len, int blockSize, uint32_t *out) {
+    static const unsigned char zeros[4096];
+    size_t full = len / blockSize, n = 0;
+    for (; crc32cHardware && n + 3 <= full; n += 3) {
+        const unsigned char *p = (const unsigned char *)data + n * blockSize;
+        crc32cTriple(p, p + blockSize, p + 2 * (size_t)blockSize, blockSize, &out[n]);
+    }
+    for (; n < full; n++) {
+        out[n] = ~crc32cUpdate(~0u, data + n * blockSize, blockSize);
+    }
+    if (len > full * blockSize) {
+        size_t tail = len - full * blockSize;
+        uint32_t crc = crc32cUpdate(~0u, data + full * blockSize, tail);
+        for (size_t pad = blockSize - tail; pad > 0; ) {
+            size_t k = pad < sizeof(zeros) ? pad : sizeof(zeros);
+            crc = crc32cUpdate(crc, zeros, k);
+            pad -= k;
+        }
+        out[full] = ~crc;
+    }
+}
+
+/* Najmniejsza potęga dwójki nie mniejsza niż 2 * inodeCount. */
+int dirHashSizeFor(int inodeCount) {
+    int size = 1;
+    while (size < 2 * inodeCount) size *= 2;
+    return size;
+}
+
+uint64_t *allocBlockMap(const SuperBlock *superBlock) {
+    return calloc(BITMAP_WORDS(superBlock->blockCount), sizeof(uint64_t));
+}
+
+void setBlockMapTail(uint64_t *blockMap, int64_t blockCount) {
+    size_t words = BITMAP_WORDS(blockCount);
+    if (blockCount % 64 != 0) {
+        blockMap[words - 1] |= ~0ULL << (blockCount % 64);
+    }
+}
+
+int isBlockUsed(const uint64_t *blockMap, int64_t block) {
+    return (blockMap[block / 64] >> (block % 64)) & 1;
+}
+
+void markBlocks(uint64_t *blockMap, int64_t start, int64_t count, int used) {
+    while (count > 0) {
+        int bit = (int)(start % 64);
+        int n = 64 - bit;
+        if (n > count) n = count;
+        uint64_t mask = (n == 64) ? ~0ULL : (((1ULL << n) - 1) << bit);
+        if (used) {
+            blockMap[start / 64] |= mask;
+        } else {
+            blockMap[start / 64] &= ~mask;
+        }
+        start += n;
+        count -= n;
+    }
+}
+
+/* Pomija słowa w całości zajęte (same jedynki), zwraca indeks pierwszego innego. */
+size_t skipFullWords(const uint64_t *blockMap, size_t w, size_t words) {
+#if defined(__SSE2__)
+    const __m128i ones = _mm_set1_epi32(-1);
+    while (w + 2 <= words) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(blockMap + w));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xFFFF) break;
+        w += 2;
+    }
+#endif
+    while (w < words && blockMap[w] == ~0ULL) {
+        w++;
+    }
+    return w;
+}
+
+/* Czy len bajtów od data to same zera; sprawdza po 64 bajty, więc dane niezerowe odpadają od razu. */
+int isZeroBlock(const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= len; i += 64) {
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)),
+                                              _mm_loadu_si128((const __m128i *)(p + i + 16))),
+                                 _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)),
+                                              _mm_loadu_si128((const __m128i *)(p + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) return 0;
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        if (word != 0) return 0;
+    }
+    for (; i < len; i++) {
+        if (p[i] != 0) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Szuka pierwszego ciągu wolnych bloków zaczynającego się od bloku >= from.
+ * Zwraca numer pierwszego bloku ciągu i jego długość w *runLength
+ * albo -1, gdy za from nie ma już wolnych bloków.
+ */
+int64_t findFreeRun(const uint64_t *blockMap, int64_t blockCount, int64_t from, int64_t *runLength) {
+    size_t words = BITMAP_WORDS(blockCount);
+    if (from >= blockCount) return -1;
+    size_t w = from / 64;
+    uint64_t freeBits = ~blockMap[w] & (~0ULL << (from % 64));
+    while (freeBits == 0) {
+        w = skipFullWords(blockMap, w + 1, words);
+        if (w >= words) {
+            statAdd(&globalStats.bitmapBytesScanned, (int64_t)(words - from / 64) * 8);
+            return -1;
+        }
+        freeBits = ~blockMap[w];
+    }
+    int64_t start = (int64_t)(w * 64) + __builtin_ctzll(freeBits);
+
+    uint64_t usedBits = blockMap[w] & (~0ULL << (start % 64));
+    while (usedBits == 0) {
+        w++;
+        if (w >= words) break;
+        usedBits = blockMap[w];
+    }
+    int64_t end = (w >= words) ? blockCount : (int64_t)(w * 64) + __builtin_ctzll(usedBits);
+    if (end > blockCount) end = blockCount;
+    statAdd(&globalStats.bitmapBytesScanned, (int64_t)((w < words ? w + 1 : words) - from / 64) * 8);
+    *runLength = end - start;
+    return start;
+}
+
+/*
+ * Indeks wolnych ekstentów: te same ciągi wolnych bloków co w bitmapie,
+ * trzymane w dwóch tablicach posortowanych po początku (do scalania
+ * sąsiadów) i po (długości, początku) (do best-fit). Na dysku zapisywana
+ * jest tylko tablica po początku. Gdy ekstentów jest więcej niż miejsca
+ * w indeksie, superblok oznacza go jako nieważny i przy następnym
+ * otwarciu indeks jest odbudowywany z bitmapy. Wyszukiwanie jest
+ * binarne, ale wstawianie i usuwanie przesuwa ogon tablicy (memmove,
+ * O(n)) - w zamian tablica po początku trafia na dysk bez przekładania,
+ * a commit zapisuje tylko jej ogon od dirtyFrom.
+ */
+typedef struct {
+    Fragment *byOffset;
+    Fragment *byLength;
+    int count;
+    int capacity;
+    int dirtyFrom;
+} FreeExtents;
+
+int compareByOffset(const void *a, const void *b) {
+    const Fragment *x = a, *y = b;
+    return (x->startBlock > y->startBlock) - (x->startBlock < y->startBlock);
+}
+
+int compareByLength(const void *a, const void *b) {
+    const Fragment *x = a, *y = b;
+    if (x->blockCount != y->blockCount) {
+        return (x->blockCount > y->blockCount) - (x->blockCount < y->blockCount);
+    }
+    return compareByOffset(a, b);
+}
+
+/* Pierwsza pozycja w tablicy, której element nie jest mniejszy od key. */
+int lowerBound(const Fragment *arr, int count, const Fragment *key,
+               int (*cmp)(const void *, const void *)) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cmp(&arr[mid], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int reserveFreeExtents(FreeExtents *fe, int needed) {
+    if (needed <= fe->capacity) return 0;
+    int cap = fe->capacity ? fe->capacity : 64;
+    while (cap < needed) cap *= 2;
+    Fragment *o = realloc(fe->byOffset, cap * sizeof(Fragment));
+    if (!o) return -1;
+    fe->byOffset = o;
+    Fragment *l = realloc(fe->byLength, cap * sizeof(Fragment));
+    if (!l) return -1;
+    fe->byLength = l;
+    fe->capacity = cap;
+    return 0;
+}
+
+void freeFreeExtents(FreeExtents *fe) {
+    free(fe->byOffset);
+    free(fe->byLength);
+    memset(fe, 0, sizeof(*fe));
+}
+
+/* Wstawianie/usuwanie z zachowaniem porządku; zwracają pozycję zmiany (-1, gdy nie ma czego usunąć). */
+int insertSorted(Fragment *arr, int count, Fragment ext,
+                 int (*cmp)(const void *, const void *)) {
+    int pos = lowerBound(arr, count, &ext, cmp);
+    memmove(&arr[pos + 1], &arr[pos], (count - pos) * sizeof(Fragment));
+    arr[pos] = ext;
+    return pos;
+}
+
+int removeSorted(Fragment *arr, int count, Fragment ext,
+                 int (*cmp)(const void *, const void *)) {
+    int pos = lowerBound(arr, count, &ext, cmp);
+    if (pos == count || cmp(&arr[pos], &ext) != 0) return -1;
+    memmove(&arr[pos], &arr[pos + 1], (count - pos - 1) * sizeof(Fragment));
+    return pos;
+}
+
+/*
+ * dirtyFrom to najmniejsza pozycja w byOffset zmieniona od ostatniego
+ * zapisu - dalsze elementy mogły się przesunąć, więc zapisywany jest
+ * tylko ogon tablicy od tej pozycji.
+ */
+int addFreeExtent(FreeExtents *fe, Fragment ext) {
+    if (reserveFreeExtents(fe, fe->count + 1) < 0) return -1;
+    int pos = insertSorted(fe->byOffset, fe->count, ext, compareByOffset);
+    if (pos < fe->dirtyFrom) fe->dirtyFrom = pos;
+    insertSorted(fe->byLength, fe->count, ext, compareByLength);
+    fe->count++;
+    return 0;
+}
+
+/* Usuwa ekstent z obu tablic; -1, gdy go w nich nie ma (indeks jest wtedy niespójny). */
+int dropFreeExtent(FreeExtents *fe, Fragment ext) {
+    int pos = removeSorted(fe->byOffset, fe->count, ext, compareByOffset);
+    if (pos < 0) return -1;
+    if (pos < fe->dirtyFrom) fe->dirtyFrom = pos;
+    if (removeSorted(fe->byLength, fe->count, ext, compareByLength) < 0) return -1;
+    fe->count--;
+    return 0;
+}
+
+int buildFreeExtents(const uint64_t *blockMap, const SuperBlock *superBlock, FreeExtents *fe) {
+    fe->count = 0;
+    fe->dirtyFrom = 0;
+    int64_t b = 0, length = 0;
+    while ((b = findFreeRun(blockMap, superBlock->blockCount, b, &length)) >= 0) {
+        if (reserveFreeExtents(fe, fe->count + 1) < 0) return -1;
+        fe->byOffset[fe->count].startBlock = b;
+        fe->byOffset[fe->count].blockCount = length;
+        fe->count++;
+        b += length;
     }
+    memcpy(fe->byLength, fe->byOffset, fe->count * sizeof(Fragment));
+    qsort(fe->byLength, fe->count, sizeof(Fragment), compareByLength);
     return 0;
 }
 
-int readInode(FILE *fp, const SuperBlock *superBlock, int index, Inode *ino) {
-    if (index < 0 || index >= superBlock->inodeCount) return -1;
-    long offset = superBlock->inodeTableOffset + (long)index * sizeof(Inode);
-    fseek(fp, offset, SEEK_SET);
-    if (fread(ino, sizeof(Inode), 1, fp) != 1) {
-        return -1;
+/* Zajmuje bloki [start, start+count), które muszą leżeć w jednym wolnym ekstencie. */
+int takeFreeExtent(FreeExtents *fe, int64_t start, int64_t count) {
+    Fragment key = { start, 0 };
+    int pos = lowerBound(fe->byOffset, fe->count, &key, compareByOffset);
+    if (pos == fe->count || fe->byOffset[pos].startBlock > start) pos--;
+    if (pos < 0) return -1;
+    Fragment ext = fe->byOffset[pos];
+    if (start + count > ext.startBlock + ext.blockCount || dropFreeExtent(fe, ext) < 0) return -1;
+    if (start > ext.startBlock) {
+        Fragment before = { ext.startBlock, start - ext.startBlock };
+        if (addFreeExtent(fe, before) < 0) return -1;
+    }
+    if (start + count < ext.startBlock + ext.blockCount) {
+        Fragment after = { start + count, ext.startBlock + ext.blockCount - start - count };
+        if (addFreeExtent(fe, after) < 0) return -1;
     }
     return 0;
 }
 
-int writeInode(FILE *fp, const SuperBlock *superBlock, int index, const Inode *ino) {
-    if (index < 0 || index >= superBlock->inodeCount) return -1;
-    long offset = superBlock->inodeTableOffset + (long)index * sizeof(Inode);
-    fseek(fp, offset, SEEK_SET);
-    if (fwrite(ino, sizeof(Inode), 1, fp) != 1) {
+/* Zwalnia bloki [start, start+count), scalając je z wolnymi sąsiadami. */
+int releaseFreeExtent(FreeExtents *fe, int64_t start, int64_t count) {
+    Fragment merged = { start, count };
+    int pos = lowerBound(fe->byOffset, fe->count, &merged, compareByOffset);
+    if (pos < fe->count && fe->byOffset[pos].startBlock == start + count) {
+        Fragment next = fe->byOffset[pos];
+        merged.blockCount += next.blockCount;
+        if (dropFreeExtent(fe, next) < 0) return -1;
+    }
+    if (pos > 0) {
+        Fragment prev = fe->byOffset[pos - 1];
+        if (prev.startBlock + prev.blockCount == start) {
+            merged.startBlock = prev.startBlock;
+            merged.blockCount += prev.blockCount;
+            if (dropFreeExtent(fe, prev) < 0) return -1;
+        }
+    }
+    return addFreeExtent(fe, merged);
+}
+
+/* Znaczniki zmienionych kawałków (po DIRTY_CHUNK bajtów) obszaru metadanych. */
+typedef struct {
+    unsigned char *chunks;
+    size_t chunkCount;
+    size_t regionBytes;
+    size_t dirtyCount;
+    int any;
+} DirtyMap;
+
+int initDirtyMap(DirtyMap *dm, size_t regionBytes) {
+    dm->regionBytes = regionBytes;
+    dm->chunkCount = (regionBytes + DIRTY_CHUNK - 1) / DIRTY_CHUNK;
+    dm->chunks = calloc(dm->chunkCount + 1, 1);
+    dm->dirtyCount = 0;
+    dm->any = 0;
+    return dm->chunks ? 0 : -1;
+}
+
+/* Zaznacza bajty [offset, offset+len) obszaru jako zmienione. */
+void markDirtyRange(DirtyMap *dm, size_t offset, size_t len) {
+    if (!dm->chunks || len == 0) return;
+    size_t last = (offset + len - 1) / DIRTY_CHUNK;
+    for (size_t c = offset / DIRTY_CHUNK; c <= last && c < dm->chunkCount; c++) {
+        if (!dm->chunks[c]) dm->dirtyCount++;
+        dm->chunks[c] = 1;
+    }
+    dm->any = 1;
+}
+
+/* Zeruje znaczniki po udanym zapisie. */
+void clearDirtyMap(DirtyMap *dm) {
+    if (dm->chunks && dm->any) memset(dm->chunks, 0, dm->chunkCount);
+    dm->dirtyCount = 0;
+    dm->any = 0;
+}
+
+/*
+ * Otwarty dysk z metadanymi w pamięci. openDisk wczytuje superblok,
+ * tablicę i-węzłów i indeks katalogu (a z DISK_BLOCKMAP także bitmapę
+ * i indeks ekstentów) jednym odczytem każde. Polecenia pracują na tej
+ * kopii, a commitDisk zapisuje z powrotem tylko zmienione części:
+ * ciągi brudnych i-węzłów, a z indeksu katalogu i bitmapy tylko
+ * zmienione kawałki po DIRTY_CHUNK bajtów. refCounts (liczba
+ * dodatkowych odwołań do każdego bloku) jest wczytywane, gdy na dysku
+ * są współdzielone bloki, a indeks odcisków tylko przy --dedup.
+ */
+typedef struct {
+    int fd;
+    int flags;
+    SuperBlock superBlock;
+    unsigned char *map;
+    size_t mapSize;
+    size_t mapWritable;
+    Inode *inodes;
+    unsigned char *inodeDirty;
+    int dirtyInodes;
+    DirSlot *dirHash;
+    uint64_t *blockMap;
+    FreeExtents freeExtents;
+    unsigned char *refCounts;
+    Fingerprint *fingerprints;
+    DirtyMap dirHashChunks;
+    DirtyMap blockMapChunks;
+    DirtyMap refCountChunks;
+    DirtyMap fingerprintChunks;
+    int superBlockDirty;
+    int blockMapDirty;
+} Disk;
+
+/* markBlocks na bitmapie dysku, z zaznaczeniem zmienionego kawałka do zapisu. */
+void markDiskBlocks(Disk *disk, int64_t start, int64_t count, int used) {
+    markBlocks(disk->blockMap, start, count, used);
+    markDirtyRange(&disk->blockMapChunks, (size_t)(start / 64) * 8,
+                   (size_t)((start + count + 63) / 64 - start / 64) * 8);
+    disk->blockMapDirty = 1;
+}
+
+int allocDirtyMaps(Disk *disk) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    if (initDirtyMap(&disk->dirHashChunks, superBlock->dirHashSize * sizeof(DirSlot)) < 0 ||
+        initDirtyMap(&disk->refCountChunks, superBlock->blockCount) < 0 ||
+        initDirtyMap(&disk->fingerprintChunks, superBlock->fingerprintCount * sizeof(Fingerprint)) < 0) {
         return -1;
     }
+    return initDirtyMap(&disk->blockMapChunks, BITMAP_BYTES(superBlock->blockCount));
+}
+
+#define DISK_WRITABLE 1
+#define DISK_BLOCKMAP 2
+#define DISK_MMAP 4
+#define DISK_DEDUP 8
+#define DISK_COMPRESS 16
+/* Bez DISK_BLOCKMAP: tylko indeks wolnych ekstentów (bitmapa, gdy indeks jest nieważny). */
+#define DISK_FREE_INDEX 32
+
+/* Dodatkowe flagi dla openDisk ustawiane opcjami globalnymi (np. --mmap). */
+int globalDiskFlags = 0;
+
+/* Liczba operacji kopiowania w locie naraz (--queue-depth=N). */
+int globalQueueDepth = IO_QUEUE_DEPTH;
+
+off_t getBlockOffset(const SuperBlock *superBlock, int64_t blockNum) {
+    return superBlock->dataOffset + (off_t)blockNum * superBlock->blockSize;
+}
+
+int64_t blockAtOffset(const SuperBlock *superBlock, off_t offset) {
+    return (offset - superBlock->dataOffset) / superBlock->blockSize;
+}
+
+/*
+ * Zwraca adres [offset, offset+len) w mapowaniu, jeżeli można tam pisać
+ * bezpośrednio (tylko obszar danych), a NULL, gdy trzeba użyć pwrite.
+ */
+unsigned char *mappedForWrite(const Disk *disk, off_t offset, size_t len) {
+    if (!disk->map || (size_t)offset < disk->mapWritable || (size_t)offset + len > disk->mapSize) {
+        return NULL;
+    }
+    return disk->map + offset;
+}
+
+/*
+ * Odczyt/zapis obrazu: przy zmapowanym obrazie odczyt to memcpy
+ * z mapowania, a zapis idzie przez mapowanie tylko w obszarze danych -
+ * metadane zawsze przez pwrite, w kolejności wyznaczonej przez dziennik.
+ */
+int diskRead(const Disk *disk, void *buf, size_t len, off_t offset) {
+    statDiskIo(0, offset, len);
+    if (disk->map) {
+        if ((size_t)offset + len > disk->mapSize) return -1;
+        memcpy(buf, disk->map + offset, len);
+        return 0;
+    }
+    return readAt(disk->fd, buf, len, offset);
+}
+
+int diskWrite(Disk *disk, const void *buf, size_t len, off_t offset) {
+    statDiskIo(1, offset, len);
+    unsigned char *dst = mappedForWrite(disk, offset, len);
+    if (dst) {
+        memmove(dst, buf, len);
+        return 0;
+    }
+    return writeAt(disk->fd, buf, len, offset);
+}
+
+/* Wymusza zapis wszystkiego, co dotąd trafiło do obrazu. */
+int syncDisk(Disk *disk) {
+#if defined(HAVE_MMAP)
+    if (disk->map) {
+        statAdd(&globalStats.syscalls, 1);
+        if (msync(disk->map, disk->mapSize, MS_SYNC) < 0) return -1;
+    }
+#endif
+    statAdd(&globalStats.syscalls, 1);
+    return fsync(disk->fd);
+}
+
+/*
+ * Tablica sum kontrolnych (uint32 CRC32C na blok, pod checksumOffset)
+ * jest zapisywana razem z danymi, przed zatwierdzeniem metadanych. Suma
+ * wolnego bloku nie ma znaczenia, więc nie potrzebuje dziennika.
+ */
+int storeChecksums(Disk *disk, int64_t firstBlock, const char *data, size_t len) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    size_t count = (len + superBlock->blockSize - 1) / superBlock->blockSize;
+    uint32_t local[256];
+    uint32_t *sums = count <= 256 ? local : malloc(count * sizeof(uint32_t));
+    if (!sums) return -1;
+    blockChecksums(data, len, superBlock->blockSize, sums);
+    int rc = diskWrite(disk, sums, count * sizeof(uint32_t),
+                       superBlock->checksumOffset + firstBlock * (off_t)sizeof(uint32_t));
+    if (sums != local) free(sums);
+    return rc;
+}
+
+/*
+ * Porównuje pełne bloki data (len podzielne przez rozmiar bloku,
+ * zaczynając od firstBlock) z zapisanymi sumami. Zwraca numer
+ * pierwszego niezgodnego bloku, -1 gdy wszystkie są dobre, -2 przy
+ * błędzie odczytu.
+ */
+int64_t findBadBlock(const Disk *disk, int64_t firstBlock, const char *data, size_t len) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    size_t count = len / superBlock->blockSize;
+    uint32_t local[2 * 256];
+    uint32_t *sums = count <= 256 ? local : malloc(2 * count * sizeof(uint32_t));
+    if (!sums) return -2;
+    int64_t bad = -1;
+    if (diskRead(disk, sums, count * sizeof(uint32_t),
+                 superBlock->checksumOffset + firstBlock * (off_t)sizeof(uint32_t)) < 0) {
+        bad = -2;
+    } else {
+        blockChecksums(data, len, superBlock->blockSize, sums + count);
+        for (size_t n = 0; n < count; n++) {
+            if (sums[n] != sums[count + n]) {
+                bad = firstBlock + n;
+                break;
+            }
+        }
+    }
+    if (sums != local) free(sums);
+    return bad;
+}
+
+int verifyChecksums(const Disk *disk, int64_t firstBlock, const char *data, size_t len) {
+    int64_t bad = findBadBlock(disk, firstBlock, data, len);
+    if (bad >= 0) {
+        fprintf(stderr, "Błąd sumy kontrolnej bloku %" PRId64 " - dane są uszkodzone.\n", bad);
+    }
+    return bad == -1 ? 0 : -1;
+}
+
+/* Zapisuje dane od początku bloku firstBlock, dopełnia ostatni blok zerami i zapisuje sumy. */
+int writeDataBlocks(Disk *disk, int64_t firstBlock, const char *data, size_t len) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    off_t offset = getBlockOffset(superBlock, firstBlock);
+    size_t pad = (superBlock->blockSize - len % superBlock->blockSize) % superBlock->blockSize;
+    if (diskWrite(disk, data, len, offset) < 0) return -1;
+    if (pad > 0) {
+        char *zeros = calloc(1, pad);
+        int rc = zeros ? diskWrite(disk, zeros, pad, offset + len) : -1;
+        free(zeros);
+        if (rc < 0) return -1;
+    }
+    return storeChecksums(disk, firstBlock, data, len);
+}
+
+/* Przelicza sumy kontrolnych count bloków od firstBlock z ich obecnej zawartości. */
+int rechecksumBlocks(Disk *disk, int64_t firstBlock, int64_t count) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int64_t perBuffer = COPY_BUF_SIZE / superBlock->blockSize > 0 ? COPY_BUF_SIZE / superBlock->blockSize : 1;
+    char *buf = malloc(perBuffer * superBlock->blockSize);
+    int rc = buf ? 0 : -1;
+    for (int64_t done = 0; rc == 0 && done < count; done += perBuffer) {
+        size_t len = (size_t)((count - done < perBuffer) ? count - done : perBuffer) * superBlock->blockSize;
+        rc = diskRead(disk, buf, len, getBlockOffset(superBlock, firstBlock + done));
+        if (rc == 0) rc = storeChecksums(disk, firstBlock + done, buf, len);
+    }
+    free(buf);
+    return rc;
+}
+
+/*
+ * Kopiuje len bajtów z pliku srcFd do obrazu od początku bloku pod
+ * diskOffset, dopełniając ostatni blok zerami i zapisując sumy
+ * kontrolne. Dane przechodzą przez bufor (albo mapowanie), bo sumy
+ * trzeba policzyć.
+ */
+int copyToDisk(Disk *disk, int srcFd, off_t srcOffset, off_t diskOffset, size_t len) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int64_t block = blockAtOffset(superBlock, diskOffset);
+    size_t padded = ALIGN_UP(len, (size_t)superBlock->blockSize);
+    unsigned char *dst = mappedForWrite(disk, diskOffset, padded);
+    if (dst) {
+        statDiskIo(1, diskOffset, padded);
+        if (readAt(srcFd, dst, len, srcOffset) < 0) return -1;
+        memset(dst + len, 0, padded - len);
+        return storeChecksums(disk, block, (const char *)dst, len);
+    }
+    size_t bufSize = (len < COPY_BUF_SIZE) ? len : COPY_BUF_SIZE;
+    void *buf = NULL;
+    if (posix_memalign(&buf, COPY_BUF_ALIGN, bufSize ? bufSize : 1) != 0) return -1;
+    int rc = 0;
+    for (size_t done = 0; rc == 0 && done < len; done += bufSize) {
+        size_t chunk = (len - done < bufSize) ? len - done : bufSize;
+        rc = readAt(srcFd, buf, chunk, srcOffset + done);
+        if (rc == 0) rc = writeDataBlocks(disk, block + done / superBlock->blockSize, buf, chunk);
+    }
+    free(buf);
+    return rc;
+}
+
+/* Zapisuje len zer od offset - dziura w wyjściu, które nie jest zwykłym plikiem. */
+int writeZeros(int fd, off_t offset, size_t len) {
+    size_t bufSize = len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE;
+    char *zeros = calloc(1, bufSize ? bufSize : 1);
+    int rc = zeros ? 0 : -1;
+    for (size_t done = 0; rc == 0 && done < len; done += bufSize) {
+        rc = writeAt(fd, zeros, len - done < bufSize ? len - done : bufSize, offset + done);
+    }
+    free(zeros);
+    return rc;
+}
+
+/*
+ * Kopiuje len bajtów z obrazu (od początku bloku pod diskOffset) do
+ * pliku outFd, sprawdzając po drodze sumy kontrolne całych bloków.
+ */
+int copyFromDisk(const Disk *disk, off_t diskOffset, int outFd, off_t outOffset, size_t len) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int64_t block = blockAtOffset(superBlock, diskOffset);
+    size_t padded = ALIGN_UP(len, (size_t)superBlock->blockSize);
+    if (disk->map) {
+        if ((size_t)diskOffset + padded > disk->mapSize) return -1;
+        statDiskIo(0, diskOffset, padded);
+        if (verifyChecksums(disk, block, (const char *)disk->map + diskOffset, padded) < 0) return -1;
+        return writeAt(outFd, disk->map + diskOffset, len, outOffset);
+    }
+    size_t bufSize = (padded < COPY_BUF_SIZE) ? padded : COPY_BUF_SIZE;
+    void *buf = NULL;
+    if (posix_memalign(&buf, COPY_BUF_ALIGN, bufSize ? bufSize : 1) != 0) return -1;
+    int rc = 0;
+    for (size_t done = 0; rc == 0 && done < len; done += bufSize) {
+        size_t chunk = (padded - done < bufSize) ? padded - done : bufSize;
+        rc = diskRead(disk, buf, chunk, diskOffset + done);
+        if (rc == 0) rc = verifyChecksums(disk, block + done / superBlock->blockSize, buf, chunk);
+        if (rc == 0) rc = writeAt(outFd, buf, (len - done < chunk) ? len - done : chunk, outOffset + done);
+    }
+    free(buf);
+    return rc;
+}
+
+void closeDisk(Disk *disk) {
+#if defined(HAVE_MMAP)
+    if (disk->map) {
+        munmap(disk->map, disk->mapSize);
+        disk->map = NULL;
+    }
+#endif
+    free(disk->inodes);
+    free(disk->inodeDirty);
+    free(disk->dirHash);
+    free(disk->blockMap);
+    free(disk->refCounts);
+    free(disk->fingerprints);
+    free(disk->dirHashChunks.chunks);
+    free(disk->blockMapChunks.chunks);
+    free(disk->refCountChunks.chunks);
+    free(disk->fingerprintChunks.chunks);
+    freeFreeExtents(&disk->freeExtents);
+    if (disk->fd >= 0) {
+        close(disk->fd);
+    }
+    disk->inodes = NULL;
+    disk->inodeDirty = NULL;
+    disk->dirHash = NULL;
+    disk->blockMap = NULL;
+    disk->refCounts = NULL;
+    disk->fingerprints = NULL;
+    disk->dirHashChunks.chunks = NULL;
+    disk->blockMapChunks.chunks = NULL;
+    disk->refCountChunks.chunks = NULL;
+    disk->fingerprintChunks.chunks = NULL;
+    disk->fd = -1;
+}
+
+int loadFreeExtents(Disk *disk) {
+    SuperBlock *superBlock = &disk->superBlock;
+    FreeExtents *fe = &disk->freeExtents;
+    if (!superBlock->freeExtentValid) {
+        return buildFreeExtents(disk->blockMap, superBlock, fe);
+    }
+    if (reserveFreeExtents(fe, superBlock->freeExtentCount + 1) < 0) return -1;
+    if (diskRead(disk, fe->byOffset, superBlock->freeExtentCount * sizeof(Fragment),
+                 superBlock->freeExtentOffset) < 0) {
+        return disk->blockMap ? buildFreeExtents(disk->blockMap, superBlock, fe) : -1;
+    }
+    fe->count = superBlock->freeExtentCount;
+    fe->dirtyFrom = fe->count;
+    memcpy(fe->byLength, fe->byOffset, fe->count * sizeof(Fragment));
+    qsort(fe->byLength, fe->count, sizeof(Fragment), compareByLength);
+    return 0;
+}
+
+
+/*
+ * Mapuje cały obraz tylko do odczytu; przy dysku zapisywalnym zapis
+ * jest dozwolony od pierwszej pełnej strony obszaru danych. I-węzły
+ * i indeks katalogu są kopiowane z mapowania do pamięci jak przy
+ * zwykłym odczycie, więc zmiany metadanych trafiają do obrazu tylko
+ * przez commitDisk, a dane plików idą przez mapowanie i msync.
+ */
+int mapDisk(Disk *disk) {
+#if defined(HAVE_MMAP)
+    const SuperBlock *superBlock = &disk->superBlock;
+    struct stat st;
+    size_t needed = superBlock->dataOffset + (size_t)superBlock->blockCount * superBlock->blockSize;
+    if (fstat(disk->fd, &st) < 0 || (size_t)st.st_size < needed) {
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, disk->fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    size_t writable = st.st_size;
+    if (disk->flags & DISK_WRITABLE) {
+        writable = ALIGN_UP((size_t)superBlock->dataOffset, (size_t)sysconf(_SC_PAGESIZE));
+        if (writable < (size_t)st.st_size &&
+            mprotect((char *)map + writable, st.st_size - writable, PROT_READ | PROT_WRITE) < 0) {
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+    disk->map = map;
+    disk->mapSize = st.st_size;
+    disk->mapWritable = writable;
+    return 0;
+#else
+    (void)disk;
+    return -1;
+#endif
+}
+
+/*
+ * Dziennik (WAL) w obszarze [walOffset, walOffset+walSize): nagłówek,
+ * po nim rekordy (przesunięcie, długość, dane wyrównane do 8 bajtów)
+ * z nową zawartością zmienionych obszarów metadanych.
+ */
+typedef struct {
+    char magic[4];
+    int32_t state;
+    int64_t recordCount;
+    int64_t payloadBytes;
+    uint64_t checksum;
+} WalHeader;
+
+typedef struct {
+    int64_t offset;
+    int64_t length;
+} WalRecord;
+
+typedef struct {
+    off_t offset;
+    const void *data;
+    size_t len;
+} WalRange;
+
+typedef struct {
+    WalRange *ranges;
+    int count;
+    int capacity;
+    size_t payloadBytes;
+} WalTxn;
+
+/* Dokłada obszar do transakcji, sklejając go z poprzednim, jeśli się stykają. */
+int addWalRange(WalTxn *txn, off_t offset, const void *data, size_t len) {
+    if (len == 0) return 0;
+    if (txn->count > 0) {
+        WalRange *last = &txn->ranges[txn->count - 1];
+        if (last->offset + (off_t)last->len == offset && (const char *)last->data + last->len == data) {
+            txn->payloadBytes += ALIGN_UP(last->len + len, 8) - ALIGN_UP(last->len, 8);
+            last->len += len;
+            return 0;
+        }
+    }
+    if (txn->count == txn->capacity) {
+        int newCapacity = txn->capacity ? txn->capacity * 2 : 64;
+        WalRange *grown = realloc(txn->ranges, newCapacity * sizeof(WalRange));
+        if (!grown) return -1;
+        txn->ranges = grown;
+        txn->capacity = newCapacity;
+    }
+    txn->ranges[txn->count].offset = offset;
+    txn->ranges[txn->count].data = data;
+    txn->ranges[txn->count].len = len;
+    txn->count++;
+    txn->payloadBytes += sizeof(WalRecord) + ALIGN_UP(len, 8);
+    return 0;
+}
+
+/*
+ * Dokłada do transakcji zmienione kawałki obszaru zaczynającego się
+ * w offset. Znaczniki zeruje dopiero clearDirtyMap po udanym zapisie.
+ */
+int addDirtyChunks(WalTxn *txn, const DirtyMap *dm, off_t offset, const void *data) {
+    int rc = 0;
+    for (size_t c = 0; dm->any && c < dm->chunkCount; c++) {
+        if (!dm->chunks[c]) continue;
+        size_t start = c * DIRTY_CHUNK;
+        size_t len = (dm->regionBytes - start < DIRTY_CHUNK) ? dm->regionBytes - start : DIRTY_CHUNK;
+        if (addWalRange(txn, offset + start, (const char *)data + start, len) < 0) rc = -1;
+    }
+    return rc;
+}
+
+/*
+ * Dokłada indeks wolnych ekstentów (od pierwszej zmienionej pozycji)
+ * i uaktualnia pola freeExtent* w superbloku (który trzeba potem zapisać).
+ * dirtyFrom przesuwa commitDisk po udanym zapisie.
+ */
+int saveFreeExtents(Disk *disk, WalTxn *txn) {
+    SuperBlock *superBlock = &disk->superBlock;
+    FreeExtents *fe = &disk->freeExtents;
+    if (fe->count > superBlock->freeExtentCapacity) {
+        superBlock->freeExtentValid = 0;
+        superBlock->freeExtentCount = 0;
+        return 0;
+    }
+    int from = superBlock->freeExtentValid ? fe->dirtyFrom : 0;
+    if (from > fe->count) from = fe->count;
+    if (addWalRange(txn, superBlock->freeExtentOffset + (off_t)from * sizeof(Fragment),
+                    &fe->byOffset[from], (fe->count - from) * sizeof(Fragment)) < 0) {
+        superBlock->freeExtentValid = 0;
+        return -1;
+    }
+    superBlock->freeExtentCount = fe->count;
+    superBlock->freeExtentValid = 1;
+    return 0;
+}
+
+#if defined(MYFS_CRASH_TEST)
+/*
+ * Do testu odtwarzania (crashtest.sh): przy MYFS_CRASH_AFTER_LOG=N proces
+ * zabija się po N-tym utrwaleniu dziennika, przed zapisem na miejsce.
+ */
+int crashLogCount = 0;
+
+void crashAfterLog(void) {
+    const char *limit = getenv("MYFS_CRASH_AFTER_LOG");
+    if (limit && ++crashLogCount >= atoi(limit)) {
+        raise(SIGKILL);
+    }
+}
+#endif
+
+/*
+ * Zapisuje obszary, które razem mieszczą się w dzienniku. Najpierw trafiają
+ * do dziennika z nagłówkiem WAL_COMMITTED i są utrwalane jednym fsync
+ * (razem z zapisanymi wcześniej danymi plików) - od tej chwili są
+ * zatwierdzone. Potem obszary są zapisywane na swoje miejsca, utrwalane,
+ * a nagłówek zmieniany na WAL_APPLIED. Po awarii między tymi krokami
+ * replayWal powtarza zapis z dziennika.
+ */
+int writeLogged(Disk *disk, const WalRange *ranges, int count, size_t payloadBytes) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    size_t total = sizeof(WalHeader) + payloadBytes;
+    char *log = calloc(1, total);
+    if (!log) return -1;
+    WalHeader *header = (WalHeader *)log;
+    char *p = log + sizeof(WalHeader);
+    for (int r = 0; r < count; r++) {
+        WalRecord record = { ranges[r].offset, (int64_t)ranges[r].len };
+        memcpy(p, &record, sizeof(record));
+        memcpy(p + sizeof(record), ranges[r].data, ranges[r].len);
+        p += sizeof(record) + ALIGN_UP(ranges[r].len, 8);
+    }
+    memcpy(header->magic, WAL_MAGIC_STR, 4);
+    header->state = WAL_COMMITTED;
+    header->recordCount = count;
+    header->payloadBytes = payloadBytes;
+    header->checksum = checksum64(log + sizeof(WalHeader), payloadBytes);
+    if (diskWrite(disk, log, total, superBlock->walOffset) < 0 || syncDisk(disk) < 0) {
+        free(log);
+        return -1;
+    }
+#if defined(MYFS_CRASH_TEST)
+    crashAfterLog();
+#endif
+    int rc = 0;
+    for (int r = 0; r < count; r++) {
+        if (diskWrite(disk, ranges[r].data, ranges[r].len, ranges[r].offset) < 0) rc = -1;
+    }
+    if (syncDisk(disk) < 0) rc = -1;
+    if (rc == 0) {
+        header->state = WAL_APPLIED;
+        rc = diskWrite(disk, header, sizeof(WalHeader), superBlock->walOffset);
+    }
+    free(log);
+    return rc;
+}
+
+/*
+ * Zapisuje transakcję przez dziennik (writeLogged). Transakcja większa
+ * niż dziennik jest dzielona na kolejne części, które się w nim mieszczą
+ * (długie obszary na kawałki), w kolejności obszarów, więc superblok
+ * dodany przez commitDisk na końcu idzie w ostatniej. Każda część jest
+ * atomowa, cała transakcja już nie - dlatego wsady i copyin-many
+ * zatwierdzają zmiany po drodze (commitIfLogFull), a podział zdarza się
+ * tylko przy upgrade i pojedynczych bardzo dużych operacjach (np. --dedup
+ * pliku, którego liczniki odwołań zajmują więcej niż dziennik).
+ */
+int writeTransaction(Disk *disk, const WalTxn *txn) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    size_t capacity = superBlock->walSize > (int64_t)sizeof(WalHeader)
+                      ? superBlock->walSize - sizeof(WalHeader) : 0;
+    if (capacity < sizeof(WalRecord) + 8) {
+        fprintf(stderr, "Dysk nie ma dziennika, w którym zmieściłaby się transakcja.\n");
+        return -1;
+    }
+    if (txn->payloadBytes <= capacity) {
+        return writeLogged(disk, txn->ranges, txn->count, txn->payloadBytes);
+    }
+    WalRange *part = malloc(txn->count * sizeof(WalRange));
+    if (!part) return -1;
+    int rc = 0;
+    int r = 0;
+    size_t done = 0;
+    while (rc == 0 && r < txn->count) {
+        int partCount = 0;
+        size_t partBytes = 0;
+        while (r < txn->count) {
+            const WalRange *range = &txn->ranges[r];
+            size_t take = range->len - done;
+            size_t room = capacity - partBytes;
+            if (sizeof(WalRecord) + ALIGN_UP(take, 8) > room) {
+                take = room > sizeof(WalRecord) ? (room - sizeof(WalRecord)) / 8 * 8 : 0;
+                if (take == 0) break;
+            }
+            part[partCount].offset = range->offset + done;
+            part[partCount].data = (const char *)range->data + done;
+            part[partCount].len = take;
+            partCount++;
+            partBytes += sizeof(WalRecord) + ALIGN_UP(take, 8);
+            done += take;
+            if (done < range->len) break;
+            r++;
+            done = 0;
+        }
+        rc = writeLogged(disk, part, partCount, partBytes);
+    }
+    free(part);
+    return rc;
+}
+
+/*
+ * Jeżeli dziennik zawiera zatwierdzoną, a niezastosowaną transakcję
+ * (awaria w trakcie commitDisk), zapisuje ją na miejsce. Zwraca 1, gdy
+ * coś zostało odtworzone, 0 gdy nie było czego, -1 przy błędzie.
+ */
+int replayWal(const char *diskName, int fd, const SuperBlock *superBlock) {
+    WalHeader header;
+    if (superBlock->walSize < (int64_t)sizeof(WalHeader) ||
+        readAt(fd, &header, sizeof(header), superBlock->walOffset) < 0 ||
+        memcmp(header.magic, WAL_MAGIC_STR, 4) != 0 || header.state != WAL_COMMITTED ||
+        header.payloadBytes < 0 || header.payloadBytes > superBlock->walSize - (int64_t)sizeof(header)) {
+        return 0;
+    }
+    char *payload = malloc(header.payloadBytes + 1);
+    if (!payload || readAt(fd, payload, header.payloadBytes, superBlock->walOffset + sizeof(header)) < 0 ||
+        checksum64(payload, header.payloadBytes) != header.checksum) {
+        /* Niepełny zapis dziennika - transakcja nie została zatwierdzona. */
+        free(payload);
+        return 0;
+    }
+    int rwFd = open(diskName, O_RDWR);
+    if (rwFd < 0) {
+        fprintf(stderr, "Dziennik dysku %s wymaga odtworzenia, a dysk jest tylko do odczytu.\n", diskName);
+        free(payload);
+        return -1;
+    }
+    int rc = 0;
+    const char *p = payload;
+    for (int64_t r = 0; r < header.recordCount && rc == 0; r++) {
+        WalRecord record;
+        memcpy(&record, p, sizeof(record));
+        if (record.offset < 0 || record.length < 0 || record.offset + record.length > superBlock->dataOffset ||
+            p + sizeof(record) + record.length > payload + header.payloadBytes) {
+            rc = -1;
+            break;
+        }
+        rc = writeAt(rwFd, p + sizeof(record), record.length, record.offset);
+        p += sizeof(record) + ALIGN_UP(record.length, 8);
+    }
+    if (rc == 0 && fsync(rwFd) == 0) {
+        header.state = WAL_APPLIED;
+        writeAt(rwFd, &header, sizeof(header), superBlock->walOffset);
+    } else {
+        rc = -1;
+    }
+    close(rwFd);
+    free(payload);
+    if (rc < 0) {
+        fprintf(stderr, "Błąd odtwarzania dziennika dysku %s.\n", diskName);
+        return -1;
+    }
+    fprintf(stderr, "Odtworzono niezakończoną transakcję z dziennika dysku %s.\n", diskName);
+    return 1;
+}
+
+int openDisk(const char *diskName, int flags, Disk *disk) {
+    memset(disk, 0, sizeof(*disk));
+    flags |= globalDiskFlags;
+    disk->flags = flags;
+    disk->fd = open(diskName, (flags & DISK_WRITABLE) ? O_RDWR : O_RDONLY);
+    statAdd(&globalStats.syscalls, 1);
+    if (disk->fd < 0) {
+        fprintf(stderr, "Nie można otworzyć dysku %s\n", diskName);
+        return -1;
+    }
+    SuperBlock *superBlock = &disk->superBlock;
+    if (readSuperBlock(disk->fd, superBlock) < 0) {
+        closeDisk(disk);
+        return -1;
+    }
+    int replayed = replayWal(diskName, disk->fd, superBlock);
+    if (replayed < 0 || (replayed > 0 && readSuperBlock(disk->fd, superBlock) < 0)) {
+        closeDisk(disk);
+        return -1;
+    }
+    if ((flags & DISK_MMAP) && mapDisk(disk) < 0) {
+        fprintf(stderr, "Nie można zmapować dysku %s, używam zwykłego odczytu.\n", diskName);
+    }
+    disk->inodeDirty = calloc(superBlock->inodeCount, 1);
+    if (allocDirtyMaps(disk) < 0) {
+        closeDisk(disk);
+        return -1;
+    }
+    disk->inodes = calloc(superBlock->inodeCount, sizeof(Inode));
+    disk->dirHash = calloc(superBlock->dirHashSize, sizeof(DirSlot));
+    if (superBlock->inodesInitialized < 0 || superBlock->inodesInitialized > superBlock->inodeCount) {
+        fprintf(stderr, "Uszkodzony superblok dysku '%s'.\n", diskName);
+        closeDisk(disk);
+        return -1;
+    }
+    if (!disk->inodes || !disk->inodeDirty || !disk->dirHash ||
+        diskRead(disk, disk->inodes, superBlock->inodesInitialized * sizeof(Inode),
+                 superBlock->inodeTableOffset) < 0 ||
+        diskRead(disk, disk->dirHash, superBlock->dirHashSize * sizeof(DirSlot),
+                 superBlock->dirHashOffset) < 0) {
+        fprintf(stderr, "Błąd odczytu metadanych dysku '%s'.\n", diskName);
+        closeDisk(disk);
+        return -1;
+    }
+    if (flags & DISK_BLOCKMAP) {
+        disk->blockMap = allocBlockMap(superBlock);
+        if (!disk->blockMap ||
+            diskRead(disk, disk->blockMap, BITMAP_BYTES(superBlock->blockCount),
+                     superBlock->blockBitmapOffset) < 0 ||
+            loadFreeExtents(disk) < 0) {
+            fprintf(stderr, "Błąd odczytu bitmapy dysku '%s'.\n", diskName);
+            closeDisk(disk);
+            return -1;
+        }
+        setBlockMapTail(disk->blockMap, superBlock->blockCount);
+        int dedup = (flags & DISK_DEDUP) && (flags & DISK_WRITABLE);
+        if (superBlock->sharedBlocks > 0 || dedup) {
+            disk->refCounts = malloc(superBlock->blockCount);
+            if (!disk->refCounts ||
+                diskRead(disk, disk->refCounts, superBlock->blockCount, superBlock->refCountOffset) < 0) {
+                fprintf(stderr, "Błąd odczytu liczników odwołań dysku '%s'.\n", diskName);
+                closeDisk(disk);
+                return -1;
+            }
+        }
+        if (dedup) {
+            disk->fingerprints = malloc(superBlock->fingerprintCount * sizeof(Fingerprint));
+            if (!disk->fingerprints ||
+                diskRead(disk, disk->fingerprints, superBlock->fingerprintCount * sizeof(Fingerprint),
+                         superBlock->fingerprintOffset) < 0) {
+                fprintf(stderr, "Błąd odczytu indeksu odcisków dysku '%s'.\n", diskName);
+                closeDisk(disk);
+                return -1;
+            }
+        }
+    } else if (flags & DISK_FREE_INDEX) {
+        if (!superBlock->freeExtentValid) {
+            disk->blockMap = allocBlockMap(superBlock);
+            if (!disk->blockMap || diskRead(disk, disk->blockMap, BITMAP_BYTES(superBlock->blockCount),
+                                            superBlock->blockBitmapOffset) < 0) {
+                fprintf(stderr, "Błąd odczytu bitmapy dysku '%s'.\n", diskName);
+                closeDisk(disk);
+                return -1;
+            }
+        }
+        if (loadFreeExtents(disk) < 0) {
+            fprintf(stderr, "Błąd odczytu indeksu wolnych ekstentów dysku '%s'.\n", diskName);
+            closeDisk(disk);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Górne oszacowanie rozmiaru transakcji, którą zapisałby teraz commitDisk. */
+size_t pendingCommitBytes(const Disk *disk) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    size_t chunks = disk->dirHashChunks.dirtyCount + disk->blockMapChunks.dirtyCount +
+                    disk->refCountChunks.dirtyCount;
+    size_t bytes = sizeof(WalHeader) + sizeof(WalRecord) + ALIGN_UP(sizeof(SuperBlock), 8) +
+                   (size_t)disk->dirtyInodes * (sizeof(WalRecord) + ALIGN_UP(sizeof(Inode), 8)) +
+                   chunks * (sizeof(WalRecord) + DIRTY_CHUNK);
+    if (disk->blockMapDirty) {
+        int from = superBlock->freeExtentValid ? disk->freeExtents.dirtyFrom : 0;
+        if (from > disk->freeExtents.count) from = disk->freeExtents.count;
+        bytes += sizeof(WalRecord) + (size_t)(disk->freeExtents.count - from) * sizeof(Fragment);
+    }
+    return bytes;
+}
+
+/*
+ * Zapisuje zmienione metadane jedną transakcją (writeTransaction).
+ * Znaczniki zmian są zerowane dopiero po udanym zapisie, więc po błędzie
+ * następny commitDisk spróbuje zapisać je jeszcze raz.
+ */
+int commitDisk(Disk *disk) {
+    int64_t started = phaseStart();
+    SuperBlock *superBlock = &disk->superBlock;
+    WalTxn txn;
+    memset(&txn, 0, sizeof(txn));
+    int rc = 0;
+    int i = 0;
+    while (i < superBlock->inodeCount) {
+        if (!disk->inodeDirty[i]) {
+            i++;
+            continue;
+        }
+        int j = i;
+        while (j < superBlock->inodeCount && disk->inodeDirty[j]) {
+            j++;
+        }
+        if (addWalRange(&txn, superBlock->inodeTableOffset + (off_t)i * sizeof(Inode),
+                        &disk->inodes[i], (j - i) * sizeof(Inode)) < 0) rc = -1;
+        i = j;
+    }
+    if (addDirtyChunks(&txn, &disk->dirHashChunks, superBlock->dirHashOffset, disk->dirHash) < 0) rc = -1;
+    if (disk->blockMapDirty) {
+        if (addDirtyChunks(&txn, &disk->blockMapChunks, superBlock->blockBitmapOffset, disk->blockMap) < 0 ||
+            saveFreeExtents(disk, &txn) < 0) rc = -1;
+        disk->superBlockDirty = 1;
+    }
+    if (disk->refCounts &&
+        addDirtyChunks(&txn, &disk->refCountChunks, superBlock->refCountOffset, disk->refCounts) < 0) rc = -1;
+    if (disk->superBlockDirty && addWalRange(&txn, 0, superBlock, sizeof(SuperBlock)) < 0) rc = -1;
+    if (rc == 0 && txn.count > 0) {
+        rc = writeTransaction(disk, &txn);
+    }
+    if (rc == 0) {
+        if (disk->dirtyInodes > 0) memset(disk->inodeDirty, 0, superBlock->inodeCount);
+        disk->dirtyInodes = 0;
+        clearDirtyMap(&disk->dirHashChunks);
+        clearDirtyMap(&disk->blockMapChunks);
+        clearDirtyMap(&disk->refCountChunks);
+        if (disk->blockMapDirty) disk->freeExtents.dirtyFrom = disk->freeExtents.count;
+        disk->blockMapDirty = 0;
+        disk->superBlockDirty = 0;
+    }
+    /* Indeks odcisków jest tylko podpowiedzią, więc idzie poza dziennikiem. */
+    txn.count = 0;
+    if (rc == 0 && disk->fingerprints &&
+        addDirtyChunks(&txn, &disk->fingerprintChunks, superBlock->fingerprintOffset, disk->fingerprints) == 0) {
+        for (int r = 0; r < txn.count && rc == 0; r++) {
+            rc = diskWrite(disk, txn.ranges[r].data, txn.ranges[r].len, txn.ranges[r].offset);
+        }
+        if (rc == 0) clearDirtyMap(&disk->fingerprintChunks);
+    }
+    free(txn.ranges);
+    phaseEnd(PHASE_COMMIT, started);
+    if (rc < 0) {
+        fprintf(stderr, "Błąd zapisu metadanych dysku.\n");
+    }
+    return rc;
+}
+
+void markInodeDirty(Disk *disk, int index) {
+    if (!disk->inodeDirty[index]) disk->dirtyInodes++;
+    disk->inodeDirty[index] = 1;
+}
+
+/*
+ * Zatwierdza dotychczasowe zmiany, gdy zajęłyby już ponad pół dziennika,
+ * żeby długie wsady i copyin-many dzieliły się na transakcje mieszczące
+ * się w nim.
+ */
+int commitIfLogFull(Disk *disk) {
+    if (pendingCommitBytes(disk) <= (size_t)disk->superBlock.walSize / 2) return 0;
+    return commitDisk(disk);
+}
+
+/*
+ * Szuka pliku po nazwie w indeksie katalogu. Zwraca numer i-węzła
+ * albo -1. W *slotOut zwraca numer slotu.
+ */
+int probeDirectory(const Disk *disk, const char *name, int *slotOut) {
+    unsigned int hash = hashName(name);
+    int size = disk->superBlock.dirHashSize;
+    for (int n = 0; n < size; n++) {
+        int slot = (int)((hash + n) & (size - 1));
+        const DirSlot *ds = &disk->dirHash[slot];
+        if (ds->entry == 0) {
+            return -1;
+        }
+        if (ds->entry == DIR_SLOT_DELETED || ds->hash != hash) {
+            continue;
+        }
+        const Inode *ino = &disk->inodes[ds->entry - 1];
+        statAdd(&globalStats.inodesVisited, 1);
+        if (ino->isUsed == 1 && strncmp(ino->fileName, name, MAX_NAME_LEN) == 0) {
+            if (slotOut) *slotOut = slot;
+            return ds->entry - 1;
+        }
+    }
+    return -1;
+}
+
+int findFile(const Disk *disk, const char *name, int *slotOut) {
+    int64_t started = phaseStart();
+    int idx = probeDirectory(disk, name, slotOut);
+    phaseEnd(PHASE_LOOKUP, started);
+    return idx;
+}
+
+int insertDirEntry(Disk *disk, const char *name, int inodeIdx) {
+    unsigned int hash = hashName(name);
+    int size = disk->superBlock.dirHashSize;
+    for (int n = 0; n < size; n++) {
+        DirSlot *ds = &disk->dirHash[(hash + n) & (size - 1)];
+        if (ds->entry == 0 || ds->entry == DIR_SLOT_DELETED) {
+            ds->entry = inodeIdx + 1;
+            ds->hash = hash;
+            markDirtyRange(&disk->dirHashChunks, (size_t)((const char *)ds - (const char *)disk->dirHash),
+                           sizeof(DirSlot));
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Usuwa wpis ze slotu. Jeżeli następny slot jest pusty, znacznik
+ * usunięcia nie jest potrzebny - slot (i poprzedzające go znaczniki)
+ * stają się puste, żeby nie wydłużać wyszukiwania.
+ */
+void removeDirEntry(Disk *disk, int slot) {
+    int mask = disk->superBlock.dirHashSize - 1;
+    if (disk->dirHash[(slot + 1) & mask].entry != 0) {
+        disk->dirHash[slot].entry = DIR_SLOT_DELETED;
+        disk->dirHash[slot].hash = 0;
+        markDirtyRange(&disk->dirHashChunks, slot * sizeof(DirSlot), sizeof(DirSlot));
+        return;
+    }
+    for (int n = 0; n <= mask; n++) {
+        disk->dirHash[slot].entry = 0;
+        disk->dirHash[slot].hash = 0;
+        markDirtyRange(&disk->dirHashChunks, slot * sizeof(DirSlot), sizeof(DirSlot));
+        slot = (slot - 1) & mask;
+        if (disk->dirHash[slot].entry != DIR_SLOT_DELETED) break;
+    }
+}
+
+int hasFreeInode(const Disk *disk) {
+    return disk->superBlock.freeInodeHead >= 0 ||
+           disk->superBlock.inodesInitialized < disk->superBlock.inodeCount;
+}
+
+/* Zdejmuje i-węzeł z listy wolnych, a gdy jest pusta - bierze pierwszy niezainicjowany. */
+int allocInode(Disk *disk) {
+    SuperBlock *superBlock = &disk->superBlock;
+    int idx = superBlock->freeInodeHead;
+    statAdd(&globalStats.inodesVisited, 1);
+    if (idx >= 0) {
+        superBlock->freeInodeHead = disk->inodes[idx].nextFree;
+    } else if (superBlock->inodesInitialized < superBlock->inodeCount) {
+        idx = superBlock->inodesInitialized++;
+    } else {
+        return -1;
+    }
+    disk->superBlockDirty = 1;
+    return idx;
+}
+
+/* Czyści i-węzeł i dokłada go na początek listy wolnych. */
+void releaseInode(Disk *disk, int idx) {
+    Inode *empty = &disk->inodes[idx];
+    memset(empty, 0, sizeof(*empty));
+    for (int i = 0; i < MAX_FRAGS; i++) {
+        empty->fragments[i].startBlock = -1;
+    }
+    empty->extentBlock = -1;
+    empty->nextFree = disk->superBlock.freeInodeHead;
+    disk->superBlock.freeInodeHead = idx;
+    disk->superBlockDirty = 1;
+    markInodeDirty(disk, idx);
+}
+
+/*
+ * Układ dysku: superblok, tablica i-węzłów, indeks katalogu, bitmapa,
+ * indeks wolnych ekstentów, liczniki odwołań (bajt na blok), indeks
+ * odcisków (potęga dwójki, co najmniej 1/4 liczby bloków), sumy
+ * kontrolne (uint32 na blok), dziennik, dane. Wylicza przesunięcia w superBlock dla podanej liczby bloków
+ * (górnego ograniczenia - od niej zależy rozmiar bitmapy) i zwraca
+ * koniec obszaru metadanych. Dziennik ma 1/32 pozostałych metadanych,
+ * w granicach MIN..MAX_WAL_SIZE.
+ */
+int64_t layoutMetadata(SuperBlock *superBlock, int64_t blocks) {
+    superBlock->dirHashSize = dirHashSizeFor(superBlock->inodeCount);
+    int64_t extentCapacity = (int64_t)superBlock->inodeCount * MAX_FRAGS + 1;
+    if (extentCapacity > blocks / 2 + 1) {
+        extentCapacity = blocks / 2 + 1;
+    }
+    superBlock->freeExtentCapacity = extentCapacity;
+    superBlock->inodeTableOffset = ALIGN_UP((int64_t)sizeof(SuperBlock), 8);
+    superBlock->dirHashOffset = ALIGN_UP(superBlock->inodeTableOffset
+                                + (int64_t)superBlock->inodeCount * (int64_t)sizeof(Inode), 8);
+    superBlock->blockBitmapOffset = ALIGN_UP(superBlock->dirHashOffset
+                                    + (int64_t)superBlock->dirHashSize * (int64_t)sizeof(DirSlot), 8);
+    superBlock->freeExtentOffset = ALIGN_UP(superBlock->blockBitmapOffset
+                                   + (int64_t)BITMAP_BYTES(blocks), 8);
+    superBlock->refCountOffset = ALIGN_UP(superBlock->freeExtentOffset
+                                 + extentCapacity * (int64_t)sizeof(Fragment), 8);
+    superBlock->fingerprintCount = 64;
+    while (superBlock->fingerprintCount < blocks / 4) {
+        superBlock->fingerprintCount *= 2;
+    }
+    superBlock->fingerprintOffset = ALIGN_UP(superBlock->refCountOffset + blocks, 8);
+    superBlock->checksumOffset = superBlock->fingerprintOffset
+                                 + superBlock->fingerprintCount * (int64_t)sizeof(Fingerprint);
+    superBlock->walOffset = superBlock->checksumOffset + blocks * (int64_t)sizeof(uint32_t);
+    int64_t walSize = superBlock->walOffset / 32;
+    if (walSize < MIN_WAL_SIZE) walSize = MIN_WAL_SIZE;
+    if (walSize > MAX_WAL_SIZE) walSize = MAX_WAL_SIZE;
+    superBlock->walSize = ALIGN_UP(walSize, 8);
+    return superBlock->walOffset + superBlock->walSize;
+}
+
+int formatDisk(const char *diskFile, int64_t diskSize, int blockSize, int inodeCount) {
+    if (blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0) {
+        fprintf(stderr, "Rozmiar bloku musi być potęgą dwójki z zakresu %d..%d\n",
+                MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+    int64_t blocks = diskSize / blockSize;
+    if (blocks < 1) {
+        fprintf(stderr, "Za mały rozmiar dysku\n");
+        return -1;
+    }
+    if (inodeCount <= 0) {
+        int64_t defaultCount = blocks / 16;
+        if (defaultCount > DEFAULT_MAX_INODES) {
+            defaultCount = DEFAULT_MAX_INODES;
+        }
+        if (defaultCount < 16) {
+            defaultCount = 16;
+        }
+        inodeCount = (int)defaultCount;
+    }
+    if (inodeCount > MAX_INODE_COUNT) {
+        fprintf(stderr, "Za dużo i-węzłów (maksymalnie %d)\n", MAX_INODE_COUNT);
+        return -1;
+    }
+
+    SuperBlock superBlock;
+    memset(&superBlock, 0, sizeof(superBlock));
+    memcpy(superBlock.signature, MAGIC_STR, 4);
+    superBlock.version = FS_VERSION;
+    superBlock.blockSize = blockSize;
+    superBlock.inodeCount = inodeCount;   
+    int64_t overhead = layoutMetadata(&superBlock, blocks);
+    int dataAlign = blockSize < 4096 ? blockSize : 4096;
+    superBlock.dataOffset = ALIGN_UP(overhead, dataAlign);
+    if (diskSize <= superBlock.dataOffset) {
+        fprintf(stderr, "Za mały rozmiar dysku\n");
+        return -1;
+    }
+    int64_t blockCount = (diskSize - superBlock.dataOffset) / blockSize;
+    if (blockCount < 1) {
+        fprintf(stderr, "Za mały rozmiar dysku\n");
+        return -1;
+    }
+    superBlock.blockCount = blockCount;   
+    superBlock.freeBlocks = blockCount;   
+    superBlock.freeInodeHead = -1;
+    superBlock.inodesInitialized = 0;
+    superBlock.freeExtentCount = 1;
+    superBlock.freeExtentValid = 1;
+
+    /*
+     * Plik jest rozszerzany ftruncate, więc wszystko, co ma być zerami
+     * (bitmapa, indeks katalogu, niezainicjowane i-węzły, dziennik),
+     * pozostaje dziurą i nie jest zapisywane.
+     */
+    int fd = open(diskFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("formatDisk open");
+        return -1;
+    }
+    int64_t totalSize = superBlock.dataOffset + blockCount * blockSize;
+    Fragment wholeDisk = { 0, blockCount };
+    if (ftruncate(fd, totalSize) < 0 ||
+        writeAt(fd, &wholeDisk, sizeof(wholeDisk), superBlock.freeExtentOffset) < 0 ||
+        writeAt(fd, &superBlock, sizeof(superBlock), 0) < 0) {
+        perror("formatDisk write");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    printf("Utworzono wirtualny dysk: %s\n", diskFile);
+    printf("Liczba bloków = %" PRId64 " (po %d bajtów), i-węzłów = %d, rozmiar pliku = %" PRId64 " bajtów\n",
+           blockCount, blockSize, inodeCount, totalSize);
+    return 0;
+}
+
+int extentsPerBlock(const SuperBlock *superBlock) {
+    return (superBlock->blockSize - (int)sizeof(ExtentBlockHeader)) / (int)sizeof(Fragment);
+}
+
+/*
+ * Wszystkie fragmenty pliku w pamięci. logicalStart[i] to numer
+ * pierwszego bloku pliku leżącego we frags[i] (sumy prefiksowe długości),
+ * więc blok dla danego przesunięcia znajduje się wyszukiwaniem binarnym.
+ */
+typedef struct {
+    Fragment *frags;
+    int64_t *logicalStart;
+    int count;
+    int64_t *extentBlocks;
+    int extentBlockCount;
+} FileExtents;
+
+void freeFileExtents(FileExtents *fe) {
+    free(fe->frags);
+    free(fe->logicalStart);
+    free(fe->extentBlocks);
+    memset(fe, 0, sizeof(*fe));
+}
+
+void computeLogicalStarts(FileExtents *fe) {
+    int64_t logical = 0;
+    for (int f = 0; f < fe->count; f++) {
+        fe->logicalStart[f] = logical;
+        logical += fe->frags[f].blockCount;
+    }
+    fe->logicalStart[fe->count] = logical;
+}
+
+int loadFileExtents(const Disk *disk, const Inode *ino, FileExtents *fe) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    memset(fe, 0, sizeof(*fe));
+    int count = (ino->flags & INODE_INLINE) ? 0 : ino->fragmentsCount;
+    fe->frags = malloc((count + 1) * sizeof(Fragment));
+    fe->logicalStart = malloc((count + 1) * sizeof(int64_t));
+    if (!fe->frags || !fe->logicalStart) {
+        freeFileExtents(fe);
+        return -1;
+    }
+    int direct = count < MAX_FRAGS ? count : MAX_FRAGS;
+    memcpy(fe->frags, ino->fragments, direct * sizeof(Fragment));
+    fe->count = direct;
+
+    int perBlock = extentsPerBlock(superBlock);
+    int chainLength = (count - direct + perBlock - 1) / perBlock;
+    if (chainLength > 0) {
+        fe->extentBlocks = malloc(chainLength * sizeof(int64_t));
+        char *buf = malloc(superBlock->blockSize);
+        int64_t block = ino->extentBlock;
+        int rc = (fe->extentBlocks && buf) ? 0 : -1;
+        while (rc == 0 && fe->count < count) {
+            const ExtentBlockHeader *header = (const ExtentBlockHeader *)buf;
+            if (block < 0 || block >= superBlock->blockCount || fe->extentBlockCount >= chainLength ||
+                diskRead(disk, buf, superBlock->blockSize, getBlockOffset(superBlock, block)) < 0 ||
+                header->count <= 0 || header->count > perBlock || header->count > count - fe->count) {
+                rc = -1;
+                break;
+            }
+            fe->extentBlocks[fe->extentBlockCount++] = block;
+            memcpy(&fe->frags[fe->count], buf + sizeof(ExtentBlockHeader),
+                   header->count * sizeof(Fragment));
+            fe->count += header->count;
+            block = header->next;
+        }
+        free(buf);
+        if (rc < 0) {
+            fprintf(stderr, "Uszkodzony łańcuch ekstentów pliku '%s'.\n", ino->fileName);
+            freeFileExtents(fe);
+            return -1;
+        }
+    }
+    computeLogicalStarts(fe);
+    statFile(fe->count);
+    return 0;
+}
+
+/* Indeks fragmentu zawierającego logiczny blok pliku albo -1. */
+int findExtent(const FileExtents *fe, int64_t logicalBlock) {
+    if (logicalBlock < 0 || logicalBlock >= fe->logicalStart[fe->count]) return -1;
+    int lo = 0, hi = fe->count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (fe->logicalStart[mid] <= logicalBlock) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/* Dopisuje fragment do listy, scalając go z poprzednim, jeśli się stykają (albo oba są dziurami). */
+void appendFragment(Fragment *frags, int *count, int64_t start, int64_t length) {
+    if (length <= 0) return;
+    Fragment *last = *count > 0 ? &frags[*count - 1] : NULL;
+    if (last && (start == HOLE_BLOCK ? last->startBlock == HOLE_BLOCK
+                                     : last->startBlock != HOLE_BLOCK && last->startBlock + last->blockCount == start)) {
+        last->blockCount += length;
+        return;
+    }
+    frags[*count].startBlock = start;
+    frags[*count].blockCount = length;
+    (*count)++;
+}
+
+/* appendFragment na liście z malloc, powiększanej w razie potrzeby. */
+int addExtent(Fragment **frags, int *count, int *capacity, int64_t start, int64_t length) {
+    if (*count == *capacity) {
+        int newCapacity = *capacity ? *capacity * 2 : MAX_FRAGS;
+        Fragment *grown = realloc(*frags, newCapacity * sizeof(Fragment));
+        if (!grown) return -1;
+        *frags = grown;
+        *capacity = newCapacity;
+    }
+    appendFragment(*frags, count, start, length);
+    return 0;
+}
+
+/* Fizyczne kawałki logicznych bloków [first, first+count) pliku (z dziurami); zwraca ich liczbę. */
+int sliceExtents(const FileExtents *fe, int64_t first, int64_t count, Fragment *out) {
+    int n = 0;
+    for (int f = findExtent(fe, first); f >= 0 && f < fe->count && count > 0; f++) {
+        int64_t skip = first - fe->logicalStart[f];
+        int64_t length = fe->frags[f].blockCount - skip;
+        if (length > count) length = count;
+        int64_t start = fe->frags[f].startBlock;
+        appendFragment(out, &n, start == HOLE_BLOCK ? HOLE_BLOCK : start + skip, length);
+        first += length;
+        count -= length;
+    }
+    return n;
+}
+
+/* Dokłada odwołanie do bloku (współdzielenie przy deduplikacji). */
+void addReference(Disk *disk, int64_t block) {
+    if (disk->refCounts[block]++ == 0) {
+        disk->superBlock.sharedBlocks++;
+    }
+    disk->superBlock.savedBlocks++;
+    markDirtyRange(&disk->refCountChunks, block, 1);
+    disk->superBlockDirty = 1;
+}
+
+void dropReference(Disk *disk, int64_t block) {
+    if (--disk->refCounts[block] == 0) {
+        disk->superBlock.sharedBlocks--;
+    }
+    disk->superBlock.savedBlocks--;
+    markDirtyRange(&disk->refCountChunks, block, 1);
+    disk->superBlockDirty = 1;
+}
+
+/* Zwalnia bloki fragmentów (dziury pomija); blok współdzielony traci tylko jedno odwołanie. */
+void releaseFragments(Disk *disk, const Fragment *frags, int count) {
+    for (int f = 0; f < count; f++) {
+        if (frags[f].startBlock == HOLE_BLOCK) continue;
+        int64_t start = frags[f].startBlock;
+        int64_t end = start + frags[f].blockCount;
+        while (start < end) {
+            int64_t b = disk->refCounts ? start : end;
+            while (b < end && disk->refCounts[b] == 0) b++;
+            if (b > start) {
+                markDiskBlocks(disk, start, b - start, 0);
+                if (releaseFreeExtent(&disk->freeExtents, start, b - start) < 0) {
+                    /* Indeks rozjechał się z bitmapą (która jest już poprawna) - odbudowujemy go z niej. */
+                    fprintf(stderr, "Niespójny indeks wolnych ekstentów, odbudowuję go z bitmapy.\n");
+                    buildFreeExtents(disk->blockMap, &disk->superBlock, &disk->freeExtents);
+                }
+                disk->superBlock.freeBlocks += b - start;
+            }
+            if (b < end) {
+                dropReference(disk, b++);
+            }
+            start = b;
+        }
+    }
+}
+
+/*
+ * Best-fit: jeżeli jakiś wolny ekstent mieści resztę pliku, bierzemy
+ * najmniejszy taki; w przeciwnym razie bierzemy największy wolny ekstent
+ * w całości. Daje to minimalną liczbę fragmentów dla danego pliku.
+ * Wynik (tablica z malloc) trafia do *fragsOut i *countOut.
+ */
+int allocateFragments(Disk *disk, int64_t blocksNeeded, Fragment **fragsOut, int *countOut) {
+    *fragsOut = NULL;
+    *countOut = 0;
+    if (blocksNeeded <= 0) return 0; 
+
+    int64_t started = phaseStart();
+    FreeExtents *freeExtents = &disk->freeExtents;
+    Fragment *frags = NULL;
+    int capacity = 0;
+    int64_t allocated = 0;
+    int fragIndex = 0;
+    while (allocated < blocksNeeded && freeExtents->count > 0) {
+        if (fragIndex == capacity) {
+            int newCapacity = capacity ? capacity * 2 : MAX_FRAGS;
+            Fragment *grown = realloc(frags, newCapacity * sizeof(Fragment));
+            if (!grown) break;
+            frags = grown;
+            capacity = newCapacity;
+        }
+        int64_t remaining = blocksNeeded - allocated;
+        Fragment key = { -1, remaining };
+        int pos = lowerBound(freeExtents->byLength, freeExtents->count, &key, compareByLength);
+        if (pos == freeExtents->count) {
+            pos = freeExtents->count - 1;
+        }
+        int64_t start = freeExtents->byLength[pos].startBlock;
+        int64_t length = freeExtents->byLength[pos].blockCount;
+        if (length > remaining) {
+            length = remaining;
+        }
+        if (takeFreeExtent(freeExtents, start, length) < 0) {
+            break;
+        }
+        frags[fragIndex].startBlock = start;
+        frags[fragIndex].blockCount = length;
+        fragIndex++;
+        markDiskBlocks(disk, start, length, 1);
+        allocated += length;
+    }
+    disk->superBlock.freeBlocks -= allocated;
+    if (allocated < blocksNeeded) {
+        releaseFragments(disk, frags, fragIndex);
+        free(frags);
+        phaseEnd(PHASE_ALLOC, started);
+        return -1;
+    }
+    *fragsOut = frags;
+    *countOut = fragIndex;
+    phaseEnd(PHASE_ALLOC, started);
+    return 0;
+}
+
+/*
+ * Zapisuje listę fragmentów do i-węzła: pierwsze MAX_FRAGS bezpośrednio,
+ * resztę do nowo przydzielonych bloków ekstentów (zapisywanych od razu,
+ * i-węzeł trzeba potem zatwierdzić). Stary łańcuch musi być już zwolniony.
+ */
+int setFileExtents(Disk *disk, Inode *ino, const Fragment *frags, int count) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int direct = count < MAX_FRAGS ? count : MAX_FRAGS;
+    statFile(count);
+    for (int f = 0; f < MAX_FRAGS; f++) {
+        ino->fragments[f].startBlock = (f < direct) ? frags[f].startBlock : -1;
+        ino->fragments[f].blockCount = (f < direct) ? frags[f].blockCount : 0;
+    }
+    ino->fragmentsCount = count;
+    ino->extentBlock = -1;
+    if (count == direct) return 0;
+
+    int perBlock = extentsPerBlock(superBlock);
+    int chainLength = (count - direct + perBlock - 1) / perBlock;
+    Fragment *chain = NULL;
+    int chainFrags = 0;
+    if (allocateFragments(disk, chainLength, &chain, &chainFrags) < 0) {
+        return -1;
+    }
+    int64_t *blocks = malloc(chainLength * sizeof(int64_t));
+    char *buf = calloc(1, superBlock->blockSize);
+    int rc = (blocks && buf) ? 0 : -1;
+    for (int f = 0, n = 0; rc == 0 && f < chainFrags; f++) {
+        for (int64_t k = 0; k < chain[f].blockCount; k++) {
+            blocks[n++] = chain[f].startBlock + k;
+        }
+    }
+    int next = direct;
+    for (int n = 0; rc == 0 && n < chainLength; n++) {
+        ExtentBlockHeader *header = (ExtentBlockHeader *)buf;
+        header->count = (count - next < perBlock) ? count - next : perBlock;
+        header->next = (n + 1 < chainLength) ? blocks[n + 1] : -1;
+        memcpy(buf + sizeof(ExtentBlockHeader), &frags[next], header->count * sizeof(Fragment));
+        next += header->count;
+        rc = writeDataBlocks(disk, blocks[n], buf, superBlock->blockSize);
+    }
+    if (rc == 0) {
+        ino->extentBlock = blocks[0];
+    } else {
+        releaseFragments(disk, chain, chainFrags);
+    }
+    free(blocks);
+    free(buf);
+    free(chain);
+    return rc;
+}
+
+/* Zwalnia wszystkie bloki pliku, także bloki ekstentów (bez zmiany samego i-węzła). */
+int64_t freeFileBlocks(Disk *disk, const Inode *ino) {
+    FileExtents fe;
+    if (loadFileExtents(disk, ino, &fe) < 0) {
+        return -1;
+    }
+    releaseFragments(disk, fe.frags, fe.count);
+    for (int n = 0; n < fe.extentBlockCount; n++) {
+        Fragment one = { fe.extentBlocks[n], 1 };
+        releaseFragments(disk, &one, 1);
+    }
+    int64_t totalBlocksFreed = fe.logicalStart[fe.count] + fe.extentBlockCount;
+    freeFileExtents(&fe);
+    return totalBlocksFreed;
+}
+
+/*
+ * Jak freeFileBlocks, ale bloki pliku są tylko dopisywane do *deferred,
+ * a zwalnia je releaseFragments dopiero po zatwierdzeniu usunięcia.
+ */
+int deferFileBlocks(const Disk *disk, const Inode *ino, Fragment **deferred, int *count, int *capacity) {
+    FileExtents fe;
+    if (loadFileExtents(disk, ino, &fe) < 0) {
+        return -1;
+    }
+    int rc = 0;
+    for (int f = 0; f < fe.count && rc == 0; f++) {
+        if (fe.frags[f].startBlock == HOLE_BLOCK) continue;
+        rc = addExtent(deferred, count, capacity, fe.frags[f].startBlock, fe.frags[f].blockCount);
+    }
+    for (int n = 0; n < fe.extentBlockCount && rc == 0; n++) {
+        rc = addExtent(deferred, count, capacity, fe.extentBlocks[n], 1);
+    }
+    freeFileExtents(&fe);
+    return rc;
+}
+
+/*
+ * Oddaje do puli bloki odłożone przez rm (albo defrag) i zatwierdza
+ * wszystko jedną transakcją, więc zwolnienie trafia do obrazu razem
+ * z usunięciem.
+ */
+int commitBatch(Disk *disk, Fragment *deferred, int *deferredCount) {
+    releaseFragments(disk, deferred, *deferredCount);
+    *deferredCount = 0;
+    return commitDisk(disk);
+}
+
+/*
+ * Kolejka zadań kopiowania między plikami a rozłącznymi obszarami
+ * obrazu. Zadania wykonuje pula wątków (pread/pwrite po jawnych
+ * przesunięciach, więc wspólne deskryptory im nie przeszkadzają), a w
+ * kierunku z dysku do pliku - jeśli się da - io_uring. Duże fragmenty
+ * są dzielone na zadania po COPY_JOB_BYTES, żeby wątki były równo
+ * obciążone. failed[file] ustawiane jest dla plików z nieudanym zadaniem.
+ */
+typedef struct {
+    int file;
+    off_t fileOffset;
+    off_t diskOffset;
+    size_t len;
+} CopyJob;
+
+typedef struct {
+    Disk *disk;
+    const int *fds;
+    int toDisk;
+    int *failed;
+    CopyJob *jobs;
+    int jobCount;
+    int nextJob;
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_t lock;
+#endif
+} CopyQueue;
+
+void *copyWorker(void *arg) {
+    CopyQueue *q = arg;
+    for (;;) {
+#if defined(HAVE_PTHREAD)
+        pthread_mutex_lock(&q->lock);
+#endif
+        int j = q->nextJob++;
+#if defined(HAVE_PTHREAD)
+        pthread_mutex_unlock(&q->lock);
+#endif
+        if (j >= q->jobCount) break;
+        const CopyJob *job = &q->jobs[j];
+        int rc = q->toDisk
+                 ? copyToDisk(q->disk, q->fds[job->file], job->fileOffset, job->diskOffset, job->len)
+                 : copyFromDisk(q->disk, job->diskOffset, q->fds[job->file], job->fileOffset, job->len);
+        if (rc < 0) {
+#if defined(HAVE_PTHREAD)
+            pthread_mutex_lock(&q->lock);
+#endif
+            q->failed[job->file] = 1;
+#if defined(HAVE_PTHREAD)
+            pthread_mutex_unlock(&q->lock);
+#endif
+        }
+    }
+    return NULL;
+}
+
+/* Uruchamia worker(arg) na threads wątkach (w tym bieżącym) i czeka na wszystkie. */
+void runThreads(void *(*worker)(void *), void *arg, int threads) {
+#if defined(HAVE_PTHREAD)
+    pthread_t workers[MAX_COPY_THREADS];
+    int started = 0;
+    while (started < threads - 1 && started < MAX_COPY_THREADS &&
+           pthread_create(&workers[started], NULL, worker, arg) == 0) {
+        started++;
+    }
+    worker(arg);
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+#else
+    (void)threads;
+    worker(arg);
+#endif
+}
+
+/* Wykonuje zadania kolejki na threads wątkach (w tym bieżącym). */
+void runCopyJobs(CopyQueue *q, int threads) {
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_init(&q->lock, NULL);
+#endif
+    runThreads(copyWorker, q, threads);
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_destroy(&q->lock);
+#endif
+}
+
+int copyThreadCount(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return 1;
+    return cpus > MAX_COPY_THREADS ? MAX_COPY_THREADS : (int)cpus;
+}
+
+#if defined(HAVE_IO_URING)
+/* Minimalna obsługa io_uring bezpośrednio przez wywołania systemowe (bez liburing). */
+typedef struct {
+    int fd;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned toSubmit;
+} Ring;
+
+void ringClose(Ring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing) munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing) munmap(ring->sqRing, ring->sqRingSize);
+    if (ring->fd >= 0) close(ring->fd);
+}
+
+int ringSetup(Ring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -1;
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sq = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    void *cq = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    ring->sqRing = (sq == MAP_FAILED) ? NULL : sq;
+    ring->cqRing = (cq == MAP_FAILED) ? NULL : cq;
+    ring->sqes = (sqes == MAP_FAILED) ? NULL : sqes;
+    if (!ring->sqRing || !ring->cqRing || !ring->sqes) {
+        ringClose(ring);
+        return -1;
+    }
+    ring->sqTail = (unsigned *)((char *)sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)((char *)sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)((char *)sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)((char *)cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)((char *)cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)((char *)cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)cq + params.cq_off.cqes);
+    return 0;
+}
+
+void ringPrep(Ring *ring, int opcode, int fd, void *addr, size_t len, off_t offset,
+              int flags, uint64_t userData) {
+    unsigned tail = *ring->sqTail;
+    unsigned idx = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = (unsigned)len;
+    sqe->off = (uint64_t)offset;
+    sqe->flags = flags;
+    sqe->user_data = userData;
+    ring->sqArray[idx] = idx;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+}
+
+/* Wysyła przygotowane zgłoszenia i czeka na co najmniej minComplete zakończeń. */
+int ringEnter(Ring *ring, unsigned minComplete) {
+    for (;;) {
+        long r = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, minComplete,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        statAdd(&globalStats.syscalls, 1);
+        if (r >= 0) {
+            ring->toSubmit = 0;
+            return 0;
+        }
+        if (errno != EINTR) return -1;
+    }
+}
+
+typedef struct {
+    char *buf;
+    off_t diskOffset;
+    off_t fileOffset;
+    size_t len;
+    size_t padded;
+    int busy;
+    int failed;
+} IoSlot;
+
+/*
+ * Kopiuje zadania z dysku do outFd przez io_uring: do depth kawałków
+ * (każdy z własnym buforem) jest w locie naraz. Odczyt całych bloków
+ * kawałka wraca do nas, żeby sprawdzić sumy kontrolne, i dopiero wtedy
+ * zgłaszany jest zapis; przy zmapowanym obrazie sumy sprawdzamy od
+ * razu i wystarczy sam zapis prosto z mapowania. Kawałek, który wrócił
+ * z błędem lub niepełny, jest kopiowany jeszcze raz przez copyFromDisk. Zwraca 0, gdy io_uring
+ * jest niedostępny (nic nie zostało skopiowane), 1 gdy kopiowanie się
+ * odbyło - wynik jest wtedy w *result.
+ */
+int uringCopyOut(Disk *disk, int outFd, const CopyJob *jobs, int jobCount, int depth, int *result) {
+    Ring ring;
+    if (ringSetup(&ring, 2 * depth) < 0) return 0;
+    IoSlot *slots = calloc(depth, sizeof(IoSlot));
+    int ok = slots != NULL;
+    for (int s = 0; ok && s < depth && !disk->map; s++) {
+        if (posix_memalign((void **)&slots[s].buf, COPY_BUF_ALIGN, COPY_BUF_SIZE) != 0) {
+            slots[s].buf = NULL;
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        for (int s = 0; slots && s < depth; s++) free(slots[s].buf);
+        free(slots);
+        ringClose(&ring);
+        return 0;
+    }
+
+    int rc = 0, job = 0, inFlight = 0;
+    size_t done = 0;
+    while (job < jobCount || inFlight > 0) {
+        for (int s = 0; s < depth && job < jobCount; s++) {
+            IoSlot *slot = &slots[s];
+            if (slot->busy) continue;
+            slot->len = jobs[job].len - done;
+            if (slot->len > COPY_BUF_SIZE) slot->len = COPY_BUF_SIZE;
+            slot->diskOffset = jobs[job].diskOffset + done;
+            slot->fileOffset = jobs[job].fileOffset + done;
+            slot->padded = ALIGN_UP(slot->len, (size_t)disk->superBlock.blockSize);
+            slot->failed = 0;
+            done += slot->len;
+            if (done == jobs[job].len) {
+                job++;
+                done = 0;
+            }
+            if (disk->map) {
+                if ((size_t)slot->diskOffset + slot->padded > disk->mapSize ||
+                    verifyChecksums(disk, blockAtOffset(&disk->superBlock, slot->diskOffset),
+                                    (const char *)disk->map + slot->diskOffset, slot->padded) < 0) {
+                    rc = -1;
+                    continue;
+                }
+                ringPrep(&ring, IORING_OP_WRITE, outFd, disk->map + slot->diskOffset, slot->len,
+                         slot->fileOffset, 0, 2 * s + 1);
+            } else {
+                ringPrep(&ring, IORING_OP_READ, disk->fd, slot->buf, slot->padded,
+                         slot->diskOffset, 0, 2 * s);
+            }
+            statDiskIo(0, slot->diskOffset, slot->padded);
+            slot->busy = 1;
+            inFlight++;
+        }
+        if (inFlight == 0) continue;
+        if (ringEnter(&ring, 1) < 0) {
+            /* Zgłoszenia mogą być jeszcze w jądrze, więc bufory zostają. */
+            ringClose(&ring);
+            *result = -1;
+            return 1;
+        }
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            int s = (int)(cqe->user_data / 2);
+            IoSlot *slot = &slots[s];
+            int isWrite = (int)(cqe->user_data & 1);
+            if (cqe->res < 0 || (size_t)cqe->res != (isWrite ? slot->len : slot->padded)) {
+                slot->failed = 1;
+            }
+            if (!isWrite && !slot->failed) {
+                if (verifyChecksums(disk, blockAtOffset(&disk->superBlock, slot->diskOffset),
+                                    slot->buf, slot->padded) == 0) {
+                    ringPrep(&ring, IORING_OP_WRITE, outFd, slot->buf, slot->len,
+                             slot->fileOffset, 0, 2 * s + 1);
+                    continue;
+                }
+                rc = -1;
+            } else if (slot->failed && copyFromDisk(disk, slot->diskOffset, outFd,
+                                                    slot->fileOffset, slot->len) < 0) {
+                rc = -1;
+            }
+            slot->busy = 0;
+            inFlight--;
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+    for (int s = 0; s < depth; s++) free(slots[s].buf);
+    free(slots);
+    ringClose(&ring);
+    *result = rc;
+    return 1;
+}
+#endif
+
+/*
+ * Kopiuje zadania z dysku do jednego pliku outFd, trzymając do
+ * globalQueueDepth operacji w locie: przez io_uring, a gdy go nie ma -
+ * pulą wątków z pread/pwrite.
+ */
+int copyOutJobs(Disk *disk, int outFd, CopyJob *jobs, int jobCount) {
+    int depth = globalQueueDepth;
+#if defined(HAVE_IO_URING)
+    int result = 0;
+    if (uringCopyOut(disk, outFd, jobs, jobCount, depth, &result)) {
+        return result;
+    }
+#endif
+    int failed = 0;
+    CopyQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.disk = disk;
+    queue.fds = &outFd;
+    queue.toDisk = 0;
+    queue.failed = &failed;
+    queue.jobs = jobs;
+    queue.jobCount = jobCount;
+    int threads = depth < MAX_COPY_THREADS ? depth : MAX_COPY_THREADS;
+    runCopyJobs(&queue, jobCount < threads ? jobCount : threads);
+    return failed ? -1 : 0;
+}
+
+/*
+ * Szuka w indeksie odcisków zajętego bloku o tej samej zawartości co
+ * data (porównując go bajt po bajcie w scratch). Zwraca numer bloku,
+ * który można współdzielić, albo -1.
+ */
+int64_t findDuplicate(const Disk *disk, uint64_t hash, const void *data, void *scratch) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int64_t mask = superBlock->fingerprintCount - 1;
+    for (int p = 0; p < FINGERPRINT_PROBE; p++) {
+        const Fingerprint *fp = &disk->fingerprints[(hash + p) & mask];
+        if (fp->blockPlusOne == 0) break;
+        int64_t block = fp->blockPlusOne - 1;
+        if (fp->hash != hash || block >= superBlock->blockCount ||
+            !isBlockUsed(disk->blockMap, block) || disk->refCounts[block] >= REF_COUNT_MAX) {
+            continue;
+        }
+        if (diskRead(disk, scratch, superBlock->blockSize, getBlockOffset(superBlock, block)) == 0 &&
+            memcmp(scratch, data, superBlock->blockSize) == 0) {
+            return block;
+        }
+    }
+    return -1;
+}
+
+/* Zapamiętuje odcisk bloku; przy pełnym oknie nadpisuje najstarszy wpis. */
+void rememberBlock(Disk *disk, uint64_t hash, int64_t block) {
+    int64_t mask = disk->superBlock.fingerprintCount - 1;
+    int64_t slot = hash & mask;
+    for (int p = 0; p < FINGERPRINT_PROBE; p++) {
+        const Fingerprint *fp = &disk->fingerprints[(hash + p) & mask];
+        if (fp->blockPlusOne == 0 || fp->hash == hash) {
+            slot = (hash + p) & mask;
+            break;
+        }
+    }
+    disk->fingerprints[slot].hash = hash;
+    disk->fingerprints[slot].blockPlusOne = block + 1;
+    markDirtyRange(&disk->fingerprintChunks, slot * sizeof(Fingerprint), sizeof(Fingerprint));
+}
+
+/*
+ * Przydziela i zapisuje bloki [first, first+count) bufora buf (bytes
+ * bajtów danych, blok 0 bufora to logiczny blok base pliku), dopisuje
+ * je do listy fragmentów i zapamiętuje odciski pełnych bloków.
+ */
+int writeNewBlocks(Disk *disk, const char *buf, size_t bytes, const uint64_t *hashes,
+                   int first, int count, Fragment **frags, int *fragCount, int *capacity) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int blockSize = superBlock->blockSize;
+    Fragment *run = NULL;
+    int runCount = 0;
+    if (allocateFragments(disk, count, &run, &runCount) < 0) return -2;
+    if (*fragCount + runCount > *capacity) {
+        int newCapacity = (*fragCount + runCount) * 2;
+        Fragment *grown = realloc(*frags, newCapacity * sizeof(Fragment));
+        if (!grown) {
+            releaseFragments(disk, run, runCount);
+            free(run);
+            return -1;
+        }
+        *frags = grown;
+        *capacity = newCapacity;
+    }
+    int k = first;
+    for (int r = 0; r < runCount; r++) {
+        size_t offset = (size_t)k * blockSize;
+        size_t len = (size_t)run[r].blockCount * blockSize;
+        if (len > bytes - offset) len = bytes - offset;
+        if (writeDataBlocks(disk, run[r].startBlock, buf + offset, len) < 0) {
+            releaseFragments(disk, run, runCount);
+            free(run);
+            return -1;
+        }
+        appendFragment(*frags, fragCount, run[r].startBlock, run[r].blockCount);
+        for (int64_t b = 0; b < run[r].blockCount; b++, k++) {
+            if ((size_t)(k + 1) * blockSize <= bytes) {
+                rememberBlock(disk, hashes[k], run[r].startBlock + b);
+            }
+        }
+    }
+    free(run);
+    return 0;
+}
+
+/*
+ * Szuka w seen (tablica z haszowaniem otwartym, mask + 1 pozycji,
+ * numery bloków porcji + 1) wcześniejszego bloku porcji z odciskiem
+ * hashes[k] i zapamiętuje tam k. Zwraca numer znalezionego bloku albo -1.
+ */
+int seenInBuffer(int *seen, int mask, const uint64_t *hashes, int k) {
+    for (int slot = (int)(hashes[k] & mask); ; slot = (slot + 1) & mask) {
+        if (seen[slot] == 0 || hashes[seen[slot] - 1] == hashes[k]) {
+            int earlier = seen[slot] - 1;
+            seen[slot] = k + 1;
+            return earlier;
+        }
+    }
+}
+
+/*
+ * copyin z deduplikacją: plik jest czytany porcjami po COPY_BUF_SIZE,
+ * każdy pełny blok szukany w indeksie odcisków, a znaleziony duplikat
+ * dostaje kolejne odwołanie zamiast nowego bloku. Ciągi bloków bez
+ * duplikatu są przydzielane i zapisywane razem - chyba że blok powtarza
+ * jeszcze niezapisany blok tej samej porcji, wtedy zaległy ciąg jest
+ * zapisywany wcześniej, żeby duplikat mógł go znaleźć. Lista fragmentów trafia
+ * do *fragsOut, a liczba współdzielonych bloków do *sharedOut; przy
+ * błędzie wszystko jest już zwolnione.
+ */
+int dedupCopyIn(Disk *disk, int srcFd, const char *srcFile, int64_t fileSize,
+                Fragment **fragsOut, int *countOut, int64_t *sharedOut) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int blockSize = superBlock->blockSize;
+    int64_t blocksNeeded = (fileSize + blockSize - 1) / blockSize;
+    int perBuffer = COPY_BUF_SIZE / blockSize > 0 ? COPY_BUF_SIZE / blockSize : 1;
+    char *buf = malloc((size_t)perBuffer * blockSize);
+    char *scratch = malloc(blockSize);
+    uint64_t *hashes = malloc(perBuffer * sizeof(uint64_t));
+    int seenMask = 1;
+    while (seenMask < 2 * perBuffer) seenMask = seenMask * 2 + 1;
+    int *seen = malloc((seenMask + 1) * sizeof(int));
+    Fragment *frags = NULL;
+    int fragCount = 0, capacity = 0;
+    int64_t shared = 0;
+    int rc = (buf && scratch && hashes && seen) ? 0 : -1;
+    for (int64_t base = 0; rc == 0 && base < blocksNeeded; base += perBuffer) {
+        int n = (blocksNeeded - base < perBuffer) ? (int)(blocksNeeded - base) : perBuffer;
+        size_t bytes = (size_t)n * blockSize;
+        if ((int64_t)bytes > fileSize - base * blockSize) bytes = fileSize - base * blockSize;
+        if (readAt(srcFd, buf, bytes, base * blockSize) < 0) {
+            rc = -1;
+            break;
+        }
+        int pending = 0;
+        memset(seen, 0, (seenMask + 1) * sizeof(int));
+        for (int k = 0; rc == 0 && k <= n; k++) {
+            int64_t dup = -1;
+            size_t offset = (size_t)k * blockSize;
+            size_t len = bytes - offset < (size_t)blockSize ? bytes - offset : (size_t)blockSize;
+            int zero = k < n && isZeroBlock(buf + offset, len);
+            if (k < n && !zero && offset + blockSize <= bytes) {
+                hashes[k] = blockHash64(buf + offset, blockSize);
+                if (seenInBuffer(seen, seenMask, hashes, k) >= pending && k > pending) {
+                    rc = writeNewBlocks(disk, buf, bytes, hashes, pending, k - pending,
+                                        &frags, &fragCount, &capacity);
+                    pending = k;
+                }
+                if (rc == 0) dup = findDuplicate(disk, hashes[k], buf + offset, scratch);
+            }
+            if (k < n && dup < 0 && !zero) continue;
+            if (k > pending) {
+                rc = writeNewBlocks(disk, buf, bytes, hashes, pending, k - pending,
+                                    &frags, &fragCount, &capacity);
+            }
+            if (rc == 0 && (dup >= 0 || zero)) {
+                /* Blok z samych zer nie zajmuje miejsca - zostaje dziurą. */
+                rc = addExtent(&frags, &fragCount, &capacity, zero ? HOLE_BLOCK : dup, 1);
+                if (rc == 0 && dup >= 0) {
+                    addReference(disk, dup);
+                    shared++;
+                }
+            }
+            pending = k + 1;
+        }
+    }
+    if (rc == -2) {
+        printf("Brak miejsca na dysku (pozostale miejsce = %" PRId64 ", potrzebne miejsce = %" PRId64 ").\n",
+               superBlock->freeBlocks * blockSize, fileSize);
+    } else if (rc < 0) {
+        fprintf(stderr, "Błąd kopiowania danych z pliku %s.\n", srcFile);
+    }
+    if (rc < 0) {
+        releaseFragments(disk, frags, fragCount);
+        free(frags);
+        frags = NULL;
+        fragCount = 0;
+    }
+    free(buf);
+    free(scratch);
+    free(hashes);
+    free(seen);
+    *fragsOut = frags;
+    *countOut = fragCount;
+    *sharedOut = shared;
+    return rc < 0 ? -1 : 0;
+}
+
+/*
+ * Wbudowany kodek z rodziny LZ (format sekwencji jak w LZ4): bajt
+ * sterujący z długością literałów (górne 4 bity) i dopasowania minus
+ * LZ_MIN_MATCH (dolne 4 bity), długości >= 15 przedłużane bajtami 255,
+ * literały, 2-bajtowe przesunięcie wstecz. Ostatnia sekwencja ma same
+ * literały. Przesunięcie ma 16 bitów, więc dalsze dopasowania są
+ * pomijane.
+ */
+int lzPutLength(unsigned char *dst, int cap, int out, int len) {
+    while (len >= 255) {
+        if (out >= cap) return -1;
+        dst[out++] = 255;
+        len -= 255;
+    }
+    if (out >= cap) return -1;
+    dst[out++] = (unsigned char)len;
+    return out;
+}
+
+int lzEmit(unsigned char *dst, int cap, int out, const unsigned char *literals, int literalCount,
+           int offset, int matchLength) {
+    int matchCode = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+    if (out >= cap) return -1;
+    dst[out++] = (unsigned char)(((literalCount < 15 ? literalCount : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+    if (literalCount >= 15 && (out = lzPutLength(dst, cap, out, literalCount - 15)) < 0) return -1;
+    if (literalCount > cap - out) return -1;
+    memcpy(dst + out, literals, literalCount);
+    out += literalCount;
+    if (matchLength == 0) return out;
+    if (cap - out < 2) return -1;
+    dst[out++] = (unsigned char)(offset & 0xff);
+    dst[out++] = (unsigned char)(offset >> 8);
+    if (matchCode >= 15 && (out = lzPutLength(dst, cap, out, matchCode - 15)) < 0) return -1;
+    return out;
+}
+
+/* Kompresuje src do dst; zwraca długość wyniku albo -1, gdy nie mieści się w cap. */
+int lzCompress(const unsigned char *src, int len, unsigned char *dst, int cap) {
+    int *table = malloc(sizeof(int) << LZ_HASH_BITS);
+    if (!table) return -1;
+    for (int h = 0; h < (1 << LZ_HASH_BITS); h++) {
+        table[h] = -1;
+    }
+    int anchor = 0, i = 0, out = 0;
+    while (i + LZ_MIN_MATCH <= len && out >= 0) {
+        uint32_t seq;
+        memcpy(&seq, src + i, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = i;
+        if (ref < 0 || i - ref > 0xffff || memcmp(src + ref, src + i, LZ_MIN_MATCH) != 0) {
+            /* Im dłużej bez dopasowania, tym większe kroki - szybciej przez dane nieściśliwe. */
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+        int m = LZ_MIN_MATCH;
+        while (i + m < len && src[ref + m] == src[i + m]) m++;
+        out = lzEmit(dst, cap, out, src + anchor, i - anchor, i - ref, m);
+        i += m;
+        anchor = i;
+    }
+    if (out >= 0) {
+        out = lzEmit(dst, cap, out, src + anchor, len - anchor, 0, 0);
+    }
+    free(table);
+    return out;
+}
+
+/* Rozpakowuje src do dst (dokładnie dstLen bajtów); -1 przy uszkodzonych danych. */
+int lzDecompress(const unsigned char *src, int srcLen, unsigned char *dst, int dstLen) {
+    int ip = 0, op = 0;
+    while (ip < srcLen) {
+        int token = src[ip++];
+        int literalCount = token >> 4;
+        if (literalCount == 15) {
+            int b;
+            do {
+                if (ip >= srcLen) return -1;
+                b = src[ip++];
+                literalCount += b;
+            } while (b == 255);
+        }
+        if (literalCount > srcLen - ip || literalCount > dstLen - op) return -1;
+        memcpy(dst + op, src + ip, literalCount);
+        ip += literalCount;
+        op += literalCount;
+        if (ip == srcLen) break;
+        if (srcLen - ip < 2) return -1;
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int matchLength = token & 15;
+        if (matchLength == 15) {
+            int b;
+            do {
+                if (ip >= srcLen) return -1;
+                b = src[ip++];
+                matchLength += b;
+            } while (b == 255);
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || matchLength > dstLen - op) return -1;
+        if (offset >= matchLength) {
+            memcpy(dst + op, dst + op - offset, matchLength);
+        } else {
+            for (int k = 0; k < matchLength; k++) {
+                dst[op + k] = dst[op - offset + k];
+            }
+        }
+        op += matchLength;
+    }
+    return op == dstLen ? op : -1;
+}
+
+/* Czyta (write=0) lub zapisuje len bajtów zawartości bloków pliku od bajtu offset; dziura czyta się jako zera. */
+int fileBytesIo(Disk *disk, const FileExtents *fe, int64_t offset, void *buf, size_t len, int write) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int blockSize = superBlock->blockSize;
+    char *p = buf;
+    for (int f = findExtent(fe, offset / blockSize); len > 0; f++) {
+        if (f < 0 || f >= fe->count) return -1;
+        int64_t fragStart = fe->logicalStart[f] * blockSize;
+        int64_t fragEnd = fragStart + fe->frags[f].blockCount * blockSize;
+        size_t n = (int64_t)len < fragEnd - offset ? len : (size_t)(fragEnd - offset);
+        off_t diskOffset = getBlockOffset(superBlock, fe->frags[f].startBlock) + (offset - fragStart);
+        if (fe->frags[f].startBlock == HOLE_BLOCK) {
+            if (write) return -1;
+            memset(p, 0, n);
+        } else if ((write ? diskWrite(disk, p, n, diskOffset) : diskRead(disk, p, n, diskOffset)) < 0) {
+            return -1;
+        }
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Sprawdza sumy count bloków pliku od bloku logicznego first, wczytanych już do data. */
+int verifyFileBlocks(const Disk *disk, const FileExtents *fe, int64_t first, const char *data, int64_t count) {
+    int blockSize = disk->superBlock.blockSize;
+    for (int f = findExtent(fe, first); count > 0; f++) {
+        if (f < 0 || f >= fe->count) return -1;
+        int64_t skip = first - fe->logicalStart[f];
+        int64_t n = fe->frags[f].blockCount - skip < count ? fe->frags[f].blockCount - skip : count;
+        if (fe->frags[f].startBlock != HOLE_BLOCK &&
+            verifyChecksums(disk, fe->frags[f].startBlock + skip, data, n * blockSize) < 0) return -1;
+        data += n * blockSize;
+        first += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/*
+ * copyin z kompresją: przydziela bloki na najgorszy przypadek (nagłówek,
+ * tablica i plik bez kompresji), kompresuje plik kawałkami po
+ * COMPRESS_CHUNK prosto do tych bloków, a nieużyty koniec oddaje. Lista
+ * fragmentów trafia do *fragsOut; przy błędzie wszystko jest zwolnione.
+ */
+int compressCopyIn(Disk *disk, int srcFd, const char *srcFile, int64_t fileSize,
+                   Fragment **fragsOut, int *countOut) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int blockSize = superBlock->blockSize;
+    CompressedHeader header = { COMPRESS_CHUNK, 0, (fileSize + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK };
+    int64_t tableBytes = sizeof(header) + header.chunkCount * (int64_t)sizeof(uint32_t);
+    int64_t reserved = (tableBytes + fileSize + blockSize - 1) / blockSize;
+    FileExtents fe;
+    memset(&fe, 0, sizeof(fe));
+    *fragsOut = NULL;
+    *countOut = 0;
+    if (allocateFragments(disk, reserved, &fe.frags, &fe.count) < 0) {
+        printf("Brak miejsca na dysku (pozostale miejsce = %" PRId64 ", potrzebne miejsce = %" PRId64 ").\n",
+               superBlock->freeBlocks * blockSize, tableBytes + fileSize);
+        return -1;
+    }
+    fe.logicalStart = malloc((fe.count + 1) * sizeof(int64_t));
+    uint32_t *lengths = malloc(header.chunkCount * sizeof(uint32_t) + 1);
+    unsigned char *raw = malloc(COMPRESS_CHUNK);
+    unsigned char *packed = malloc(COMPRESS_CHUNK);
+    int rc = (fe.logicalStart && lengths && raw && packed) ? 0 : -1;
+    int64_t stored = tableBytes;
+    if (rc == 0) computeLogicalStarts(&fe);
+    for (int64_t c = 0; rc == 0 && c < header.chunkCount; c++) {
+        int len = (fileSize - c * COMPRESS_CHUNK < COMPRESS_CHUNK) ? (int)(fileSize - c * COMPRESS_CHUNK)
+                                                                   : COMPRESS_CHUNK;
+        if (readAt(srcFd, raw, len, c * COMPRESS_CHUNK) < 0) {
+            rc = -1;
+            break;
+        }
+        int packedLength = lzCompress(raw, len, packed, len - 1);
+        if (packedLength > 0) {
+            lengths[c] = packedLength;
+            rc = fileBytesIo(disk, &fe, stored, packed, packedLength, 1);
+            stored += packedLength;
+        } else {
+            lengths[c] = len | CHUNK_RAW;
+            rc = fileBytesIo(disk, &fe, stored, raw, len, 1);
+            stored += len;
+        }
+    }
+    if (rc == 0) {
+        rc = fileBytesIo(disk, &fe, 0, &header, sizeof(header), 1);
+    }
+    if (rc == 0) {
+        rc = fileBytesIo(disk, &fe, sizeof(header), lengths, header.chunkCount * sizeof(uint32_t), 1);
+    }
+    Fragment *frags = NULL;
+    int fragCount = 0;
+    int64_t used = (stored + blockSize - 1) / blockSize;
+    if (rc == 0 && used * blockSize > stored) {
+        char *zeros = calloc(1, used * blockSize - stored);
+        rc = zeros ? fileBytesIo(disk, &fe, stored, zeros, used * blockSize - stored, 1) : -1;
+        free(zeros);
+    }
+    if (rc == 0) {
+        frags = malloc((fe.count + 1) * sizeof(Fragment));
+        Fragment *tail = malloc((fe.count + 1) * sizeof(Fragment));
+        if (frags && tail) {
+            fragCount = sliceExtents(&fe, 0, used, frags);
+            releaseFragments(disk, tail, sliceExtents(&fe, used, reserved - used, tail));
+        } else {
+            rc = -1;
+        }
+        free(tail);
+    }
+    /* Kawałki nie są wyrównane do bloków, więc sumy liczymy z tego, co już leży na dysku. */
+    for (int f = 0; rc == 0 && f < fragCount; f++) {
+        rc = rechecksumBlocks(disk, frags[f].startBlock, frags[f].blockCount);
+    }
+    if (rc < 0) {
+        fprintf(stderr, "Błąd kopiowania danych z pliku %s.\n", srcFile);
+        releaseFragments(disk, fe.frags, fe.count);
+        free(frags);
+        frags = NULL;
+        fragCount = 0;
+    }
+    freeFileExtents(&fe);
+    free(lengths);
+    free(raw);
+    free(packed);
+    *fragsOut = frags;
+    *countOut = fragCount;
+    return rc;
+}
+
+/* Nagłówek skompresowanego pliku z długościami i położeniami (w pliku) kawałków. */
+typedef struct {
+    CompressedHeader header;
+    uint32_t *lengths;
+    int64_t *offsets;
+} ChunkTable;
+
+void freeChunkTable(ChunkTable *table) {
+    free(table->lengths);
+    free(table->offsets);
+    memset(table, 0, sizeof(*table));
+}
+
+/* Wczytuje i sprawdza nagłówek oraz tablicę długości kawałków pliku z INODE_COMPRESSED. */
+int loadChunkTable(Disk *disk, const Inode *ino, const FileExtents *fe, ChunkTable *table) {
+    CompressedHeader *header = &table->header;
+    memset(table, 0, sizeof(*table));
+    int64_t storedBytes = fe->logicalStart[fe->count] * disk->superBlock.blockSize;
+    if (fileBytesIo(disk, fe, 0, header, sizeof(*header), 0) < 0 ||
+        header->chunkSize <= 0 || header->chunkSize > MAX_COMPRESS_CHUNK ||
+        header->chunkCount != (ino->fileSize + header->chunkSize - 1) / header->chunkSize) {
+        fprintf(stderr, "Uszkodzony nagłówek skompresowanego pliku '%s'.\n", ino->fileName);
+        return -1;
+    }
+    table->lengths = malloc(header->chunkCount * sizeof(uint32_t) + 1);
+    table->offsets = malloc(header->chunkCount * sizeof(int64_t) + 1);
+    int rc = (table->lengths && table->offsets) ? 0 : -1;
+    if (rc == 0) {
+        rc = fileBytesIo(disk, fe, sizeof(*header), table->lengths, header->chunkCount * sizeof(uint32_t), 0);
+    }
+    int64_t offset = sizeof(*header) + header->chunkCount * (int64_t)sizeof(uint32_t);
+    if (rc == 0 && offset <= storedBytes) {
+        int blockSize = disk->superBlock.blockSize;
+        int64_t tableBlocks = (offset + blockSize - 1) / blockSize;
+        char *blocks = malloc(tableBlocks * blockSize);
+        rc = blocks ? fileBytesIo(disk, fe, 0, blocks, tableBlocks * blockSize, 0) : -1;
+        if (rc == 0) rc = verifyFileBlocks(disk, fe, 0, blocks, tableBlocks);
+        free(blocks);
+    }
+    for (int64_t c = 0; rc == 0 && c < header->chunkCount; c++) {
+        table->offsets[c] = offset;
+        offset += table->lengths[c] & ~CHUNK_RAW;
+        if (offset > storedBytes) rc = -1;
+    }
+    if (rc < 0) {
+        fprintf(stderr, "Błąd rozpakowywania pliku '%s'.\n", ino->fileName);
+        freeChunkTable(table);
+    }
+    return rc;
+}
+
+/*
+ * Rozpakowuje kawałek c do raw (chunkSize bajtów); packed musi mieć
+ * chunkSize + 2 bloki. Czytane są całe bloki obejmujące kawałek, żeby
+ * sprawdzić ich sumy. Zwraca długość kawałka albo -1.
+ */
+int readChunk(Disk *disk, const FileExtents *fe, const ChunkTable *table, int64_t fileSize, int64_t c,
+              unsigned char *packed, unsigned char *raw) {
+    int chunkSize = table->header.chunkSize;
+    int blockSize = disk->superBlock.blockSize;
+    int len = (fileSize - c * chunkSize < chunkSize) ? (int)(fileSize - c * chunkSize) : chunkSize;
+    uint32_t stored = table->lengths[c] & ~CHUNK_RAW;
+    if ((table->lengths[c] & CHUNK_RAW) ? stored != (uint32_t)len : stored > (uint32_t)chunkSize) {
+        return -1;
+    }
+    int64_t first = table->offsets[c] / blockSize;
+    int64_t count = (table->offsets[c] + stored + blockSize - 1) / blockSize - first;
+    unsigned char *data = packed + (table->offsets[c] - first * blockSize);
+    if (fileBytesIo(disk, fe, first * blockSize, packed, count * blockSize, 0) < 0 ||
+        verifyFileBlocks(disk, fe, first, (const char *)packed, count) < 0) {
+        return -1;
+    }
+    if (table->lengths[c] & CHUNK_RAW) {
+        memcpy(raw, data, len);
+    } else if (lzDecompress(data, stored, raw, len) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+/* Kolejka kawałków skompresowanego pliku do rozpakowania przez kilka wątków. */
+typedef struct {
+    Disk *disk;
+    const FileExtents *fe;
+    const ChunkTable *table;
+    int64_t fileSize;
+    int outFd;
+    int64_t nextChunk;
+    int failed;
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_t lock;
+#endif
+} ChunkQueue;
+
+void *decompressWorker(void *arg) {
+    ChunkQueue *q = arg;
+    int chunkSize = q->table->header.chunkSize;
+    unsigned char *packed = malloc(chunkSize + 2 * (size_t)q->disk->superBlock.blockSize);
+    unsigned char *raw = malloc(chunkSize);
+    for (int rc = (packed && raw) ? 0 : -1; ; ) {
+#if defined(HAVE_PTHREAD)
+        pthread_mutex_lock(&q->lock);
+#endif
+        int64_t c = q->nextChunk++;
+        if (rc < 0) q->failed = 1;
+        int stop = q->failed || c >= q->table->header.chunkCount;
+#if defined(HAVE_PTHREAD)
+        pthread_mutex_unlock(&q->lock);
+#endif
+        if (stop) break;
+        int len = readChunk(q->disk, q->fe, q->table, q->fileSize, c, packed, raw);
+        rc = len < 0 ? -1 : writeAt(q->outFd, raw, len, c * chunkSize);
+    }
+    free(packed);
+    free(raw);
+    return NULL;
+}
+
+/* copyout pliku z INODE_COMPRESSED: kawałki rozpakowuje równolegle copyThreadCount() wątków. */
+int decompressCopyOut(Disk *disk, const Inode *ino, const FileExtents *fe, int outFd) {
+    ChunkTable table;
+    if (loadChunkTable(disk, ino, fe, &table) < 0) {
+        return -1;
+    }
+    ChunkQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.disk = disk;
+    queue.fe = fe;
+    queue.table = &table;
+    queue.fileSize = ino->fileSize;
+    queue.outFd = outFd;
+    int threads = copyThreadCount();
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_init(&queue.lock, NULL);
+#endif
+    runThreads(decompressWorker, &queue, table.header.chunkCount < threads ? (int)table.header.chunkCount : threads);
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_destroy(&queue.lock);
+#endif
+    freeChunkTable(&table);
+    if (queue.failed) {
+        fprintf(stderr, "Błąd rozpakowywania pliku '%s'.\n", ino->fileName);
+        return -1;
+    }
+    return 0;
+}
+
+/* Czyta do len bajtów z potoku (do skutku albo do końca danych); zwraca liczbę bajtów albo -1. */
+ssize_t readFull(int fd, void *buf, size_t len) {
+    char *p = buf;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(fd, p + got, len - got);
+        statAdd(&globalStats.syscalls, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += r;
+    }
+    return got;
+}
+
+/* Zajmuje do want wolnych bloków zaczynających się dokładnie od start; zwraca ich liczbę. */
+int64_t extendInPlace(Disk *disk, int64_t start, int64_t want) {
+    int64_t started = phaseStart();
+    FreeExtents *freeExtents = &disk->freeExtents;
+    Fragment key = { start, 0 };
+    int pos = lowerBound(freeExtents->byOffset, freeExtents->count, &key, compareByOffset);
+    int64_t length = 0;
+    if (pos < freeExtents->count && freeExtents->byOffset[pos].startBlock == start) {
+        length = freeExtents->byOffset[pos].blockCount < want ? freeExtents->byOffset[pos].blockCount : want;
+        if (takeFreeExtent(freeExtents, start, length) < 0) {
+            length = 0;
+        } else {
+            markDiskBlocks(disk, start, length, 1);
+            disk->superBlock.freeBlocks -= length;
+        }
+    }
+    phaseEnd(PHASE_ALLOC, started);
+    return length;
+}
+
+/*
+ * copyin strumieniowy: dane są czytane porcjami po COPY_BUF_SIZE, bloki
+ * z samych zer zostają dziurami (HOLE_BLOCK), a miejsce na pozostałe
+ * jest przydzielane w coraz większych porcjach (najpierw tuż za ostatnim
+ * fragmentem), po końcu danych nieużyty koniec jest oddawany. sizeHint
+ * to rozmiar zwykłego pliku albo -1 dla potoku i stdin; w zwykłym pliku
+ * dziury źródła są pomijane bez czytania (SEEK_DATA), a pierwsza porcja
+ * miejsca obejmuje cały plik. Lista fragmentów trafia do *fragsOut,
+ * rozmiar do *sizeOut; przy błędzie wszystko jest zwolnione. Gdy całe
+ * dane mieszczą się w INLINE_MAX bajtach, a inlineData nie jest NULL,
+ * trafiają tam bez przydzielania bloków i funkcja zwraca 1.
+ */
+int streamCopyIn(Disk *disk, int srcFd, const char *srcFile, int64_t sizeHint, char *inlineData,
+                 Fragment **fragsOut, int *countOut, int64_t *sizeOut) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int blockSize = superBlock->blockSize;
+    int64_t totalBlocks = sizeHint > 0 ? (sizeHint + blockSize - 1) / blockSize : 0;
+    int64_t grow = totalBlocks > 0 ? totalBlocks : COPY_BUF_SIZE / blockSize;
+    int64_t reserved = 0, used = 0, written = 0;
+    /* frags to zarezerwowane bloki, extents - logiczna lista pliku razem z dziurami. */
+    Fragment *frags = NULL, *extents = NULL;
+    int fragCount = 0, capacity = 0, extentCount = 0, extentCapacity = 0;
+    int cursor = 0;
+    int64_t into = 0;
+    unsigned char zero[COPY_BUF_SIZE / MIN_BLOCK_SIZE];
+    void *buf = NULL;
+    int rc = posix_memalign(&buf, COPY_BUF_ALIGN, COPY_BUF_SIZE) == 0 ? 0 : -1;
+    if (rc == 0 && sizeHint >= 0 && lseek(srcFd, 0, SEEK_SET) < 0) rc = -1;
+    while (rc == 0) {
+#if defined(SEEK_DATA)
+        if (sizeHint >= 0) {
+            off_t data = lseek(srcFd, written, SEEK_DATA);
+            statAdd(&globalStats.syscalls, 1);
+            if ((data < 0 && errno == ENXIO) || data >= sizeHint) {
+                /* Do końca pliku jest już tylko dziura. */
+                if (written < sizeHint) rc = addExtent(&extents, &extentCount, &extentCapacity, HOLE_BLOCK,
+                                                       totalBlocks - written / blockSize);
+                written = written > sizeHint ? written : sizeHint;
+                break;
+            }
+            if (data > written) {
+                int64_t skip = (data - written) / blockSize;
+                rc = addExtent(&extents, &extentCount, &extentCapacity, HOLE_BLOCK, skip);
+                written += skip * blockSize;
+            }
+            if (data >= 0 && lseek(srcFd, written, SEEK_SET) < 0) rc = -1;
+            if (rc < 0) break;
+        }
+#endif
+        ssize_t n = readFull(srcFd, buf, COPY_BUF_SIZE);
+        if (n < 0) {
+            rc = -1;
+            break;
+        }
+        if (inlineData && written == 0 && n <= INLINE_MAX) {
+            memcpy(inlineData, buf, n);
+            written = n;
+            rc = 1;
+            break;
+        }
+        int blocks = (int)((n + blockSize - 1) / blockSize);
+        int64_t needed = used;
+        for (int k = 0; k < blocks; k++) {
+            size_t offset = (size_t)k * blockSize;
+            zero[k] = isZeroBlock((const char *)buf + offset, n - offset < (size_t)blockSize ? n - offset
+                                                                                             : (size_t)blockSize);
+            needed += !zero[k];
+        }
+        while (rc == 0 && reserved < needed) {
+            int64_t want = grow;
+            /* W zwykłym pliku nie rezerwujemy więcej, niż zostało do końca. */
+            if (totalBlocks > 0 && want > used + totalBlocks - written / blockSize - reserved) {
+                want = used + totalBlocks - written / blockSize - reserved;
+            }
+            if (want < needed - reserved) want = needed - reserved;
+            Fragment *run = NULL;
+            int runCount = 0;
+            int64_t last = fragCount > 0 ? frags[fragCount - 1].startBlock + frags[fragCount - 1].blockCount : -1;
+            int64_t extended = last >= 0 ? extendInPlace(disk, last, want) : 0;
+            if (extended == 0 && allocateFragments(disk, want, &run, &runCount) < 0) {
+                /* Za mało miejsca na dużą porcję - bierzemy tylko brakujące bloki. */
+                grow = COPY_BUF_SIZE / blockSize;
+                if (want == needed - reserved || allocateFragments(disk, needed - reserved, &run, &runCount) < 0) {
+                    rc = -2;
+                    break;
+                }
+            } else if (grow < STREAM_MAX_GROW / blockSize) {
+                grow *= 2;
+            }
+            if (fragCount + runCount + 1 > capacity) {
+                int newCapacity = (fragCount + runCount + 1) * 2;
+                Fragment *grown = realloc(frags, newCapacity * sizeof(Fragment));
+                if (!grown) {
+                    releaseFragments(disk, run, runCount);
+                    if (extended > 0) {
+                        Fragment tail = { last, extended };
+                        releaseFragments(disk, &tail, 1);
+                    }
+                    free(run);
+                    rc = -1;
+                    break;
+                }
+                frags = grown;
+                capacity = newCapacity;
+            }
+            if (extended > 0) {
+                appendFragment(frags, &fragCount, last, extended);
+                reserved += extended;
+            }
+            for (int r = 0; r < runCount; r++) {
+                appendFragment(frags, &fragCount, run[r].startBlock, run[r].blockCount);
+                reserved += run[r].blockCount;
+            }
+            free(run);
+        }
+        /* Porcje mają po COPY_BUF_SIZE, więc każda poza ostatnią kończy się na granicy bloku. */
+        /* Kursor przechodzi dalej dopiero przy zapisie, bo ostatni fragment mógł się wydłużyć. */
+        for (int k = 0; rc == 0 && k < blocks; ) {
+            int end = k;
+            while (end < blocks && zero[end] == zero[k]) end++;
+            if (zero[k]) {
+                rc = addExtent(&extents, &extentCount, &extentCapacity, HOLE_BLOCK, end - k);
+                k = end;
+                continue;
+            }
+            if (into == frags[cursor].blockCount) {
+                cursor++;
+                into = 0;
+            }
+            int64_t count = frags[cursor].blockCount - into < end - k ? frags[cursor].blockCount - into : end - k;
+            size_t offset = (size_t)k * blockSize;
+            size_t len = (size_t)count * blockSize < n - offset ? (size_t)count * blockSize : n - offset;
+            rc = writeDataBlocks(disk, frags[cursor].startBlock + into, (const char *)buf + offset, len);
+            if (rc == 0) {
+                rc = addExtent(&extents, &extentCount, &extentCapacity, frags[cursor].startBlock + into, count);
+            }
+            into += count;
+            used += count;
+            k += count;
+        }
+        written += n;
+        if (n < COPY_BUF_SIZE) break;
+    }
+    free(buf);
+    if (rc >= 0) {
+        /* Oddaje nieużyty koniec rezerwacji. */
+        int64_t keep = used;
+        for (int f = 0; f < fragCount; f++) {
+            int64_t kept = keep < frags[f].blockCount ? keep : frags[f].blockCount;
+            Fragment tail = { frags[f].startBlock + kept, frags[f].blockCount - kept };
+            if (tail.blockCount > 0) releaseFragments(disk, &tail, 1);
+            keep -= kept;
+        }
+    } else {
+        releaseFragments(disk, frags, fragCount);
+        free(extents);
+        extents = NULL;
+        extentCount = 0;
+    }
+    free(frags);
+    if (rc == -2) {
+        printf("Brak miejsca na dysku (pozostale miejsce = %" PRId64 ", wczytano już %" PRId64 " bajtów).\n",
+               superBlock->freeBlocks * blockSize, written);
+    } else if (rc < 0) {
+        fprintf(stderr, "Błąd kopiowania danych z pliku %s.\n", srcFile);
+    }
+    *fragsOut = extents;
+    *countOut = extentCount;
+    *sizeOut = written;
+    return rc < 0 ? -1 : rc;
+}
+
+/*
+ * Sprawdza nazwę nowego pliku. Za długie nazwy są odrzucane, a nie
+ * przycinane - przycięta mogłaby się pokryć z istniejącym plikiem.
+ */
+int checkNewFileName(const char *name) {
+    if (name[0] == '\0') {
+        fprintf(stderr, "Pusta nazwa pliku.\n");
+        return -1;
+    }
+    if (strlen(name) >= MAX_NAME_LEN) {
+        fprintf(stderr, "Za długa nazwa pliku '%s' (najwyżej %d znaków).\n", name, MAX_NAME_LEN - 1);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Polecenia działają na otwartym dysku (*Disk), żeby tryb wsadowy mógł
+ * wykonać wiele poleceń na jednej kopii metadanych. Przy błędzie stan w
+ * pamięci zostaje taki jak przed poleceniem. Funkcje bez przyrostka
+ * otwierają dysk, wykonują jedno polecenie i zatwierdzają zmiany.
+ *
+ * copyin pliku srcFile ("-" oznacza stdin) jako destName. Bez kompresji
+ * i deduplikacji dane idą przez streamCopyIn, który zostawia bloki z
+ * samych zer jako dziury. I-węzeł powstaje dopiero po zapisaniu
+ * wszystkich danych.
+ */
+int copyInDisk(Disk *disk, const char *srcFile, const char *destName) {
+    if (checkNewFileName(destName) < 0) return -1;
+    int fromStdin = strcmp(srcFile, "-") == 0;
+    /* Kopia deskryptora, żeby zamknięcie źródła nie zamykało stdin. */
+    int srcFd = fromStdin ? dup(STDIN_FILENO) : open(srcFile, O_RDONLY);
+    struct stat st;
+    if (srcFd < 0 || fstat(srcFd, &st) < 0) {
+        fprintf(stderr, "Nie mogę otworzyć pliku źródłowego %s\n", srcFile);
+        if (srcFd >= 0) close(srcFd);
+        return -1;
+    }
+    if (fromStdin) srcFile = "stdin";
+    int streaming = !S_ISREG(st.st_mode);
+    int64_t fileSize = streaming ? 0 : (int64_t)st.st_size;
+    SuperBlock *superBlock = &disk->superBlock;
+    if (findFile(disk, destName, NULL) >= 0) {
+        fprintf(stderr, "Plik o nazwie '%s' już istnieje na dysku!\n", destName);
+        close(srcFd);
+        return -1;
+    }
+    if (!hasFreeInode(disk)) {
+        fprintf(stderr, "Brak wolnych i-węzłów, katalog pełny.\n");
+        close(srcFd);
+        return -1;
+    }
+    if (streaming && ((disk->flags & DISK_COMPRESS) || disk->fingerprints)) {
+        fprintf(stderr, "Kompresja i deduplikacja wymagają zwykłego pliku źródłowego, nie strumienia.\n");
+        close(srcFd);
+        return -1;
+    }
+
+    Inode newIno;
+    memset(&newIno, 0, sizeof(newIno));
+    newIno.isUsed = 1;
+    strcpy(newIno.fileName, destName);
+    newIno.fileSize = fileSize;
+    newIno.fragmentsCount = 0;
+    newIno.nextFree = -1;
+    newIno.extentBlock = -1;
+    int blockSize = superBlock->blockSize;
+    int64_t blocksNeeded = (fileSize + blockSize - 1) / blockSize;
+    Fragment *frags = NULL;
+    int fragCount = 0;
+    int64_t sharedBlocks = 0;
+    int64_t started = phaseStart();
+    /* Małe pliki trafiają do i-węzła, więc kompresja i deduplikacja ich nie dotyczą. */
+    if ((disk->flags & DISK_COMPRESS) && fileSize > INLINE_MAX) {
+        if (compressCopyIn(disk, srcFd, srcFile, fileSize, &frags, &fragCount) < 0) {
+            close(srcFd);
+            return -1;
+        }
+        newIno.flags |= INODE_COMPRESSED;
+    } else if (disk->fingerprints && fileSize > INLINE_MAX) {
+        if (dedupCopyIn(disk, srcFd, srcFile, fileSize, &frags, &fragCount, &sharedBlocks) < 0) {
+            close(srcFd);
+            return -1;
+        }
+    } else {
+        int stored = streamCopyIn(disk, srcFd, srcFile, streaming ? -1 : fileSize, INLINE_DATA(&newIno),
+                                  &frags, &fragCount, &fileSize);
+        if (stored < 0) {
+            close(srcFd);
+            return -1;
+        }
+        if (stored == 1) newIno.flags |= INODE_INLINE;
+        newIno.fileSize = fileSize;
+        blocksNeeded = (fileSize + blockSize - 1) / blockSize;
+    }
+    phaseEnd(PHASE_TRANSFER, started);
+    int rc = !(newIno.flags & INODE_INLINE) && setFileExtents(disk, &newIno, frags, fragCount) < 0 ? -1 : 0;
+    if (rc < 0) {
+        fprintf(stderr, "Brak miejsca na dysku na bloki ekstentów.\n");
+        releaseFragments(disk, frags, fragCount);
+    }
+    int64_t storedBlocks = 0, holeBlocks = 0;
+    for (int f = 0; f < fragCount; f++) {
+        if (frags[f].startBlock == HOLE_BLOCK) {
+            holeBlocks += frags[f].blockCount;
+        } else {
+            storedBlocks += frags[f].blockCount;
+        }
+    }
+    free(frags);
+    close(srcFd);
+    if (rc < 0) {
+        return -1;
+    }
+    int freeInodeIdx = allocInode(disk);
+    disk->inodes[freeInodeIdx] = newIno;
+    markInodeDirty(disk, freeInodeIdx);
+    insertDirEntry(disk, newIno.fileName, freeInodeIdx);
+    printf("Skopiowano plik %s do FS jako '%s' (inode=%d, rozmiar=%" PRId64 ").\n",
+           srcFile, destName, freeInodeIdx, fileSize);
+    if (newIno.flags & INODE_INLINE) {
+        printf("Dane zapisane w i-węźle, bez bloków danych.\n");
+    } else if (newIno.flags & INODE_COMPRESSED) {
+        printf("Kompresja: %" PRId64 " bloków zamiast %" PRId64 ".\n", storedBlocks, blocksNeeded);
+    } else if (disk->fingerprints) {
+        printf("Deduplikacja: %" PRId64 " z %" PRId64 " bloków współdzielonych z już zapisanymi.\n",
+               sharedBlocks, blocksNeeded);
+    }
+    if (holeBlocks > 0) {
+        printf("Dziury: %" PRId64 " z %" PRId64 " bloków nie zajmuje miejsca.\n",
+               holeBlocks, blocksNeeded);
+    }
+    return 0;
+}
+
+int copyOutDisk(Disk *disk, const char *fileName, const char *outFile) {
+    int foundInode = findFile(disk, fileName, NULL);
+    if (foundInode < 0) {
+        fprintf(stderr, "Nie ma takiego pliku '%s' na dysku.\n", fileName);
+        return -1;
+    }
+    const Inode *ino = &disk->inodes[foundInode];
+    int outFd = open(outFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outFd < 0) {
+        fprintf(stderr, "Nie można utworzyć pliku wyjściowego %s\n", outFile);
+        return -1;
+    }
+    FileExtents fe;
+    if (loadFileExtents(disk, ino, &fe) < 0) {
+        close(outFd);
+        return -1;
+    }
+    int64_t bytesLeft = ino->fileSize;
+    int rc = 0;
+    struct stat st;
+    int regular = fstat(outFd, &st) == 0 && S_ISREG(st.st_mode);
+    int64_t started = phaseStart();
+    if (ino->flags & INODE_INLINE) {
+        if (writeAt(outFd, INLINE_DATA(ino), ino->fileSize, 0) < 0) {
+            fprintf(stderr, "Błąd kopiowania danych do pliku %s.\n", outFile);
+            rc = -1;
+        }
+        bytesLeft = 0;
+    } else if (ino->flags & INODE_COMPRESSED) {
+        rc = decompressCopyOut(disk, ino, &fe, outFd);
+        bytesLeft = 0;
+    } else if (fe.count > 1 && regular) {
+        /* Pofragmentowany plik: wszystkie fragmenty naraz przez copyOutJobs. */
+        CopyJob *jobs = malloc(fe.count * sizeof(CopyJob));
+        int jobCount = 0;
+        for (int f = 0; jobs && f < fe.count && bytesLeft > 0; f++) {
+            int64_t bytes = fe.frags[f].blockCount * disk->superBlock.blockSize;
+            if (bytes > bytesLeft) bytes = bytesLeft;
+            bytesLeft -= bytes;
+            if (fe.frags[f].startBlock == HOLE_BLOCK) continue;
+            jobs[jobCount].file = 0;
+            jobs[jobCount].fileOffset = ino->fileSize - bytesLeft - bytes;
+            jobs[jobCount].diskOffset = getBlockOffset(&disk->superBlock, fe.frags[f].startBlock);
+            jobs[jobCount].len = bytes;
+            jobCount++;
+        }
+        if (!jobs || copyOutJobs(disk, outFd, jobs, jobCount) < 0) {
+            fprintf(stderr, "Błąd kopiowania danych do pliku %s.\n", outFile);
+            rc = -1;
+        }
+        free(jobs);
+    }
+    for (int f = 0; f < fe.count && bytesLeft > 0; f++) {
+        int64_t bytes = fe.frags[f].blockCount * disk->superBlock.blockSize;
+        if (bytes > bytesLeft) bytes = bytesLeft;
+        /* Dziurę w zwykłym pliku tylko przeskakujemy, resztę dopełni ftruncate. */
+        if (fe.frags[f].startBlock == HOLE_BLOCK
+                ? !regular && writeZeros(outFd, ino->fileSize - bytesLeft, bytes) < 0
+                : copyFromDisk(disk, getBlockOffset(&disk->superBlock, fe.frags[f].startBlock),
+                               outFd, ino->fileSize - bytesLeft, bytes) < 0) {
+            fprintf(stderr, "Błąd kopiowania danych do pliku %s.\n", outFile);
+            rc = -1;
+            break;
+        }
+        bytesLeft -= bytes;
+    }
+    if (rc == 0 && regular && ftruncate(outFd, ino->fileSize) < 0) {
+        fprintf(stderr, "Błąd kopiowania danych do pliku %s.\n", outFile);
+        rc = -1;
+    }
+    phaseEnd(PHASE_TRANSFER, started);
+    freeFileExtents(&fe);
+
+    close(outFd);
+    if (rc < 0) {
+        return -1;
+    }
+    printf("Skopiowano plik '%s' (inode=%d) z FS do '%s'.\n", fileName, foundInode, outFile);
+    return 0;
+}
+
+/*
+ * Usuwa plik. Przy deferred != NULL jego bloki nie wracają od razu do
+ * puli, tylko trafiają do *deferred (deferFileBlocks).
+ */
+int removeFileDisk(Disk *disk, const char *fileName, Fragment **deferred, int *deferredCount,
+                   int *deferredCapacity) {
+    int dirSlot = -1;
+    int foundInode = findFile(disk, fileName, &dirSlot);
+    if (foundInode < 0) {
+        fprintf(stderr, "Nie znaleziono pliku '%s'.\n", fileName);
+        return -1;
+    }
+    if (deferred ? deferFileBlocks(disk, &disk->inodes[foundInode], deferred, deferredCount,
+                                   deferredCapacity) < 0
+                 : freeFileBlocks(disk, &disk->inodes[foundInode]) < 0) {
+        return -1;
+    }
+    removeDirEntry(disk, dirSlot);
+    releaseInode(disk, foundInode);
+    printf("Plik '%s' (inode=%d) usunięty.\n", fileName, foundInode);
+    return 0;
+}
+
+/* Wypisuje katalog; pliki zaczynające się od '.' tylko przy showHidden. */
+int listFilesDisk(const Disk *disk, int showHidden) {
+    printf("Katalog:\n");
+    for (int i = 0; i < disk->superBlock.inodeCount; i++) {
+        const Inode *ino = &disk->inodes[i];
+        statAdd(&globalStats.inodesVisited, 1);
+        if (ino->isUsed == 1) {
+            if (showHidden || ino->fileName[0] != '.') {
+                printf("  inode=%d, nazwa='%s', rozmiar=%" PRId64 " bajtów, fragmentsCount=%d%s\n",
+                   i, ino->fileName, ino->fileSize, ino->fragmentsCount,
+                   (ino->flags & INODE_COMPRESSED) ? ", skompresowany"
+                   : (ino->flags & INODE_INLINE) ? ", w i-węźle" : "");
+            }
+        }
+    }
+    return 0;
+}
+
+/* Otwiera dysk, wykonuje na nim polecenie i zatwierdza zmiany, jeśli się udało. */
+int copyIn(const char *diskName, const char *srcFile, const char *destName) {
+    Disk disk;
+    if (openDisk(diskName, DISK_WRITABLE | DISK_BLOCKMAP, &disk) < 0) {
+        return -1;
+    }
+    int rc = copyInDisk(&disk, srcFile, destName);
+    if (rc == 0) rc = commitDisk(&disk);
+    closeDisk(&disk);
+    return rc;
+}
+
+int copyOut(const char *diskName, const char *fileName, const char *outFile) {
+    Disk disk;
+    if (openDisk(diskName, 0, &disk) < 0) {
+        return -1;
+    }
+    int rc = copyOutDisk(&disk, fileName, outFile);
+    closeDisk(&disk);
+    return rc;
+}
+
+int removeFile(const char *diskName, const char *fileName) {
+    Disk disk;
+    if (openDisk(diskName, DISK_WRITABLE | DISK_BLOCKMAP, &disk) < 0) {
+        return -1;
+    }
+    int rc = removeFileDisk(&disk, fileName, NULL, NULL, NULL);
+    if (rc == 0) rc = commitDisk(&disk);
+    closeDisk(&disk);
+    return rc;
+}
+
+int listAllFiles(const char *diskName) {
+    Disk disk;
+    if (openDisk(diskName, 0, &disk) < 0) {
+        return -1;
+    }
+    listFilesDisk(&disk, 1);
+    closeDisk(&disk);
+    return 0;
+}
+
+int listFiles(const char *diskName) {
+    Disk disk;
+    if (openDisk(diskName, 0, &disk) < 0) {
+        return -1;
+    }
+    listFilesDisk(&disk, 0);
+    closeDisk(&disk);
+    return 0;
+}
+
+/*
+ * Przygotowuje plik srcFile do skopiowania jako destName: przydziela
+ * bloki i i-węzeł i dokłada zadania kopiowania do *jobs. Zwraca numer
+ * i-węzła albo -1 (wtedy nic nie zostało zmienione).
+ */
+int reserveCopyIn(Disk *disk, int srcFd, const char *srcFile, const char *destName, int file,
+                  CopyJob **jobs, int *jobCount, int *jobCapacity) {
+    SuperBlock *superBlock = &disk->superBlock;
+    struct stat st;
+    if (fstat(srcFd, &st) < 0) {
+        fprintf(stderr, "Nie mogę otworzyć pliku źródłowego %s\n", srcFile);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s nie jest zwykłym plikiem, nie można z góry przydzielić mu miejsca.\n", srcFile);
+        return -1;
+    }
+    if (checkNewFileName(destName) < 0) return -1;
+    if (findFile(disk, destName, NULL) >= 0) {
+        fprintf(stderr, "Plik o nazwie '%s' już istnieje na dysku!\n", destName);
+        return -1;
+    }
+    if (!hasFreeInode(disk)) {
+        fprintf(stderr, "Brak wolnych i-węzłów, katalog pełny.\n");
+        return -1;
+    }
+    Inode newIno;
+    memset(&newIno, 0, sizeof(newIno));
+    newIno.isUsed = 1;
+    strcpy(newIno.fileName, destName);
+    newIno.fileSize = (int64_t)st.st_size;
+    newIno.nextFree = -1;
+    newIno.extentBlock = -1;
+    int blockSize = superBlock->blockSize;
+    int64_t blocksNeeded = (newIno.fileSize + blockSize - 1) / blockSize;
+    Fragment *frags = NULL;
+    int fragCount = 0;
+    if (newIno.fileSize <= INLINE_MAX) {
+        /* Mały plik: dane od razu do i-węzła, bez bloków i zadań kopiowania. */
+        if (readAt(srcFd, INLINE_DATA(&newIno), newIno.fileSize, 0) < 0) {
+            fprintf(stderr, "Błąd kopiowania danych z pliku %s.\n", srcFile);
+            return -1;
+        }
+        newIno.flags |= INODE_INLINE;
+    } else if (allocateFragments(disk, blocksNeeded, &frags, &fragCount) < 0) {
+        printf("Brak miejsca na dysku na plik %s (pozostale miejsce = %" PRId64 ", potrzebne miejsce = %" PRId64 ").\n",
+               srcFile, superBlock->freeBlocks * blockSize, newIno.fileSize);
+        return -1;
+    }
+    if (!(newIno.flags & INODE_INLINE) && setFileExtents(disk, &newIno, frags, fragCount) < 0) {
+        fprintf(stderr, "Brak miejsca na dysku na bloki ekstentów.\n");
+        releaseFragments(disk, frags, fragCount);
+        free(frags);
+        return -1;
+    }
+    int64_t srcOffset = 0;
+    for (int f = 0; f < fragCount; f++) {
+        for (int64_t done = 0; done < frags[f].blockCount * blockSize && srcOffset < newIno.fileSize; ) {
+            if (*jobCount == *jobCapacity) {
+                int newCapacity = *jobCapacity ? *jobCapacity * 2 : 256;
+                CopyJob *grown = realloc(*jobs, newCapacity * sizeof(CopyJob));
+                if (!grown) {
+                    freeFileBlocks(disk, &newIno);
+                    free(frags);
+                    return -1;
+                }
+                *jobs = grown;
+                *jobCapacity = newCapacity;
+            }
+            int64_t len = frags[f].blockCount * blockSize - done;
+            if (len > COPY_JOB_BYTES) len = COPY_JOB_BYTES;
+            if (len > newIno.fileSize - srcOffset) len = newIno.fileSize - srcOffset;
+            CopyJob *job = &(*jobs)[(*jobCount)++];
+            job->file = file;
+            job->fileOffset = srcOffset;
+            job->diskOffset = getBlockOffset(superBlock, frags[f].startBlock) + done;
+            job->len = len;
+            srcOffset += len;
+            done += len;
+        }
+    }
+    free(frags);
+    int idx = allocInode(disk);
+    disk->inodes[idx] = newIno;
+    markInodeDirty(disk, idx);
+    insertDirEntry(disk, newIno.fileName, idx);
+    return idx;
+}
+
+/*
+ * copyin-many: miejsce dla wszystkich plików grupy jest przydzielane
+ * od razu w jednym wątku, a potem dane kopiuje kolejka zadań
+ * (runCopyJobs) równolegle do rozłącznych fragmentów obrazu. Grupy mają
+ * co najwyżej COPY_MANY_GROUP plików, żeby nie wyczerpać limitu
+ * otwartych deskryptorów, i kończą się wcześniej, gdy ich metadane
+ * zajęłyby ponad pół dziennika - po grupie zmiany są wtedy zatwierdzane.
+ * Źródła, które nie są zwykłymi plikami (potoki, FIFO), nie mają znanego
+ * rozmiaru, więc idą od razu strumieniem przez copyInDisk.
+ */
+int copyInManyDisk(Disk *disk, char **srcFiles, int count) {
+    int copied = 0;
+    if (disk->fingerprints || (disk->flags & DISK_COMPRESS)) {
+        /* Deduplikacja i kompresja czytają dane same, więc pliki idą po kolei. */
+        for (int k = 0; k < count; k++) {
+            const char *slash = strrchr(srcFiles[k], '/');
+            if (copyInDisk(disk, srcFiles[k], slash ? slash + 1 : srcFiles[k]) == 0) copied++;
+            if (commitIfLogFull(disk) < 0) return -1;
+        }
+        printf("Skopiowano %d z %d plików.\n", copied, count);
+        return copied == count ? 0 : -1;
+    }
+    int threads = copyThreadCount();
+    for (int base = 0, groupSize; base < count; base += groupSize) {
+        groupSize = (count - base < COPY_MANY_GROUP) ? count - base : COPY_MANY_GROUP;
+        int srcFds[COPY_MANY_GROUP];
+        int inodeOf[COPY_MANY_GROUP];
+        int failed[COPY_MANY_GROUP];
+        CopyJob *jobs = NULL;
+        int jobCount = 0, jobCapacity = 0;
+        for (int k = 0; k < groupSize; k++) {
+            const char *srcFile = srcFiles[base + k];
+            const char *slash = strrchr(srcFile, '/');
+            const char *destName = slash ? slash + 1 : srcFile;
+            failed[k] = 0;
+            inodeOf[k] = -1;
+            srcFds[k] = -1;
+            struct stat st;
+            if (stat(srcFile, &st) == 0 && !S_ISREG(st.st_mode)) {
+                /* Sprawdzane przed open, żeby FIFO nie było otwierane dwa razy. */
+                if (copyInDisk(disk, srcFile, destName) == 0) copied++;
+                continue;
+            }
+            srcFds[k] = open(srcFile, O_RDONLY);
+            if (srcFds[k] < 0) {
+                fprintf(stderr, "Nie mogę otworzyć pliku źródłowego %s\n", srcFile);
+                continue;
+            }
+            inodeOf[k] = reserveCopyIn(disk, srcFds[k], srcFile, destName, k,
+                                       &jobs, &jobCount, &jobCapacity);
+            if (pendingCommitBytes(disk) > (size_t)disk->superBlock.walSize / 2) {
+                groupSize = k + 1;
+            }
+        }
+
+        CopyQueue queue;
+        memset(&queue, 0, sizeof(queue));
+        queue.disk = disk;
+        queue.fds = srcFds;
+        queue.toDisk = 1;
+        queue.failed = failed;
+        queue.jobs = jobs;
+        queue.jobCount = jobCount;
+        int64_t started = phaseStart();
+        runCopyJobs(&queue, jobCount < threads ? jobCount : threads);
+        phaseEnd(PHASE_TRANSFER, started);
+
+        for (int k = 0; k < groupSize; k++) {
+            const char *srcFile = srcFiles[base + k];
+            int idx = inodeOf[k];
+            if (idx >= 0 && failed[k]) {
+                int dirSlot = -1;
+                fprintf(stderr, "Błąd kopiowania danych z pliku %s.\n", srcFile);
+                findFile(disk, disk->inodes[idx].fileName, &dirSlot);
+                freeFileBlocks(disk, &disk->inodes[idx]);
+                removeDirEntry(disk, dirSlot);
+                releaseInode(disk, idx);
+            } else if (idx >= 0) {
+                printf("Skopiowano plik %s do FS jako '%s' (inode=%d, rozmiar=%" PRId64 ").\n",
+                       srcFile, disk->inodes[idx].fileName, idx, disk->inodes[idx].fileSize);
+                copied++;
+            }
+            if (srcFds[k] >= 0) close(srcFds[k]);
+        }
+        free(jobs);
+        if (commitIfLogFull(disk) < 0) return -1;
+    }
+    printf("Skopiowano %d z %d plików.\n", copied, count);
+    return copied == count ? 0 : -1;
+}
+
+int copyInMany(const char *diskName, char **srcFiles, int count) {
+    Disk disk;
+    if (openDisk(diskName, DISK_WRITABLE | DISK_BLOCKMAP, &disk) < 0) {
+        return -1;
+    }
+    int rc = copyInManyDisk(&disk, srcFiles, count);
+    if (commitDisk(&disk) < 0) rc = -1;
+    closeDisk(&disk);
+    return rc;
+}
+
+int hasSharedBlocks(const Disk *disk, const FileExtents *fe) {
+    for (int f = 0; disk->refCounts && f < fe->count; f++) {
+        for (int64_t b = 0; fe->frags[f].startBlock != HOLE_BLOCK && b < fe->frags[f].blockCount; b++) {
+            if (disk->refCounts[fe->frags[f].startBlock + b]) return 1;
+        }
+    }
+    return 0;
+}
+
+/* Ciąg bloków zajęty przez plik; owner to numer i-węzła albo OWNER_SHARED. */
+typedef struct {
+    int64_t startBlock;
+    int64_t blockCount;
+    int owner;
+} OwnedRun;
+
+/* Początek (delta 1) albo koniec (delta -1) ekstentu pliku owner. */
+typedef struct {
+    int64_t block;
+    int delta;
+    int owner;
+} ExtentEdge;
+
+int compareEdges(const void *a, const void *b) {
+    const ExtentEdge *x = a, *y = b;
+    return (x->block > y->block) - (x->block < y->block);
+}
+
+/*
+ * Zajęte ciągi bloków posortowane po początku, zbudowane z samych list
+ * ekstentów (dane i łańcuchy ekstentów), bez tablicy na każdy blok:
+ * końce ekstentów są sortowane i zamiatane, a ciąg, do którego odwołuje
+ * się więcej niż jeden ekstent, dostaje OWNER_SHARED. Czas O(e log e) i
+ * pamięć O(e) dla e ekstentów. Zwraca liczbę ciągów albo -1.
+ */
+int64_t buildOwnedRuns(const Disk *disk, OwnedRun **runsOut) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    ExtentEdge *edges = NULL;
+    int64_t edgeCount = 0, edgeCapacity = 0;
+    int rc = 0;
+    for (int i = 0; rc == 0 && i < superBlock->inodesInitialized; i++) {
+        FileExtents fe;
+        statAdd(&globalStats.inodesVisited, 1);
+        if (disk->inodes[i].isUsed != 1 || loadFileExtents(disk, &disk->inodes[i], &fe) < 0) continue;
+        int64_t needed = edgeCount + 2 * (fe.count + fe.extentBlockCount);
+        if (needed > edgeCapacity) {
+            ExtentEdge *grown = realloc(edges, needed * 2 * sizeof(ExtentEdge));
+            if (grown) {
+                edges = grown;
+                edgeCapacity = needed * 2;
+            } else {
+                rc = -1;
+            }
+        }
+        for (int k = 0; rc == 0 && k < fe.count + fe.extentBlockCount; k++) {
+            int64_t start = k < fe.count ? fe.frags[k].startBlock : fe.extentBlocks[k - fe.count];
+            int64_t count = k < fe.count ? fe.frags[k].blockCount : 1;
+            if (start < 0 || count <= 0) continue;
+            edges[edgeCount].block = start;
+            edges[edgeCount].delta = 1;
+            edges[edgeCount++].owner = i;
+            edges[edgeCount].block = start + count;
+            edges[edgeCount].delta = -1;
+            edges[edgeCount++].owner = i;
+        }
+        freeFileExtents(&fe);
+    }
+    OwnedRun *runs = rc == 0 ? malloc((edgeCount + 1) * sizeof(OwnedRun)) : NULL;
+    if (!runs) {
+        free(edges);
+        return -1;
+    }
+    qsort(edges, edgeCount, sizeof(ExtentEdge), compareEdges);
+    int64_t runCount = 0, active = 0, ownerSum = 0, from = 0;
+    for (int64_t e = 0; e < edgeCount; ) {
+        int64_t block = edges[e].block;
+        if (active > 0 && block > from) {
+            /* Przy jednym aktywnym ekstencie suma właścicieli to jego i-węzeł. */
+            int owner = active == 1 ? (int)ownerSum : OWNER_SHARED;
+            OwnedRun *last = runCount > 0 ? &runs[runCount - 1] : NULL;
+            if (last && last->owner == owner && last->startBlock + last->blockCount == from) {
+                last->blockCount += block - from;
+            } else {
+                runs[runCount].startBlock = from;
+                runs[runCount].blockCount = block - from;
+                runs[runCount++].owner = owner;
+            }
+        }
+        for (; e < edgeCount && edges[e].block == block; e++) {
+            active += edges[e].delta;
+            ownerSum += edges[e].delta * (int64_t)edges[e].owner;
+        }
+        from = block;
+    }
+    free(edges);
+    *runsOut = runs;
+    return runCount;
+}
+
+/*
+ * Właściciele bloków dla fsck i defrag: ciągi z buildOwnedRuns
+ * posortowane po początku, które defrag uaktualnia przy przenoszeniu
+ * (setOwner) zamiast tablicy z int na każdy blok.
+ */
+typedef struct {
+    OwnedRun *runs;
+    int64_t count;
+    int64_t capacity;
+} OwnerMap;
+
+int buildOwnerMap(const Disk *disk, OwnerMap *map) {
+    map->count = buildOwnedRuns(disk, &map->runs);
+    map->capacity = map->count + 1;
+    return map->count < 0 ? -1 : 0;
+}
+
+/* Pozycja ciągu zawierającego block albo pierwszego za nim. */
+int64_t ownerRunAt(const OwnerMap *map, int64_t block) {
+    int64_t lo = 0, hi = map->count;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (map->runs[mid].startBlock + map->runs[mid].blockCount <= block) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Numer i-węzła właściciela bloku, OWNER_SHARED albo -1; w *endOut koniec ciągu. */
+int ownerOf(const OwnerMap *map, int64_t block, int64_t *endOut) {
+    int64_t r = ownerRunAt(map, block);
+    if (r == map->count || map->runs[r].startBlock > block) return -1;
+    if (endOut) *endOut = map->runs[r].startBlock + map->runs[r].blockCount;
+    return map->runs[r].owner;
+}
+
+/* Przypisuje bloki [start, start+count) do owner (-1 usuwa właściciela), scalając z sąsiadami. */
+int setOwner(OwnerMap *map, int64_t start, int64_t count, int owner) {
+    int64_t end = start + count;
+    if (count <= 0) return 0;
+    if (map->count + 2 > map->capacity) {
+        OwnedRun *grown = realloc(map->runs, (map->count + 2) * 2 * sizeof(OwnedRun));
+        if (!grown) return -1;
+        map->runs = grown;
+        map->capacity = (map->count + 2) * 2;
+    }
+    int64_t r = ownerRunAt(map, start);
+    OwnedRun pieces[3];
+    int pieceCount = 0;
+    int64_t last = r;
+    /* Ciągi nachodzące na [start, end) zastępujemy ich resztkami i nowym ciągiem. */
+    while (last < map->count && map->runs[last].startBlock < end) last++;
+    if (r < last && map->runs[r].startBlock < start) {
+        OwnedRun before = { map->runs[r].startBlock, start - map->runs[r].startBlock, map->runs[r].owner };
+        pieces[pieceCount++] = before;
+    }
+    if (owner != -1) {
+        OwnedRun middle = { start, count, owner };
+        pieces[pieceCount++] = middle;
+    }
+    if (r < last && map->runs[last - 1].startBlock + map->runs[last - 1].blockCount > end) {
+        OwnedRun after = { end, map->runs[last - 1].startBlock + map->runs[last - 1].blockCount - end,
+                           map->runs[last - 1].owner };
+        pieces[pieceCount++] = after;
+    }
+    memmove(&map->runs[r + pieceCount], &map->runs[last], (map->count - last) * sizeof(OwnedRun));
+    memcpy(&map->runs[r], pieces, pieceCount * sizeof(OwnedRun));
+    map->count += pieceCount - (last - r);
+    for (int64_t k = r + pieceCount; k > r - 1 && k > 0; k--) {
+        if (k >= map->count) continue;
+        OwnedRun *prev = &map->runs[k - 1];
+        if (prev->owner == map->runs[k].owner && prev->startBlock + prev->blockCount == map->runs[k].startBlock) {
+            prev->blockCount += map->runs[k].blockCount;
+            memmove(&map->runs[k], &map->runs[k + 1], (map->count - k - 1) * sizeof(OwnedRun));
+            map->count--;
+        }
+    }
+    return 0;
+}
+
+/* Wiersz mapy dla bloków [start..end]; owner jak w OwnedRun, -1 dla zajętych bez właściciela. */
+void printMapRange(const Disk *disk, int64_t start, int64_t end, int used, int owner) {
+    if (!used) {
+        printf("Bloki [%" PRId64 "..%" PRId64 "] -> WOLNE\n", start, end);
+    } else if (owner >= 0) {
+        printf("Bloki [%" PRId64 "..%" PRId64 "] -> ZAJĘTE (plik='%s')\n", start, end, disk->inodes[owner].fileName);
+    } else if (owner == OWNER_SHARED) {
+        printf("Bloki [%" PRId64 "..%" PRId64 "] -> ZAJĘTE (współdzielone)\n", start, end);
+    } else {
+        printf("Bloki [%" PRId64 "..%" PRId64 "] -> ZAJĘTE (nieznany plik)\n", start, end);
+    }
+}
+
+/*
+ * Mapa powstaje przez scalenie dwóch posortowanych list: zajętych ciągów
+ * z buildOwnedRuns i indeksu wolnych ekstentów. Bloki, których nie ma na
+ * żadnej z nich, są zajęte bez właściciela.
+ */
+int printMapDisk(const Disk *disk, const char *diskName) {
+    const SuperBlock superBlock = disk->superBlock;
+
+    printf("STRUKTURA DYSKU '%s':\n", diskName);
+    printf("Offset superbloku: %ld\n", 0L);
+    printf("Offset tabeli i-węzłów: %" PRId64 "\n", superBlock.inodeTableOffset);
+    printf("Offset bitmapy bloków: %" PRId64 "\n", superBlock.blockBitmapOffset);
+    printf("Offset danych: %" PRId64 "\n", superBlock.dataOffset);
+    printf("Rozmiar bloku: %d bajtów\n", superBlock.blockSize);
+
+    OwnedRun *runs = NULL;
+    int64_t runCount = buildOwnedRuns(disk, &runs);
+    if (runCount < 0) {
+        return -1;
+    }
+    const Fragment *freeRuns = disk->freeExtents.byOffset;
+    int freeCount = disk->freeExtents.count;
+    printf("Mapa bloków:\n");
+    int64_t cursor = 0, pendingStart = 0, r = 0;
+    int f = 0, pendingUsed = -1, pendingOwner = -1;
+    while (cursor < superBlock.blockCount) {
+        while (r < runCount && runs[r].startBlock + runs[r].blockCount <= cursor) r++;
+        while (f < freeCount && freeRuns[f].startBlock + freeRuns[f].blockCount <= cursor) f++;
+        int64_t runStart = r < runCount ? runs[r].startBlock : superBlock.blockCount;
+        int64_t freeStart = f < freeCount ? freeRuns[f].startBlock : superBlock.blockCount;
+        int used = 1, owner = -1;
+        int64_t end;
+        if (runStart <= cursor) {
+            owner = runs[r].owner;
+            end = runs[r].startBlock + runs[r].blockCount;
+        } else if (freeStart <= cursor) {
+            used = 0;
+            end = freeRuns[f].startBlock + freeRuns[f].blockCount;
+        } else {
+            end = runStart < freeStart ? runStart : freeStart;
+        }
+        if (end > superBlock.blockCount) end = superBlock.blockCount;
+        if (used != pendingUsed || owner != pendingOwner) {
+            if (pendingUsed >= 0) printMapRange(disk, pendingStart, cursor - 1, pendingUsed, pendingOwner);
+            pendingStart = cursor;
+            pendingUsed = used;
+            pendingOwner = owner;
+        }
+        cursor = end;
+    }
+    printMapRange(disk, pendingStart, superBlock.blockCount - 1, pendingUsed, pendingOwner);
+
+    printf("Wolne przestrzenie: %" PRId64 " bajtów\n", 
+           superBlock.freeBlocks * superBlock.blockSize);
+    if (superBlock.sharedBlocks > 0) {
+        printf("Bloki współdzielone: %" PRId64 " (zaoszczędzono %" PRId64 " bajtów)\n",
+               superBlock.sharedBlocks, superBlock.savedBlocks * superBlock.blockSize);
+    }
+
+    free(runs);
+    return 0;
+}
+
+int printMap(const char *diskName) {
+    Disk disk;
+    if (openDisk(diskName, DISK_FREE_INDEX, &disk) < 0) {
+        return -1;
+    }
+    int rc = printMapDisk(&disk, diskName);
+    closeDisk(&disk);
+    return rc;
+}
+
+/*
+ * Raport fragmentacji: pliki i ich fragmenty, histogram długości wolnych
+ * ekstentów (przedziały potęg dwójki) i największy plik, jaki da się
+ * teraz zapisać - w jednym kawałku i w ogóle (wolne bloki bez tych,
+ * które zajmie łańcuch ekstentów). Z json jedna linia JSON na stdout.
+ */
+int fragReportDisk(const Disk *disk, int json) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    const FreeExtents *freeExtents = &disk->freeExtents;
+    int64_t files = 0, inlineFiles = 0, dataFiles = 0, fragmentedFiles = 0, fragments = 0, maxFragments = 0;
+    for (int i = 0; i < superBlock->inodesInitialized; i++) {
+        const Inode *ino = &disk->inodes[i];
+        FileExtents fe;
+        statAdd(&globalStats.inodesVisited, 1);
+        if (ino->isUsed != 1) continue;
+        files++;
+        if (ino->flags & INODE_INLINE) inlineFiles++;
+        if (loadFileExtents(disk, ino, &fe) < 0) continue;
+        int64_t count = 0, prevEnd = -1;
+        int runs = 0;
+        for (int f = 0; f < fe.count; f++) {
+            if (fe.frags[f].startBlock == HOLE_BLOCK) continue;
+            if (fe.frags[f].startBlock != prevEnd) runs++;
+            prevEnd = fe.frags[f].startBlock + fe.frags[f].blockCount;
+            count++;
+        }
+        freeFileExtents(&fe);
+        if (count == 0) continue;
+        dataFiles++;
+        fragments += count;
+        if (runs > 1) fragmentedFiles++;
+        if (count > maxFragments) maxFragments = count;
+    }
+    int64_t histogram[64] = { 0 };
+    for (int f = 0; f < freeExtents->count; f++) {
+        int b = 0;
+        while (b < 63 && freeExtents->byOffset[f].blockCount >> (b + 1)) b++;
+        histogram[b]++;
+    }
+    int64_t largest = freeExtents->count > 0 ? freeExtents->byLength[freeExtents->count - 1].blockCount : 0;
+    int64_t chainBlocks = 0;
+    if (freeExtents->count > MAX_FRAGS) {
+        int perBlock = extentsPerBlock(superBlock);
+        chainBlocks = (freeExtents->count - MAX_FRAGS + perBlock - 1) / perBlock;
+    }
+    int freeInode = hasFreeInode(disk);
+    int64_t largestContiguous = freeInode ? largest * superBlock->blockSize : 0;
+    int64_t largestFile = freeInode && superBlock->freeBlocks > chainBlocks
+                              ? (superBlock->freeBlocks - chainBlocks) * superBlock->blockSize : 0;
+    double average = dataFiles ? (double)fragments / dataFiles : 0.0;
+    double freeFragmentation = superBlock->freeBlocks ? 100.0 * (1.0 - (double)largest / superBlock->freeBlocks)
+                                                      : 0.0;
+    if (json) {
+        printf("{\"blockSize\":%d,\"blockCount\":%" PRId64 ",\"files\":%" PRId64 ",\"inlineFiles\":%" PRId64
+               ",\"dataFiles\":%" PRId64 ",\"fragmentedFiles\":%" PRId64 ",\"fragments\":%" PRId64
+               ",\"averageFragments\":%.3f,\"maxFragments\":%" PRId64 ",\"freeBlocks\":%" PRId64
+               ",\"freeExtents\":%d,\"largestFreeExtent\":%" PRId64 ",\"freeFragmentationPercent\":%.2f"
+               ",\"largestContiguousFileBytes\":%" PRId64 ",\"largestFileBytes\":%" PRId64
+               ",\"freeExtentHistogram\":[",
+               superBlock->blockSize, superBlock->blockCount, files, inlineFiles, dataFiles, fragmentedFiles,
+               fragments, average, maxFragments, superBlock->freeBlocks, freeExtents->count, largest,
+               freeFragmentation, largestContiguous, largestFile);
+        int first = 1;
+        for (int b = 0; b < 64; b++) {
+            if (histogram[b] == 0) continue;
+            printf("%s[%" PRId64 ",%" PRId64 "]", first ? "" : ",", (int64_t)1 << b, histogram[b]);
+            first = 0;
+        }
+        printf("]}\n");
+        return 0;
+    }
+    printf("Pliki: %" PRId64 " (w i-węźle: %" PRId64 ", z blokami danych: %" PRId64 ", pofragmentowane: %" PRId64
+           ")\n", files, inlineFiles, dataFiles, fragmentedFiles);
+    printf("Fragmenty: %" PRId64 " (średnio %.2f na plik, najwięcej %" PRId64 ")\n",
+           fragments, average, maxFragments);
+    printf("Wolne bloki: %" PRId64 " w %d ekstentach, największy: %" PRId64 " bloków (fragmentacja %.1f%%)\n",
+           superBlock->freeBlocks, freeExtents->count, largest, freeFragmentation);
+    printf("Największy plik: %" PRId64 " bajtów w jednym kawałku, %" PRId64 " bajtów w ogóle\n",
+           largestContiguous, largestFile);
+    printf("Wolne ekstenty według długości (w blokach):\n");
+    for (int b = 0; b < 64; b++) {
+        if (histogram[b] == 0) continue;
+        int bar = (int)((histogram[b] * 40 + freeExtents->count - 1) / freeExtents->count);
+        printf("  %12" PRId64 " .. %-12" PRId64 " %8" PRId64 " %.*s\n", (int64_t)1 << b,
+               ((int64_t)2 << b) - 1, histogram[b], bar, "########################################");
+    }
+    return 0;
+}
+
+int fragReport(const char *diskName, int json) {
+    Disk disk;
+    if (openDisk(diskName, DISK_FREE_INDEX, &disk) < 0) {
+        return -1;
+    }
+    int rc = fragReportDisk(&disk, json);
+    closeDisk(&disk);
+    return rc;
+}
+
+#define FSCK_MAX_REPORTS 20
+
+/* Wypisuje problem znaleziony przez fsck (tylko pierwsze FSCK_MAX_REPORTS). */
+void fsckReport(int64_t *problems, const char *format, ...) {
+    if (++*problems <= FSCK_MAX_REPORTS) {
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+    } else if (*problems == FSCK_MAX_REPORTS + 1) {
+        printf("(kolejne problemy nie są wypisywane)\n");
+    }
+}
+
+/*
+ * Sprawdza metadane: odwołania plików do bloków (dane i łańcuchy
+ * ekstentów) kontra bitmapa i liczniki odwołań, liczniki w superbloku,
+ * indeks wolnych ekstentów, katalog i listę wolnych i-węzłów. Zwraca
+ * liczbę znalezionych problemów albo -1 przy braku pamięci.
+ */
+int64_t fsckMetadata(const Disk *disk) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int64_t problems = 0;
+    uint16_t *refs = calloc(superBlock->blockCount, sizeof(uint16_t));
+    unsigned char *seen = calloc(superBlock->inodeCount, 1);
+    if (!refs || !seen) {
+        free(refs);
+        free(seen);
+        return -1;
+    }
+    int usedInodes = 0;
+    for (int i = 0; i < superBlock->inodesInitialized; i++) {
+        const Inode *ino = &disk->inodes[i];
+        statAdd(&globalStats.inodesVisited, 1);
+        if (ino->isUsed != 1) continue;
+        usedInodes++;
+        FileExtents fe;
+        if (loadFileExtents(disk, ino, &fe) < 0) {
+            fsckReport(&problems, "Plik '%s': nie można wczytać listy ekstentów.\n", ino->fileName);
+            continue;
+        }
+        int64_t blocks = 0;
+        for (int f = 0; f < fe.count; f++) {
+            int64_t start = fe.frags[f].startBlock;
+            int64_t count = fe.frags[f].blockCount;
+            if (start == HOLE_BLOCK && count > 0 && !(ino->flags & INODE_COMPRESSED)) {
+                blocks += count;
+                continue;
+            }
+            if (start < 0 || count <= 0 || start + count > superBlock->blockCount) {
+                fsckReport(&problems, "Plik '%s': fragment [%" PRId64 ", +%" PRId64 "] poza dyskiem.\n",
+                           ino->fileName, start, count);
+                continue;
+            }
+            for (int64_t b = start; b < start + count; b++) {
+                if (refs[b] < UINT16_MAX) refs[b]++;
+            }
+            blocks += count;
+        }
+        for (int n = 0; n < fe.extentBlockCount; n++) {
+            if (refs[fe.extentBlocks[n]] < UINT16_MAX) refs[fe.extentBlocks[n]]++;
+        }
+        if (ino->flags & INODE_INLINE) {
+            if (ino->fragmentsCount != 0 || ino->fileSize < 0 || ino->fileSize > INLINE_MAX) {
+                fsckReport(&problems, "Plik '%s': dane w i-węźle przy rozmiarze %" PRId64
+                           " bajtów i %d fragmentach.\n", ino->fileName, ino->fileSize, ino->fragmentsCount);
+            }
+        } else if (!(ino->flags & INODE_COMPRESSED) &&
+            blocks != (ino->fileSize + superBlock->blockSize - 1) / superBlock->blockSize) {
+            fsckReport(&problems, "Plik '%s': %" PRId64 " bloków przy rozmiarze %" PRId64 " bajtów.\n",
+                       ino->fileName, blocks, ino->fileSize);
+        }
+        if (findFile(disk, ino->fileName, NULL) != i) {
+            fsckReport(&problems, "Plik '%s' (i-węzeł %d) nie jest dostępny z katalogu.\n", ino->fileName, i);
+        }
+        freeFileExtents(&fe);
+    }
+
+    int64_t usedBlocks = 0, sharedBlocks = 0, savedBlocks = 0;
+    for (int64_t b = 0; b < superBlock->blockCount; b++) {
+        int used = isBlockUsed(disk->blockMap, b);
+        int extra = disk->refCounts ? disk->refCounts[b] : 0;
+        usedBlocks += used;
+        sharedBlocks += extra > 0;
+        savedBlocks += extra;
+        if (!used && refs[b] > 0) {
+            fsckReport(&problems, "Blok %" PRId64 " należy do pliku, ale jest oznaczony jako wolny.\n", b);
+        } else if (used && refs[b] == 0) {
+            fsckReport(&problems, "Blok %" PRId64 " jest zajęty, ale nie należy do żadnego pliku.\n", b);
+        } else if (used && refs[b] != 1 + extra) {
+            fsckReport(&problems, "Blok %" PRId64 ": %d odwołań, a licznik mówi o %d.\n", b, refs[b], 1 + extra);
+        }
+    }
+    if (superBlock->freeBlocks != superBlock->blockCount - usedBlocks) {
+        fsckReport(&problems, "Superblok podaje %" PRId64 " wolnych bloków, bitmapa %" PRId64 ".\n",
+                   superBlock->freeBlocks, superBlock->blockCount - usedBlocks);
+    }
+    if (superBlock->sharedBlocks != sharedBlocks || superBlock->savedBlocks != savedBlocks) {
+        fsckReport(&problems, "Superblok podaje %" PRId64 "/%" PRId64 " bloków współdzielonych/zaoszczędzonych, "
+                   "liczniki %" PRId64 "/%" PRId64 ".\n",
+                   superBlock->sharedBlocks, superBlock->savedBlocks, sharedBlocks, savedBlocks);
+    }
+
+    FreeExtents expected;
+    memset(&expected, 0, sizeof(expected));
+    if (buildFreeExtents(disk->blockMap, superBlock, &expected) == 0 &&
+        (expected.count != disk->freeExtents.count ||
+         memcmp(expected.byOffset, disk->freeExtents.byOffset, expected.count * sizeof(Fragment)) != 0)) {
+        fsckReport(&problems, "Indeks wolnych ekstentów (%d) nie zgadza się z bitmapą (%d ekstentów).\n",
+                   disk->freeExtents.count, expected.count);
+    }
+    freeFreeExtents(&expected);
+
+    int entries = 0;
+    for (int slot = 0; slot < superBlock->dirHashSize; slot++) {
+        const DirSlot *ds = &disk->dirHash[slot];
+        if (ds->entry == 0 || ds->entry == DIR_SLOT_DELETED) continue;
+        entries++;
+        int idx = ds->entry - 1;
+        if (idx < 0 || idx >= superBlock->inodesInitialized || disk->inodes[idx].isUsed != 1 ||
+            ds->hash != hashName(disk->inodes[idx].fileName)) {
+            fsckReport(&problems, "Wpis katalogu %d wskazuje na niepoprawny i-węzeł %d.\n", slot, idx);
+        }
+    }
+    if (entries != usedInodes) {
+        fsckReport(&problems, "Katalog ma %d wpisów, a plików jest %d.\n", entries, usedInodes);
+    }
+
+    for (int idx = superBlock->freeInodeHead; idx != -1; idx = disk->inodes[idx].nextFree) {
+        if (idx < 0 || idx >= superBlock->inodesInitialized || seen[idx] || disk->inodes[idx].isUsed == 1) {
+            fsckReport(&problems, "Lista wolnych i-węzłów jest uszkodzona (i-węzeł %d).\n", idx);
+            break;
+        }
+        seen[idx] = 1;
+    }
+    free(refs);
+    free(seen);
+    return problems;
+}
+
+/* Kolejka zakresów bloków, których sumy kontrolne sprawdza kilka wątków. */
+typedef struct {
+    const Disk *disk;
+    const OwnerMap *owners;
+    int64_t nextBlock;
+    int64_t checkedBlocks;
+    int64_t problems;
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_t lock;
+#endif
+} ScrubQueue;
+
+void *scrubWorker(void *arg) {
+    ScrubQueue *q = arg;
+    const Disk *disk = q->disk;
+    const SuperBlock *superBlock = &disk->superBlock;
+    int64_t perBuffer = COPY_BUF_SIZE / superBlock->blockSize > 0 ? COPY_BUF_SIZE / superBlock->blockSize : 1;
+    char *buf = malloc(perBuffer * superBlock->blockSize);
+    for (;;) {
+#if defined(HAVE_PTHREAD)
+        pthread_mutex_lock(&q->lock);
+#endif
+        int64_t first = q->nextBlock;
+        q->nextBlock += perBuffer;
+#if defined(HAVE_PTHREAD)
+        pthread_mutex_unlock(&q->lock);
+#endif
+        if (!buf || first >= superBlock->blockCount) break;
+        int64_t end = first + perBuffer < superBlock->blockCount ? first + perBuffer : superBlock->blockCount;
+        int64_t checked = 0;
+        for (int64_t b = first; b < end; ) {
+            while (b < end && !isBlockUsed(disk->blockMap, b)) b++;
+            int64_t runEnd = b;
+            while (runEnd < end && isBlockUsed(disk->blockMap, runEnd)) runEnd++;
+            if (b == runEnd) break;
+            size_t len = (size_t)(runEnd - b) * superBlock->blockSize;
+            int64_t bad = diskRead(disk, buf, len, getBlockOffset(superBlock, b)) < 0 ? -2 : -1;
+            for (int64_t from = b; bad == -1 && from < runEnd; ) {
+                bad = findBadBlock(disk, from, buf + (from - b) * superBlock->blockSize,
+                                   (size_t)(runEnd - from) * superBlock->blockSize);
+                if (bad < 0) break;
+                from = bad + 1;
+#if defined(HAVE_PTHREAD)
+                pthread_mutex_lock(&q->lock);
+#endif
+                int own = q->owners ? ownerOf(q->owners, bad, NULL) : -1;
+                fsckReport(&q->problems, "Błąd sumy kontrolnej bloku %" PRId64 " (%s%s%s).\n", bad,
+                           own >= 0 ? "plik '" : "", own >= 0 ? disk->inodes[own].fileName
+                           : own == OWNER_SHARED ? "współdzielony" : "nieznany plik", own >= 0 ? "'" : "");
+#if defined(HAVE_PTHREAD)
+                pthread_mutex_unlock(&q->lock);
+#endif
+                bad = -1;
+            }
+            if (bad == -2) {
+#if defined(HAVE_PTHREAD)
+                pthread_mutex_lock(&q->lock);
+#endif
+                fsckReport(&q->problems, "Błąd odczytu bloków [%" PRId64 "..%" PRId64 "].\n", b, runEnd - 1);
+#if defined(HAVE_PTHREAD)
+                pthread_mutex_unlock(&q->lock);
+#endif
+            }
+            checked += runEnd - b;
+            b = runEnd;
+        }
+#if defined(HAVE_PTHREAD)
+        pthread_mutex_lock(&q->lock);
+#endif
+        q->checkedBlocks += checked;
+#if defined(HAVE_PTHREAD)
+        pthread_mutex_unlock(&q->lock);
+#endif
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * fsck: sprawdza spójność metadanych, a potem równolegle czyta
+ * wszystkie zajęte bloki i porównuje je z sumami kontrolnymi. Dysk
+ * nie jest zmieniany; -1, gdy znaleziono jakikolwiek problem.
+ */
+int checkDisk(const char *diskName) {
+    Disk disk;
+    if (openDisk(diskName, DISK_BLOCKMAP, &disk) < 0) {
+        return -1;
+    }
+    const SuperBlock *superBlock = &disk.superBlock;
+    if (!disk.refCounts) {
+        /* Bez bloków współdzielonych liczniki nie są wczytywane, ale też muszą być zerami. */
+        disk.refCounts = malloc(superBlock->blockCount);
+        if (!disk.refCounts ||
+            diskRead(&disk, disk.refCounts, superBlock->blockCount, superBlock->refCountOffset) < 0) {
+            fprintf(stderr, "Błąd odczytu liczników odwołań dysku '%s'.\n", diskName);
+            closeDisk(&disk);
+            return -1;
+        }
+    }
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int64_t problems = fsckMetadata(&disk);
+    if (problems < 0) {
+        closeDisk(&disk);
+        return -1;
+    }
+
+    ScrubQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.disk = &disk;
+    OwnerMap owners;
+    if (buildOwnerMap(&disk, &owners) == 0) queue.owners = &owners;
+    queue.problems = problems;
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_init(&queue.lock, NULL);
+#endif
+    runThreads(scrubWorker, &queue, copyThreadCount());
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_destroy(&queue.lock);
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    printf("Sprawdzono %" PRId64 " bloków danych (%" PRId64 " KiB) w %.2f s.\n", queue.checkedBlocks,
+           queue.checkedBlocks * superBlock->blockSize >> 10, seconds);
+    if (queue.problems > 0) {
+        printf("Znaleziono problemów: %" PRId64 ".\n", queue.problems);
+    } else {
+        printf("Dysk '%s' jest spójny.\n", diskName);
+    }
+    if (queue.owners) free(owners.runs);
+    closeDisk(&disk);
+    return queue.problems > 0 ? -1 : 0;
+}
+
+/* Kopiuje len bajtów wewnątrz obrazu (obszary nie mogą się nakładać). */
+int copyWithinDisk(Disk *disk, off_t srcOffset, off_t dstOffset, size_t len) {
+    unsigned char *dst = mappedForWrite(disk, dstOffset, len);
+    if (dst && (size_t)srcOffset + len <= disk->mapSize) {
+        memmove(dst, disk->map + srcOffset, len);
+        return 0;
+    }
+    return copyRange(disk->fd, srcOffset, disk->fd, dstOffset, len);
+}
+
+/*
+ * Wyjmuje z indeksu wolnych ekstentów wolne bloki z [lo, hi), żeby
+ * alokator ich nie wybrał. Zwraca liczbę wstrzymanych bloków albo -1;
+ * unholdRange oddaje je z powrotem.
+ */
+int64_t holdRange(Disk *disk, int64_t lo, int64_t hi, Fragment **held, int *heldCount) {
+    FreeExtents *freeExtents = &disk->freeExtents;
+    *held = malloc((freeExtents->count + 1) * sizeof(Fragment));
+    *heldCount = 0;
+    if (!*held) return -1;
+    Fragment key = { lo, 0 };
+    int pos = lowerBound(freeExtents->byOffset, freeExtents->count, &key, compareByOffset);
+    if (pos > 0) pos--;
+    int64_t total = 0;
+    for (; pos < freeExtents->count && freeExtents->byOffset[pos].startBlock < hi; pos++) {
+        int64_t start = freeExtents->byOffset[pos].startBlock;
+        int64_t end = start + freeExtents->byOffset[pos].blockCount;
+        if (start < lo) start = lo;
+        if (end > hi) end = hi;
+        if (start < end) {
+            (*held)[*heldCount].startBlock = start;
+            (*held)[*heldCount].blockCount = end - start;
+            (*heldCount)++;
+            total += end - start;
+        }
+    }
+    for (int h = 0; h < *heldCount; h++) {
+        takeFreeExtent(freeExtents, (*held)[h].startBlock, (*held)[h].blockCount);
+    }
+    return total;
+}
+
+void unholdRange(Disk *disk, Fragment *held, int heldCount) {
+    for (int h = 0; h < heldCount; h++) {
+        releaseFreeExtent(&disk->freeExtents, held[h].startBlock, held[h].blockCount);
+    }
+    free(held);
+}
+
+/*
+ * Przeniesienia defragmentacji czekające na wspólne zatwierdzenie. Bloki
+ * zwolnione przez przeniesienia trafiają do deferred i wracają do puli
+ * dopiero w zatwierdzającej je transakcji (commitBatch), więc żadne
+ * przeniesienie nie pisze wcześniej w blokach, które obraz na dysku
+ * nadal przypisuje plikom.
+ */
+typedef struct {
+    OwnerMap owners;
+    Fragment *deferred;
+    int deferredCount;
+    int deferredCapacity;
+    int64_t deferredLow;
+} DefragBatch;
+
+/* Odkłada bloki [start, start+count) do zwolnienia przy zatwierdzeniu grupy. */
+int defragDefer(DefragBatch *batch, int64_t start, int64_t count) {
+    if (start < batch->deferredLow) batch->deferredLow = start;
+    if (setOwner(&batch->owners, start, count, -1) < 0) return -1;
+    return addExtent(&batch->deferred, &batch->deferredCount, &batch->deferredCapacity, start, count);
+}
+
+/* Koniec odłożonego ciągu zawierającego block albo -1, gdy block nie jest odłożony. */
+int64_t defragDeferredEnd(const DefragBatch *batch, int64_t block) {
+    for (int d = 0; d < batch->deferredCount; d++) {
+        int64_t start = batch->deferred[d].startBlock;
+        if (block >= start && block < start + batch->deferred[d].blockCount) {
+            return start + batch->deferred[d].blockCount;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Podmienia w pamięci listę fragmentów pliku idx na newFrags. Nowe
+ * bloki ekstentów (poza [lo, hi)) są od razu zapisywane, a stare bloki
+ * (freed i stary łańcuch) odkładane do batch->deferred. Dane w nowych
+ * miejscach muszą już być skopiowane.
+ */
+int defragReplace(Disk *disk, DefragBatch *batch, int idx, const FileExtents *fe,
+                  const Fragment *newFrags, int newCount,
+                  const Fragment *freed, int freedCount, int64_t lo, int64_t hi) {
+    Inode updated = disk->inodes[idx];
+    Fragment *held = NULL;
+    int heldCount = 0;
+    if (holdRange(disk, lo, hi, &held, &heldCount) < 0) return -1;
+    int rc = setFileExtents(disk, &updated, newFrags, newCount);
+    unholdRange(disk, held, heldCount);
+    if (rc < 0) {
+        fprintf(stderr, "Brak miejsca na dysku na bloki ekstentów.\n");
+        return -1;
+    }
+    disk->inodes[idx] = updated;
+    markInodeDirty(disk, idx);
+
+    for (int f = 0; rc == 0 && f < freedCount; f++) {
+        if (freed[f].startBlock != HOLE_BLOCK) rc = defragDefer(batch, freed[f].startBlock, freed[f].blockCount);
+    }
+    for (int n = 0; rc == 0 && n < fe->extentBlockCount; n++) {
+        rc = defragDefer(batch, fe->extentBlocks[n], 1);
+    }
+    FileExtents now;
+    if (rc == 0 && loadFileExtents(disk, &updated, &now) == 0) {
+        for (int n = 0; rc == 0 && n < now.extentBlockCount; n++) {
+            rc = setOwner(&batch->owners, now.extentBlocks[n], 1, idx);
+        }
+        freeFileExtents(&now);
+    }
+    return rc;
+}
+
+/*
+ * Zatwierdza przeniesienia z batch: najpierw utrwala skopiowane dane,
+ * potem jedną transakcją zapisuje zajęcie nowych bloków, i-węzły
+ * i zwolnienie starych bloków. Awaria przed końcem zostawia więc pliki
+ * w starych miejscach, a po nim - w nowych, bez osieroconych bloków.
+ */
+int defragFlush(Disk *disk, DefragBatch *batch) {
+    if (disk->dirtyInodes == 0 && batch->deferredCount == 0) return 0;
+    if (syncDisk(disk) < 0) {
+        fprintf(stderr, "Błąd utrwalania przeniesionych danych.\n");
+        return -1;
+    }
+    batch->deferredLow = INT64_MAX;
+    return commitBatch(disk, batch->deferred, &batch->deferredCount);
+}
+
+/* Zajmuje w pamięci bloki [start, start+count) na cel przeniesienia. */
+void defragTake(Disk *disk, int64_t start, int64_t count) {
+    takeFreeExtent(&disk->freeExtents, start, count);
+    markDiskBlocks(disk, start, count, 1);
+    disk->superBlock.freeBlocks -= count;
+}
+
+/*
+ * Przenosi logiczne bloki [first, first+count) pliku idx do już
+ * zajętych (ale jeszcze nieużywanych) bloków dest, po czym podmienia
+ * listę fragmentów przez defragReplace. Dziury zostają dziurami, więc
+ * dest ma tyle bloków, ile jest danych w przenoszonym zakresie.
+ */
+int defragMove(Disk *disk, DefragBatch *batch, int idx, const FileExtents *fe, int64_t first, int64_t count,
+               const Fragment *dest, int destCount, int64_t lo, int64_t hi) {
+    const SuperBlock *superBlock = &disk->superBlock;
+    int blockSize = superBlock->blockSize;
+    Fragment *source = malloc((fe->count + 1) * sizeof(Fragment));
+    Fragment *newFrags = malloc((fe->count + destCount + 2) * sizeof(Fragment));
+    if (!source || !newFrags) {
+        free(source);
+        free(newFrags);
+        return -1;
+    }
+    int sourceCount = sliceExtents(fe, first, count, source);
+    int rc = 0;
+    int s = 0, d = 0;
+    int64_t sOff = 0, dOff = 0;
+    while (rc == 0 && s < sourceCount && d < destCount) {
+        if (source[s].startBlock == HOLE_BLOCK) {
+            s++;
+            continue;
+        }
+        int64_t length = source[s].blockCount - sOff;
+        if (length > dest[d].blockCount - dOff) length = dest[d].blockCount - dOff;
+        rc = copyWithinDisk(disk, getBlockOffset(superBlock, source[s].startBlock + sOff),
+                            getBlockOffset(superBlock, dest[d].startBlock + dOff),
+                            (size_t)length * blockSize);
+        if (rc == 0) {
+            rc = copyWithinDisk(disk, superBlock->checksumOffset + (source[s].startBlock + sOff) * (off_t)sizeof(uint32_t),
+                                superBlock->checksumOffset + (dest[d].startBlock + dOff) * (off_t)sizeof(uint32_t),
+                                (size_t)length * sizeof(uint32_t));
+        }
+        sOff += length;
+        dOff += length;
+        if (sOff == source[s].blockCount) { s++; sOff = 0; }
+        if (dOff == dest[d].blockCount) { d++; dOff = 0; }
+    }
+    if (rc < 0) {
+        fprintf(stderr, "Błąd kopiowania danych pliku '%s'.\n", disk->inodes[idx].fileName);
+    } else {
+        int64_t total = fe->logicalStart[fe->count];
+        int newCount = sliceExtents(fe, 0, first, newFrags);
+        d = 0;
+        dOff = 0;
+        for (s = 0; s < sourceCount; s++) {
+            if (source[s].startBlock == HOLE_BLOCK) {
+                appendFragment(newFrags, &newCount, HOLE_BLOCK, source[s].blockCount);
+                continue;
+            }
+            for (int64_t left = source[s].blockCount; left > 0 && d < destCount; ) {
+                int64_t length = dest[d].blockCount - dOff < left ? dest[d].blockCount - dOff : left;
+                appendFragment(newFrags, &newCount, dest[d].startBlock + dOff, length);
+                left -= length;
+                dOff += length;
+                if (dOff == dest[d].blockCount) { d++; dOff = 0; }
+            }
+        }
+        Fragment *tail = malloc((fe->count + 1) * sizeof(Fragment));
+        int tailCount = tail ? sliceExtents(fe, first + count, total - first - count, tail) : 0;
+        for (int f = 0; f < tailCount; f++) {
+            appendFragment(newFrags, &newCount, tail[f].startBlock, tail[f].blockCount);
+        }
+        free(tail);
+        for (int f = 0; rc == 0 && f < destCount; f++) {
+            rc = setOwner(&batch->owners, dest[f].startBlock, dest[f].blockCount, idx);
+        }
+        if (rc == 0) rc = defragReplace(disk, batch, idx, fe, newFrags, newCount, source, sourceCount, lo, hi);
+    }
+    free(source);
+    free(newFrags);
+    return rc;
+}
+
+/*
+ * Zsuwa zajęte bloki do początku dysku (faza 1), a potem przepisuje
+ * pofragmentowane pliki w całości do wolnego ciągu na końcu i znowu
+ * zsuwa (faza 2), aż żaden pofragmentowany plik się tam nie zmieści.
+ * Zsuwanie przenosi kawałek fragmentu leżący tuż za dziurą do tej
+ * dziury, więc nigdy nie potrzebuje dodatkowego miejsca, a ciągły plik
+ * pozostaje ciągły. Kawałek wielokrotnie dłuższy niż dziura jest
+ * przenoszony w całości do największego wolnego ciągu za nim, jeśli
+ * taki jest -
+ * wraca potem jednym ruchem, gdy dziura przed nim urośnie, zamiast
+ * zsuwać się po kilka bloków. Przeniesienia są zatwierdzane grupami
+ * (defragFlush): wszystkie kawałki wstawiane do jednej dziury razem,
+ * a grupa kończy się, gdy następna dziura zaczyna się od bloków
+ * zwolnionych w tej grupie albo zmiany zajęłyby ponad pół dziennika.
+ * Można przerwać po maxSeconds sekundach lub maxBytes przeniesionych
+ * bajtach i dokończyć kolejnym wywołaniem. 0 oznacza brak limitu.
+ */
+int defragDisk(const char *diskName, int64_t maxSeconds, int64_t maxBytes) {
+    Disk disk;
+    if (openDisk(diskName, DISK_WRITABLE | DISK_BLOCKMAP, &disk) < 0) {
+        return -1;
+    }
+    const SuperBlock *superBlock = &disk.superBlock;
+    DefragBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.deferredLow = INT64_MAX;
+    if (buildOwnerMap(&disk, &batch.owners) < 0) {
+        closeDisk(&disk);
+        return -1;
+    }
+    time_t started = time(NULL);
+    int64_t moved = 0, cursor = 0;
+    int rc = 0, finished = 0, fragmented = 0;
+    while (rc == 0) {
+        if ((maxSeconds > 0 && time(NULL) - started >= maxSeconds) ||
+            (maxBytes > 0 && moved * superBlock->blockSize >= maxBytes)) {
+            break;
+        }
+        if (pendingCommitBytes(&disk) > (size_t)superBlock->walSize / 2 && defragFlush(&disk, &batch) < 0) {
+            rc = -1;
+            break;
+        }
+        while (cursor < superBlock->blockCount && cursor < batch.deferredLow && isBlockUsed(disk.blockMap, cursor)) {
+            cursor++;
+        }
+        if (cursor >= batch.deferredLow) {
+            /* Dalej są bloki zwolnione w tej grupie - po zatwierdzeniu staną się dziurą. */
+            cursor = batch.deferredLow;
+            rc = defragFlush(&disk, &batch);
+            continue;
+        }
+        int64_t p = cursor;
+        while (p < superBlock->blockCount && !isBlockUsed(disk.blockMap, p)) p++;
+        if (p < superBlock->blockCount) {
+            /*
+             * Faza 1: kawałek leżący w piece przesuwamy do dziury [cursor, p).
+             * Bloki zwolnione w tej grupie między dziurą a kawałkiem pomijamy.
+             */
+            int64_t piece = p;
+            for (int64_t end = defragDeferredEnd(&batch, piece); end > piece; end = defragDeferredEnd(&batch, piece)) {
+                piece = end;
+            }
+            int64_t ownedEnd = piece;
+            int idx = -1;
+            if (piece < superBlock->blockCount && isBlockUsed(disk.blockMap, piece)) {
+                idx = ownerOf(&batch.owners, piece, &ownedEnd);
+            }
+            FileExtents fe;
+            if (idx < 0) {
+                /* Blok bez właściciela zostaje na miejscu; za odłożonymi - najpierw je zwalniamy. */
+                if (piece > p) {
+                    rc = defragFlush(&disk, &batch);
+                } else {
+                    cursor = p;
+                }
+                continue;
+            }
+            if (loadFileExtents(&disk, &disk.inodes[idx], &fe) < 0) {
+                rc = -1;
+                break;
+            }
+            int chainBlock = 0;
+            for (int n = 0; n < fe.extentBlockCount; n++) {
+                if (fe.extentBlocks[n] == piece) chainBlock = 1;
+            }
+            if (chainBlock) {
+                if (piece > p) {
+                    rc = defragFlush(&disk, &batch);
+                } else if (p - cursor >= fe.extentBlockCount) {
+                    rc = defragReplace(&disk, &batch, idx, &fe, fe.frags, fe.count, NULL, 0,
+                                       p, superBlock->blockCount);
+                    moved += fe.extentBlockCount;
+                } else {
+                    cursor = p;
+                }
+                freeFileExtents(&fe);
+                continue;
+            }
+            int64_t first = -1, length = 0;
+            for (int f = 0; f < fe.count; f++) {
+                int64_t start = fe.frags[f].startBlock;
+                if (start != HOLE_BLOCK && piece >= start && piece < start + fe.frags[f].blockCount) {
+                    first = fe.logicalStart[f] + (piece - start);
+                    length = start + fe.frags[f].blockCount - piece;
+                    break;
+                }
+            }
+            if (first < 0) {
+                freeFileExtents(&fe);
+                if (piece > p) {
+                    rc = defragFlush(&disk, &batch);
+                } else {
+                    cursor = p;
+                }
+                continue;
+            }
+            /* Bloków współdzielonych nie przenosimy - odwołują się do nich inne pliki. */
+            if (length > ownedEnd - piece) length = ownedEnd - piece;
+            const FreeExtents *freeExtents = &disk.freeExtents;
+            const Fragment *largest = freeExtents->count > 0 ? &freeExtents->byLength[freeExtents->count - 1] : NULL;
+            Fragment dest = { cursor, length };
+            if (length > 4 * (p - cursor) && largest && largest->blockCount >= length && largest->startBlock > piece) {
+                dest.startBlock = largest->startBlock;
+            } else if (length > p - cursor) {
+                length = p - cursor;
+                dest.blockCount = length;
+            }
+            defragTake(&disk, dest.startBlock, length);
+            rc = defragMove(&disk, &batch, idx, &fe, first, length, &dest, 1, 0, 0);
+            moved += length;
+            freeFileExtents(&fe);
+            continue;
+        }
+        if (batch.deferredCount > 0) {
+            rc = defragFlush(&disk, &batch);
+            continue;
+        }
+
+        /* Faza 2: pofragmentowane pliki przepisujemy w całości do największego wolnego ciągu. */
+        int progress = 0;
+        fragmented = 0;
+        for (int i = 0; i < superBlock->inodeCount && rc == 0; i++) {
+            const Inode *ino = &disk.inodes[i];
+            if (ino->isUsed != 1 || ino->fragmentsCount <= 1) continue;
+            FileExtents fe;
+            if (loadFileExtents(&disk, ino, &fe) < 0) {
+                rc = -1;
+                break;
+            }
+            int64_t n = 0, prevEnd = -1;
+            int runs = 0;
+            for (int f = 0; f < fe.count; f++) {
+                if (fe.frags[f].startBlock == HOLE_BLOCK) continue;
+                if (fe.frags[f].startBlock != prevEnd) runs++;
+                prevEnd = fe.frags[f].startBlock + fe.frags[f].blockCount;
+                n += fe.frags[f].blockCount;
+            }
+            const FreeExtents *freeExtents = &disk.freeExtents;
+            if (runs <= 1) {
+                /* Dane są ciągłe, a fragmenty to tylko dziury między nimi. */
+            } else if (hasSharedBlocks(&disk, &fe)) {
+                /* Przepisanie rozdzieliłoby współdzielone bloki. */
+            } else if (freeExtents->count > 0 && freeExtents->byLength[freeExtents->count - 1].blockCount >= n) {
+                Fragment dest = { freeExtents->byLength[freeExtents->count - 1].startBlock, n };
+                defragTake(&disk, dest.startBlock, n);
+                rc = defragMove(&disk, &batch, i, &fe, 0, fe.logicalStart[fe.count], &dest, 1, 0, 0);
+                moved += n;
+                progress = 1;
+                if (rc == 0 && pendingCommitBytes(&disk) > (size_t)superBlock->walSize / 2) {
+                    rc = defragFlush(&disk, &batch);
+                }
+            } else {
+                fragmented++;
+            }
+            freeFileExtents(&fe);
+        }
+        if (!progress) {
+            finished = 1;
+            break;
+        }
+        if (rc == 0) rc = defragFlush(&disk, &batch);
+        cursor = 0;
+    }
+    /* Po błędzie niezatwierdzona grupa przepada, a obraz zostaje po poprzedniej. */
+    if (rc == 0 && defragFlush(&disk, &batch) < 0) rc = -1;
+    printf("Defragmentacja: przeniesiono %" PRId64 " bloków (%" PRId64 " bajtów).\n",
+           moved, moved * superBlock->blockSize);
+    if (rc == 0 && !finished) {
+        printf("Przerwano po wyczerpaniu limitu, ponowne wywołanie dokończy pracę.\n");
+    } else if (rc == 0 && fragmented > 0) {
+        printf("Za mało wolnego miejsca, żeby scalić %d plików.\n", fragmented);
+    }
+    free(batch.owners.runs);
+    free(batch.deferred);
+    closeDisk(&disk);
+    return rc;
+}
+
+/* Numer bloku dyskowego, w którym leży logiczny blok pliku, albo -1. */
+int64_t legacyBlockAt(const LegacyInode *ino, int64_t logical) {
+    for (int f = 0; f < ino->fragmentsCount && f < MAX_FRAGS; f++) {
+        if (logical < ino->fragments[f].blockCount) {
+            return ino->fragments[f].startBlock + logical;
+        }
+        logical -= ino->fragments[f].blockCount;
+    }
+    return -1;
+}
+
+/*
+ * Przepisuje dysk ze starego formatu "MYFS" (bajt na blok, pola 32-bitowe)
+ * do bieżącego. Rozmiar bloku zostaje 512 B. Jeżeli nowe metadane nie
+ * mieszczą się przed starym dataOffset, początek obszaru danych jest
+ * przesuwany o "shift" bloków, a pliki, które miały bloki w tym obszarze,
+ * są najpierw kopiowane w wolne miejsce dalej na dysku.
+ */
+int upgradeDisk(const char *diskName) {
+    Disk disk;
+    memset(&disk, 0, sizeof(disk));
+    disk.flags = DISK_WRITABLE | DISK_BLOCKMAP;
+    disk.fd = open(diskName, O_RDWR);
+    if (disk.fd < 0) {
+        fprintf(stderr, "Nie można otworzyć dysku %s\n", diskName);
+        return -1;
+    }
+    LegacySuperBlock legacy;
+    if (readAt(disk.fd, &legacy, sizeof(legacy), 0) < 0 ||
+        memcmp(legacy.signature, LEGACY_MAGIC_STR, 4) != 0) {
+        fprintf(stderr, "Dysk '%s' nie jest w starym formacie '%s'.\n", diskName, LEGACY_MAGIC_STR);
+        closeDisk(&disk);
+        return -1;
+    }
+
+    SuperBlock *superBlock = &disk.superBlock;
+    memcpy(superBlock->signature, MAGIC_STR, 4);
+    superBlock->version = FS_VERSION;
+    superBlock->blockSize = LEGACY_BLOCK_SIZE;
+    superBlock->inodeCount = legacy.inodeCount;
+    int64_t metaEnd = layoutMetadata(superBlock, legacy.blockCount);
+    int64_t shift = 0;
+    if (metaEnd > legacy.dataOffset) {
+        shift = (metaEnd - legacy.dataOffset + LEGACY_BLOCK_SIZE - 1) / LEGACY_BLOCK_SIZE;
+    }
+    if (shift >= legacy.blockCount) {
+        fprintf(stderr, "Za mało miejsca na metadane w nowym formacie.\n");
+        closeDisk(&disk);
+        return -1;
+    }
+    superBlock->dataOffset = legacy.dataOffset + shift * LEGACY_BLOCK_SIZE;
+    superBlock->blockCount = legacy.blockCount - shift;
+
+    LegacyInode *legacyInodes = calloc(legacy.inodeCount, sizeof(LegacyInode));
+    unsigned char *byteMap = malloc(legacy.blockCount);
+    disk.inodes = calloc(legacy.inodeCount, sizeof(Inode));
+    disk.inodeDirty = malloc(legacy.inodeCount);
+    disk.dirHash = calloc(superBlock->dirHashSize, sizeof(DirSlot));
+    disk.blockMap = allocBlockMap(superBlock);
+    if (!legacyInodes || !byteMap || !disk.inodes || !disk.inodeDirty || !disk.dirHash ||
+        !disk.blockMap ||
+        readAt(disk.fd, legacyInodes, legacy.inodeCount * sizeof(LegacyInode),
+               legacy.inodeTableOffset) < 0 ||
+        readAt(disk.fd, byteMap, legacy.blockCount, legacy.blockBitmapOffset) < 0) {
+        fprintf(stderr, "Błąd odczytu metadanych dysku '%s'.\n", diskName);
+        free(legacyInodes);
+        free(byteMap);
+        closeDisk(&disk);
+        return -1;
+    }
+    for (int64_t b = shift; b < legacy.blockCount; b++) {
+        if (byteMap[b]) {
+            markBlocks(disk.blockMap, b - shift, 1, 1);
+        }
+    }
+    setBlockMapTail(disk.blockMap, superBlock->blockCount);
+    buildFreeExtents(disk.blockMap, superBlock, &disk.freeExtents);
+    superBlock->freeBlocks = 0;
+    for (int e = 0; e < disk.freeExtents.count; e++) {
+        superBlock->freeBlocks += disk.freeExtents.byOffset[e].blockCount;
+    }
+
+    int rc = 0;
+    superBlock->freeInodeHead = -1;
+    superBlock->inodesInitialized = legacy.inodeCount;
+    for (int i = legacy.inodeCount - 1; i >= 0 && rc == 0; i--) {
+        const LegacyInode *old = &legacyInodes[i];
+        Inode *ino = &disk.inodes[i];
+        memcpy(ino->fileName, old->fileName, MAX_NAME_LEN);
+        ino->fileName[MAX_NAME_LEN - 1] = '\0';
+        if (old->isUsed != 1) {
+            for (int f = 0; f < MAX_FRAGS; f++) {
+                ino->fragments[f].startBlock = -1;
+            }
+            ino->extentBlock = -1;
+            ino->nextFree = superBlock->freeInodeHead;
+            superBlock->freeInodeHead = i;
+            continue;
+        }
+        ino->isUsed = 1;
+        ino->fileSize = old->fileSize;
+        ino->nextFree = -1;
+        ino->extentBlock = -1;
+        int relocate = 0;
+        int64_t blocks = 0;
+        for (int f = 0; f < old->fragmentsCount; f++) {
+            if (old->fragments[f].startBlock < shift) relocate = 1;
+            blocks += old->fragments[f].blockCount;
+        }
+        if (!relocate) {
+            ino->fragmentsCount = old->fragmentsCount;
+            for (int f = 0; f < MAX_FRAGS; f++) {
+                ino->fragments[f].startBlock = (f < old->fragmentsCount)
+                                               ? old->fragments[f].startBlock - shift : -1;
+                ino->fragments[f].blockCount = (f < old->fragmentsCount)
+                                               ? old->fragments[f].blockCount : 0;
+            }
+        } else {
+            Fragment *frags = NULL;
+            int fragCount = 0;
+            if (allocateFragments(&disk, blocks, &frags, &fragCount) < 0) {
+                fprintf(stderr, "Za mało wolnego miejsca, żeby przenieść plik '%s'.\n", ino->fileName);
+                rc = -1;
+                break;
+            }
+            int64_t logical = 0;
+            for (int f = 0; f < fragCount && rc == 0; f++) {
+                for (int64_t k = 0; k < frags[f].blockCount && rc == 0; k++) {
+                    int64_t src = legacyBlockAt(old, logical++);
+                    rc = copyRange(disk.fd, legacy.dataOffset + src * LEGACY_BLOCK_SIZE, disk.fd,
+                                   getBlockOffset(superBlock, frags[f].startBlock + k),
+                                   LEGACY_BLOCK_SIZE);
+                }
+            }
+            if (rc == 0) {
+                rc = setFileExtents(&disk, ino, frags, fragCount);
+            }
+            free(frags);
+            for (int f = 0; f < old->fragmentsCount; f++) {
+                int64_t start = old->fragments[f].startBlock;
+                int64_t end = start + old->fragments[f].blockCount;
+                if (start < shift) start = shift;
+                if (start < end) {
+                    markDiskBlocks(&disk, start - shift, end - start, 0);
+                    releaseFreeExtent(&disk.freeExtents, start - shift, end - start);
+                    superBlock->freeBlocks += end - start;
+                }
+            }
+        }
+        if (rc == 0) {
+            insertDirEntry(&disk, ino->fileName, i);
+        }
+    }
+    free(legacyInodes);
+    free(byteMap);
+    if (rc < 0) {
+        fprintf(stderr, "Dysk '%s' nie został zmieniony.\n", diskName);
+        closeDisk(&disk);
+        return -1;
+    }
+    if (shift > 0 && fsync(disk.fd) < 0) {
+        closeDisk(&disk);
+        return -1;
+    }
+
+    WalHeader emptyLog;
+    memset(&emptyLog, 0, sizeof(emptyLog));
+    memset(disk.inodeDirty, 1, legacy.inodeCount);
+    disk.dirtyInodes = legacy.inodeCount;
+    if (allocDirtyMaps(&disk) < 0 ||
+        writeAt(disk.fd, &emptyLog, sizeof(emptyLog), superBlock->walOffset) < 0) {
+        closeDisk(&disk);
+        return -1;
+    }
+    /* Liczniki odwołań i indeks odcisków leżą na miejscu starych danych - zerujemy je. */
+    disk.refCounts = calloc(superBlock->blockCount, 1);
+    disk.fingerprints = calloc(superBlock->fingerprintCount, sizeof(Fingerprint));
+    if (!disk.refCounts || !disk.fingerprints) {
+        closeDisk(&disk);
+        return -1;
+    }
+    /* Stary format nie miał sum kontrolnych - liczymy je dla wszystkich zajętych bloków. */
+    for (int64_t b = 0; b < superBlock->blockCount; ) {
+        int64_t end = b;
+        while (end < superBlock->blockCount && isBlockUsed(disk.blockMap, end)) end++;
+        if (end > b && rechecksumBlocks(&disk, b, end - b) < 0) {
+            closeDisk(&disk);
+            return -1;
+        }
+        b = end + 1;
+    }
+    markDirtyRange(&disk.dirHashChunks, 0, disk.dirHashChunks.regionBytes);
+    markDirtyRange(&disk.blockMapChunks, 0, disk.blockMapChunks.regionBytes);
+    markDirtyRange(&disk.refCountChunks, 0, disk.refCountChunks.regionBytes);
+    markDirtyRange(&disk.fingerprintChunks, 0, disk.fingerprintChunks.regionBytes);
+    disk.blockMapDirty = 1;
+    disk.superBlockDirty = 1;
+    rc = commitDisk(&disk);
+    closeDisk(&disk);
+    if (rc < 0) {
+        fprintf(stderr, "Błąd zapisu podczas aktualizacji dysku '%s'.\n", diskName);
+        return -1;
+    }
+    printf("Dysk '%s' zaktualizowany do formatu w wersji %d.\n", diskName, FS_VERSION);
+    return 0;
+}
+
+#define BATCH_MAX_ARGS 8
+#define BATCH_LINE_LEN 4096
+
+/*
+ * Dzieli linię wsadu na słowa w miejscu. Słowo w cudzysłowach "..." albo
+ * '...' może zawierać spacje, a cudzysłowy są usuwane. Zwraca liczbę
+ * słów (najwyżej maxArgs) albo -1 przy niezamkniętym cudzysłowie.
+ */
+int splitBatchLine(char *line, char **args, int maxArgs) {
+    int argc = 0;
+    char *p = line;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        if (*p == '\0' || argc == maxArgs) return argc;
+        char *out = p;
+        args[argc++] = out;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+            if (*p == '"' || *p == '\'') {
+                char quote = *p++;
+                while (*p && *p != quote) *out++ = *p++;
+                if (*p != quote) return -1;
+                p++;
+            } else {
+                *out++ = *p++;
+            }
+        }
+        if (*p) p++;
+        *out = '\0';
+    }
+}
+
+/*
+ * Tryb wsadowy: polecenia copyin, copyout, rm, ls [-a] i map czytane po
+ * jednym w linii ze scriptFile (albo ze stdin, gdy go brak lub jest
+ * "-"), wykonywane na jednej kopii metadanych i zatwierdzane commitDisk
+ * na końcu, a w długim wsadzie także po drodze, zanim zmiany przerosną
+ * dziennik. Nazwy ze spacjami podaje się w cudzysłowach (splitBatchLine).
+ * Puste linie i linie od '#' są pomijane. Błąd polecenia nie
+ * przerywa wsadu, ale kończy go kodem błędu. Bloki plików usuniętych
+ * przez rm wracają do puli dopiero w zatwierdzającej je transakcji
+ * (commitBatch), więc żadne polecenie wsadu nie pisze wcześniej w blokach,
+ * które obraz na dysku nadal przypisuje plikom.
+ */
+int runBatch(const char *diskName, const char *scriptFile) {
+    FILE *in = stdin;
+    if (scriptFile && strcmp(scriptFile, "-") != 0) {
+        in = fopen(scriptFile, "r");
+        if (!in) {
+            fprintf(stderr, "Nie można otworzyć pliku poleceń %s\n", scriptFile);
+            return -1;
+        }
+    }
+    Disk disk;
+    if (openDisk(diskName, DISK_WRITABLE | DISK_BLOCKMAP, &disk) < 0) {
+        if (in != stdin) fclose(in);
+        return -1;
+    }
+    char line[BATCH_LINE_LEN];
+    int lineNo = 0, executed = 0, failed = 0;
+    Fragment *deferred = NULL;
+    int deferredCount = 0, deferredCapacity = 0;
+    while (fgets(line, sizeof(line), in)) {
+        lineNo++;
+        char *args[BATCH_MAX_ARGS];
+        int argc = line[strspn(line, " \t")] == '#' ? 0 : splitBatchLine(line, args, BATCH_MAX_ARGS);
+        if (argc == 0) continue;
+
+        int rc;
+        if (argc < 0) {
+            fprintf(stderr, "Linia %d: niezamknięty cudzysłów.\n", lineNo);
+            rc = -1;
+        } else if (strcmp(args[0], "copyin") == 0 && argc == 3) {
+            rc = copyInDisk(&disk, args[1], args[2]);
+        } else if (strcmp(args[0], "copyout") == 0 && argc == 3) {
+            rc = copyOutDisk(&disk, args[1], args[2]);
+        } else if (strcmp(args[0], "rm") == 0 && argc == 2) {
+            rc = removeFileDisk(&disk, args[1], &deferred, &deferredCount, &deferredCapacity);
+        } else if (strcmp(args[0], "ls") == 0 && argc == 1) {
+            rc = listFilesDisk(&disk, 0);
+        } else if (strcmp(args[0], "ls") == 0 && argc == 2 && strcmp(args[1], "-a") == 0) {
+            rc = listFilesDisk(&disk, 1);
+        } else if (strcmp(args[0], "map") == 0 && argc == 1) {
+            rc = printMapDisk(&disk, diskName);
+        } else {
+            fprintf(stderr, "Linia %d: nieznane polecenie lub złe argumenty: %s\n", lineNo, args[0]);
+            rc = -1;
+        }
+        executed++;
+        if (rc < 0) failed++;
+        if (pendingCommitBytes(&disk) > (size_t)disk.superBlock.walSize / 2 &&
+            commitBatch(&disk, deferred, &deferredCount) < 0) {
+            failed++;
+            break;
+        }
+    }
+    if (in != stdin) fclose(in);
+    int rc = commitBatch(&disk, deferred, &deferredCount);
+    free(deferred);
+    closeDisk(&disk);
+    printf("Tryb wsadowy: wykonano %d poleceń, nieudanych: %d.\n", executed, failed);
+    return (rc < 0 || failed > 0) ? -1 : 0;
+}
+
+int removeDisk(const char *diskName) {
+    if (unlink(diskName) == 0) {
+        printf("Plik dysku '%s' usunięty.\n", diskName);
+        return 0;
+    } else {
+        perror("unlink");
+        return -1;
+    }
+}
+/* Rozmiar w bajtach z opcjonalnym przyrostkiem K, M, G lub T (potęgi 1024). */
+int parseSize(const char *text, int64_t *value) {
+    char *end = NULL;
+    errno = 0;
+    long long v = strtoll(text, &end, 10);
+    if (errno != 0 || end == text || v < 0) return -1;
+    int shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+        case 'T': case 't': shift = 40; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || v > (INT64_MAX >> shift)) return -1;
+    *value = (int64_t)v << shift;
     return 0;
 }
 
-int loadBlockMap(FILE *fp, const SuperBlock *superBlock, unsigned char *blockMap) {
-    fseek(fp, superBlock->blockBitmapOffset, SEEK_SET);
-    size_t r = fread(blockMap, 1, superBlock->blockCount, fp);
-    return (r == (size_t)superBlock->blockCount) ? 0 : -1;
-}
+/*
+ * API biblioteki (libmyfs.h). Montaż to otwarty Disk: zmiany metadanych
+ * czekają w pamięci na myfsSync, a bloki zwalniane dopiero po
+ * zatwierdzeniu (stare łańcuchy ekstentów) zbierane są w deferred.
+ * generation zmienia się przy każdej zmianie listy fragmentów, żeby
+ * uchwyty wiedziały, kiedy wczytać ją od nowa. Funkcje myfs* spoza
+ * libmyfs.h (myfsGrow, myfsReserve, ...) są pomocnicze i w bibliotece
+ * ukryte jak reszta manager.c.
+ */
+struct MyfsMount {
+    Disk disk;
+    int writable;
+    int openFiles;
+    int64_t generation;
+    Fragment *deferred;
+    int deferredCount;
+    int deferredCapacity;
+};
 
-int saveBlockMap(FILE *fp, const SuperBlock *superBlock, const unsigned char *blockMap) {
-    fseek(fp, superBlock->blockBitmapOffset, SEEK_SET);
-    size_t w = fwrite(blockMap, 1, superBlock->blockCount, fp);
-    return (w == (size_t)superBlock->blockCount) ? 0 : -1;
-}
+struct MyfsFile {
+    MyfsMount *mount;
+    int inode;
+    int writable;
+    int64_t generation;
+    FileExtents fe;
+    ChunkTable chunks;
+    unsigned char *packed;
+    unsigned char *raw;
+    int64_t cachedChunk;
+    int cachedLength;
+};
 
-long getBlockOffset(const SuperBlock *superBlock, int blockNum) {
-    return superBlock->dataOffset + (long)blockNum * BLOCK_SIZE;
+MyfsMount *myfsMount(const char *diskFile, int flags) {
+    MyfsMount *mount = calloc(1, sizeof(MyfsMount));
+    if (!mount) return NULL;
+    mount->writable = (flags & MYFS_RDWR) != 0;
+    initCrc32c();
+    errno = 0;
+    if (openDisk(diskFile, mount->writable ? DISK_WRITABLE | DISK_BLOCKMAP : 0, &mount->disk) < 0) {
+        if (errno == 0) errno = EIO;
+        free(mount);
+        return NULL;
+    }
+    return mount;
 }
 
-int formatDisk(const char *diskFile, long diskSize) {
-    FILE *fp = fopen(diskFile, "wb");
-    if (!fp) {
-        perror("formatDisk fopen");
+int myfsSync(MyfsMount *mount) {
+    if (!mount->writable) return 0;
+    if (commitDisk(&mount->disk) < 0) {
+        errno = EIO;
         return -1;
     }
-    int blockSize = BLOCK_SIZE;
-    long blocks = diskSize / blockSize;
-    if (blocks < 1) {
-        fprintf(stderr, "Za mały rozmiar dysku\n");
-        fclose(fp);
+    if (mount->deferredCount == 0) return 0;
+    releaseFragments(&mount->disk, mount->deferred, mount->deferredCount);
+    mount->deferredCount = 0;
+    if (commitDisk(&mount->disk) < 0) {
+        errno = EIO;
         return -1;
     }
-    int inodeCount = (int)blocks / 16;
-    if (inodeCount > MAX_INODES) {
-        inodeCount = MAX_INODES;
-    }
-    if (inodeCount < 16) {
-        inodeCount = 16;
-    }
-    size_t superBlockSize = sizeof(SuperBlock);
-    size_t inodeTableSize = inodeCount * sizeof(Inode);
-    size_t bitmapSize = blocks;
-    long overhead = (long)superBlockSize + (long)inodeTableSize + (long)bitmapSize;
-    if (diskSize <= overhead) {
-        fprintf(stderr, "Za mały rozmiar dysku\n");
-        fclose(fp);
+    return 0;
+}
+
+int myfsUnmount(MyfsMount *mount) {
+    if (mount->openFiles > 0) {
+        errno = EBUSY;
         return -1;
     }
-    int dataSpace = diskSize - overhead;
-    long blockCount = dataSpace / blockSize;
-    if (blockCount < 1) {
-        fprintf(stderr, "Za mały rozmiar dysku\n");
-        fclose(fp);
+    int rc = myfsSync(mount);
+    closeDisk(&mount->disk);
+    free(mount->deferred);
+    free(mount);
+    return rc;
+}
+
+/* Wczytuje listę fragmentów pliku od nowa, jeśli od ostatniego razu się zmieniła. */
+int myfsRefresh(MyfsFile *file) {
+    if (file->generation == file->mount->generation && file->fe.logicalStart) return 0;
+    Disk *disk = &file->mount->disk;
+    freeFileExtents(&file->fe);
+    freeChunkTable(&file->chunks);
+    file->cachedChunk = -1;
+    const Inode *ino = &disk->inodes[file->inode];
+    if (loadFileExtents(disk, ino, &file->fe) < 0 ||
+        ((ino->flags & INODE_COMPRESSED) && loadChunkTable(disk, ino, &file->fe, &file->chunks) < 0)) {
+        errno = EIO;
         return -1;
     }
+    file->generation = file->mount->generation;
+    return 0;
+}
 
-    SuperBlock superBlock;
-    memset(&superBlock, 0, sizeof(superBlock));
-    memcpy(superBlock.signature, MAGIC_STR, 4);
-    superBlock.blockCount = (int)blockCount;   
-    superBlock.inodeCount = inodeCount;   
-    superBlock.freeBlocks = (int)blockCount;   
-
-    superBlock.inodeTableOffset = (int)sizeof(SuperBlock);
-    int inodeTableOffset = superBlock.inodeTableOffset;
-    int inodeTableBytes = (int)inodeTableSize;
-    
-    superBlock.blockBitmapOffset = inodeTableOffset + inodeTableBytes;
-    int bitmapOffset = superBlock.blockBitmapOffset;
-    int bitmapBytes = (int)blockCount;
-    superBlock.dataOffset = superBlock.blockBitmapOffset + bitmapBytes;
-
-    long totalSize = superBlock.dataOffset + (long)blockCount * blockSize;
-    if (totalSize > diskSize) {
+MyfsFile *myfsOpen(MyfsMount *mount, const char *name, int flags) {
+    Disk *disk = &mount->disk;
+    if ((flags & (MYFS_RDWR | MYFS_CREATE)) && !mount->writable) {
+        errno = EROFS;
+        return NULL;
     }
-
-    fseek(fp, totalSize - 1, SEEK_SET);
-    fputc('\0', fp);
-
-    fseek(fp, 0, SEEK_SET);
-    fwrite(&superBlock, sizeof(superBlock), 1, fp);
-
-    Inode emptyInode;
-    memset(&emptyInode, 0, sizeof(emptyInode));
-    for (int i = 0; i < MAX_FRAGS; i++) {
-        emptyInode.fragments[i].startBlock = -1;
-        emptyInode.fragments[i].blockCount = 0;
+    int idx = findFile(disk, name, NULL);
+    if (idx < 0 && !(flags & MYFS_CREATE)) {
+        errno = ENOENT;
+        return NULL;
     }
-    emptyInode.fragmentsCount = 0;
-    emptyInode.isUsed = 0;
-
-    fseek(fp, superBlock.inodeTableOffset, SEEK_SET);
-    for (int i = 0; i < inodeCount; i++) {
-        fwrite(&emptyInode, sizeof(emptyInode), 1, fp);
+    if (idx < 0) {
+        if (name[0] == '\0' || strlen(name) >= MAX_NAME_LEN) {
+            errno = ENAMETOOLONG;
+            return NULL;
+        }
+        if (!hasFreeInode(disk)) {
+            errno = ENOSPC;
+            return NULL;
+        }
+        idx = allocInode(disk);
+        Inode *ino = &disk->inodes[idx];
+        memset(ino, 0, sizeof(*ino));
+        ino->isUsed = 1;
+        strncpy(ino->fileName, name, MAX_NAME_LEN - 1);
+        for (int f = 0; f < MAX_FRAGS; f++) {
+            ino->fragments[f].startBlock = -1;
+        }
+        ino->nextFree = -1;
+        ino->extentBlock = -1;
+        markInodeDirty(disk, idx);
+        insertDirEntry(disk, ino->fileName, idx);
     }
-
-    unsigned char zero = 0;
-    fseek(fp, superBlock.blockBitmapOffset, SEEK_SET);
-    for (int i = 0; i < blockCount; i++) {
-        fwrite(&zero, 1, 1, fp);
+    MyfsFile *file = calloc(1, sizeof(MyfsFile));
+    if (!file) return NULL;
+    file->mount = mount;
+    file->inode = idx;
+    file->writable = (flags & (MYFS_RDWR | MYFS_CREATE)) != 0;
+    file->generation = -1;
+    if (myfsRefresh(file) < 0) {
+        free(file);
+        return NULL;
     }
+    mount->openFiles++;
+    return file;
+}
 
-    fclose(fp);
-    printf("Utworzono wirtualny dysk: %s\n", diskFile);
-    printf("Liczba bloków = %d, rozmiar pliku = %ld bajtów\n", (int)blockCount, totalSize);
+int myfsClose(MyfsFile *file) {
+    file->mount->openFiles--;
+    freeFileExtents(&file->fe);
+    freeChunkTable(&file->chunks);
+    free(file->packed);
+    free(file->raw);
+    free(file);
     return 0;
 }
 
-int allocateFragments(unsigned char *blockMap, SuperBlock *superBlock, Inode *ino, int blocksNeeded) {
-    if (blocksNeeded <= 0) return 0; 
-
-    int allocated = 0;
-    ino->fragmentsCount = 0;
-    for (int i = 0; i < MAX_FRAGS; i++) {
-        ino->fragments[i].startBlock = -1;
-        ino->fragments[i].blockCount = 0;
+/* pread pliku skompresowanego: rozpakowuje potrzebne kawałki, ostatni trzyma w pamięci. */
+ssize_t myfsPreadCompressed(MyfsFile *file, char *buf, size_t len, int64_t offset) {
+    Disk *disk = &file->mount->disk;
+    int chunkSize = file->chunks.header.chunkSize;
+    if (!file->raw) {
+        file->packed = malloc(chunkSize + 2 * (size_t)disk->superBlock.blockSize);
+        file->raw = malloc(chunkSize);
+        if (!file->packed || !file->raw) return -1;
     }
-    int fragIndex = 0;
-    int i = 0;
-    while (i < superBlock->blockCount && allocated < blocksNeeded) {
-        if (blockMap[i] == 0) {
-            int start = i;
-            int length = 0;
-            while (i < superBlock->blockCount && blockMap[i] == 0 && allocated + length < blocksNeeded) {
-                i++;
-                length++;
-            }
-            if (fragIndex >= MAX_FRAGS) {
+    int64_t fileSize = disk->inodes[file->inode].fileSize;
+    for (size_t done = 0; done < len; ) {
+        int64_t c = (offset + done) / chunkSize;
+        if (c != file->cachedChunk) {
+            file->cachedChunk = -1;
+            file->cachedLength = readChunk(disk, &file->fe, &file->chunks, fileSize, c, file->packed, file->raw);
+            if (file->cachedLength < 0) {
+                errno = EIO;
                 return -1;
             }
-            ino->fragments[fragIndex].startBlock = start;
-            ino->fragments[fragIndex].blockCount = length;
-            fragIndex++;
-            for (int b = start; b < start + length; b++) {
-                blockMap[b] = 1; 
-            }
-
-            allocated += length;
-        } else i++;
-    }
-    if (allocated < blocksNeeded) {
-        return -1;
+            file->cachedChunk = c;
+        }
+        size_t skip = offset + done - c * chunkSize;
+        size_t n = (size_t)file->cachedLength - skip < len - done ? (size_t)file->cachedLength - skip : len - done;
+        memcpy(buf + done, file->raw + skip, n);
+        done += n;
     }
-    ino->fragmentsCount = fragIndex;
-    superBlock->freeBlocks -= allocated;
-    return 0;
+    return len;
 }
 
-int copyIn(const char *diskName, const char *srcFile, const char *destName) {
-    FILE *fSrc = fopen(srcFile, "rb");
-    if (!fSrc) {
-        fprintf(stderr, "Nie mogę otworzyć pliku źródłowego %s\n", srcFile);
+/*
+ * Pozycja w pliku jest zamieniana na blok przez wyszukiwanie binarne w
+ * sumach prefiksowych długości fragmentów (findExtent). Czytane są całe
+ * bloki, żeby sprawdzić ich sumy kontrolne.
+ */
+ssize_t myfsPread(MyfsFile *file, void *buf, size_t len, int64_t offset) {
+    Disk *disk = &file->mount->disk;
+    const Inode *ino = &disk->inodes[file->inode];
+    int blockSize = disk->superBlock.blockSize;
+    if (offset < 0) {
+        errno = EINVAL;
         return -1;
     }
-    fseek(fSrc, 0, SEEK_END);
-    long fileSize = ftell(fSrc);
-    fseek(fSrc, 0, SEEK_SET);
-    FILE *fp = fopen(diskName, "rb+");
-    if (!fp) {
-        fclose(fSrc);
-        fprintf(stderr, "Nie można otworzyć dysku %s\n", diskName);
-        return -1;
-    }
-    SuperBlock superBlock;
-    if (readSuperBlock(fp, &superBlock) < 0) {
-        fclose(fp);
-        fclose(fSrc);
-        return -1;
-    }
-    unsigned char *blockMap = calloc(superBlock.blockCount, 1);
-    loadBlockMap(fp, &superBlock, blockMap);
-    for (int i = 0; i < superBlock.inodeCount; i++) {
-        Inode tmpIno;
-        if (readInode(fp, &superBlock, i, &tmpIno) == 0) {
-            if (tmpIno.isUsed == 1) {
-                if (strncmp(tmpIno.fileName, destName, MAX_NAME_LEN) == 0) {
-                    fprintf(stderr, "Plik o nazwie '%s' już istnieje na dysku!\n", destName);
-                    free(blockMap);
-                    fclose(fp);
-                    fclose(fSrc);
-                    return -1;
-                }
-            }
-        }
+    if (myfsRefresh(file) < 0) return -1;
+    if (offset >= ino->fileSize || len == 0) return 0;
+    if ((int64_t)len > ino->fileSize - offset) len = ino->fileSize - offset;
+    if (ino->flags & INODE_COMPRESSED) return myfsPreadCompressed(file, buf, len, offset);
+    if (ino->flags & INODE_INLINE) {
+        memcpy(buf, INLINE_DATA(ino) + offset, len);
+        return len;
     }
-    int freeInodeIdx = -1;
-    for (int i = 0; i < superBlock.inodeCount; i++) {
-        Inode temp;
-        if (readInode(fp, &superBlock, i, &temp) == 0) {
-            if (temp.isUsed == 0) {
-                freeInodeIdx = i;
-                break;
-            }
+
+    int64_t perBuffer = COPY_BUF_SIZE / blockSize;
+    int64_t lastBlock = (offset + len - 1) / blockSize;
+    char *bounce = malloc(COPY_BUF_SIZE);
+    if (!bounce) return -1;
+    size_t done = 0;
+    while (done < len) {
+        int64_t pos = offset + done;
+        int64_t block = pos / blockSize;
+        int f = findExtent(&file->fe, block);
+        if (f < 0) break;
+        int64_t into = block - file->fe.logicalStart[f];
+        int64_t count = file->fe.frags[f].blockCount - into;
+        if (count > lastBlock - block + 1) count = lastBlock - block + 1;
+        if (count > perBuffer) count = perBuffer;
+        int64_t physical = file->fe.frags[f].startBlock + into;
+        if (file->fe.frags[f].startBlock == HOLE_BLOCK) {
+            memset(bounce, 0, count * blockSize);
+        } else if (diskRead(disk, bounce, count * blockSize, getBlockOffset(&disk->superBlock, physical)) < 0 ||
+                   verifyChecksums(disk, physical, bounce, count * blockSize) < 0) {
+            break;
         }
+        size_t skip = pos - block * blockSize;
+        size_t n = count * blockSize - skip < len - done ? count * blockSize - skip : len - done;
+        memcpy((char *)buf + done, bounce + skip, n);
+        done += n;
     }
-    if (freeInodeIdx < 0) {
-        fprintf(stderr, "Brak wolnych i-węzłów, katalog pełny.\n");
-        free(blockMap);
-        fclose(fp);
-        fclose(fSrc);
+    free(bounce);
+    if (done < len) {
+        errno = EIO;
         return -1;
     }
+    return len;
+}
 
-    Inode newIno;
-    memset(&newIno, 0, sizeof(newIno));
-    newIno.isUsed = 1;
-    strncpy(newIno.fileName, destName, MAX_NAME_LEN - 1);
-    newIno.fileName[MAX_NAME_LEN - 1] = '\0';
-    newIno.fileSize = fileSize;
-    newIno.fragmentsCount = 0;
-    int blocksNeeded = (fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    if (allocateFragments(blockMap, &superBlock, &newIno, blocksNeeded) < 0) {
-        if (superBlock.freeBlocks < blocksNeeded) {
-            printf("Brak miejsca na dysku (pozostale miejsce = %ld, potrzebne miejsce = %ld).\n", 
-                   (long)superBlock.freeBlocks * BLOCK_SIZE, fileSize);
-        } else {
-            fprintf(stderr, "Brak miejsca na dysku albo za dużo fragmentów.\n");
-        }
-        free(blockMap);
-        fclose(fp);
-        fclose(fSrc);
+/* Dokłada count bloków na koniec pliku, najpierw wydłużając ostatni fragment. */
+int myfsGrow(MyfsFile *file, int64_t count) {
+    Disk *disk = &file->mount->disk;
+    FileExtents *fe = &file->fe;
+    int64_t last = fe->count > 0 && fe->frags[fe->count - 1].startBlock != HOLE_BLOCK
+                       ? fe->frags[fe->count - 1].startBlock + fe->frags[fe->count - 1].blockCount : -1;
+    int64_t extended = last >= 0 ? extendInPlace(disk, last, count) : 0;
+    Fragment *run = NULL;
+    int runCount = 0;
+    Fragment *frags = NULL;
+    int64_t *starts = NULL;
+    if ((extended < count && allocateFragments(disk, count - extended, &run, &runCount) < 0) ||
+        !(frags = realloc(fe->frags, (fe->count + runCount + 1) * sizeof(Fragment)))) {
+        Fragment tail = { last, extended };
+        releaseFragments(disk, &tail, 1);
+        releaseFragments(disk, run, runCount);
+        free(run);
+        errno = ENOSPC;
         return -1;
     }
-    long bytesLeft = fileSize;
-    char *buf = malloc(BLOCK_SIZE);
-
-    for (int f = 0; f < newIno.fragmentsCount; f++) {
-        int start = newIno.fragments[f].startBlock;
-        int cnt   = newIno.fragments[f].blockCount; 
-        for (int b = 0; b < cnt; b++) {
-            if (bytesLeft <= 0) break;
-            size_t toRead = (bytesLeft > BLOCK_SIZE) ? BLOCK_SIZE : bytesLeft;
-            size_t r = fread(buf, 1, toRead, fSrc);
-            if (r != toRead) {
-            }
-            long off = getBlockOffset(&superBlock, start + b);
-            fseek(fp, off, SEEK_SET);
-            fwrite(buf, 1, toRead, fp);
-
-            bytesLeft -= toRead;
-        }
-        if (bytesLeft <= 0) break;
+    fe->frags = frags;
+    appendFragment(fe->frags, &fe->count, last, extended);
+    for (int r = 0; r < runCount; r++) {
+        appendFragment(fe->frags, &fe->count, run[r].startBlock, run[r].blockCount);
     }
+    free(run);
+    starts = realloc(fe->logicalStart, (fe->count + 1) * sizeof(int64_t));
+    if (!starts) return -1;
+    fe->logicalStart = starts;
+    computeLogicalStarts(fe);
+    return 0;
+}
 
-    free(buf);
-    writeInode(fp, &superBlock, freeInodeIdx, &newIno);
-
-    saveBlockMap(fp, &superBlock, blockMap);
-    writeSuperBlock(fp, &superBlock);
-
-    free(blockMap);
-    fclose(fp);
-    fclose(fSrc);
-    printf("Skopiowano plik %s do FS jako '%s' (inode=%d, rozmiar=%ld).\n",
-           srcFile, destName, freeInodeIdx, fileSize);
+/* Dokłada na koniec pliku dziurę długości count bloków. */
+int myfsAppendHole(MyfsFile *file, int64_t count) {
+    FileExtents *fe = &file->fe;
+    Fragment *frags = realloc(fe->frags, (fe->count + 1) * sizeof(Fragment));
+    if (!frags) return -1;
+    fe->frags = frags;
+    appendFragment(fe->frags, &fe->count, HOLE_BLOCK, count);
+    int64_t *starts = realloc(fe->logicalStart, (fe->count + 1) * sizeof(int64_t));
+    if (!starts) return -1;
+    fe->logicalStart = starts;
+    computeLogicalStarts(fe);
     return 0;
 }
 
-int copyOut(const char *diskName, const char *fileName, const char *outFile) {
-    FILE *fp = fopen(diskName, "rb");
-    if (!fp) {
-        fprintf(stderr, "Nie można otworzyć dysku %s\n", diskName);
+/*
+ * Kopiowanie przy zapisie: współdzielone bloki logiczne [first,
+ * first+count) i dziury dostają własne bloki. Stara treść (w dziurze
+ * zera) jest przepisywana tylko do bloków, których zapis [from, to) nie
+ * pokrywa w całości.
+ */
+int myfsUnshare(MyfsFile *file, int64_t first, int64_t count, int64_t from, int64_t to) {
+    Disk *disk = &file->mount->disk;
+    FileExtents *fe = &file->fe;
+    int blockSize = disk->superBlock.blockSize;
+    Fragment *run = NULL;
+    int runCount = 0;
+    if (allocateFragments(disk, count, &run, &runCount) < 0) {
+        errno = ENOSPC;
         return -1;
     }
-    SuperBlock superBlock;
-    if (readSuperBlock(fp, &superBlock) < 0) {
-        fclose(fp);
-        return -1;
+    Fragment *old = malloc((fe->count + 1) * sizeof(Fragment));
+    Fragment *frags = malloc((fe->count + runCount + 2) * sizeof(Fragment));
+    char *block = malloc(blockSize);
+    int rc = (old && frags && block) ? 0 : -1;
+    int oldCount = rc == 0 ? sliceExtents(fe, first, count, old) : 0;
+    int64_t logical = first;
+    for (int o = 0, r = 0, k = 0, j = 0; rc == 0 && o < oldCount; logical++) {
+        int64_t source = old[o].startBlock + k;
+        int64_t target = run[r].startBlock + j;
+        if ((logical * blockSize < from || (logical + 1) * blockSize > to) && old[o].startBlock == HOLE_BLOCK) {
+            memset(block, 0, blockSize);
+            rc = writeDataBlocks(disk, target, block, blockSize);
+        } else if (logical * blockSize < from || (logical + 1) * blockSize > to) {
+            rc = diskRead(disk, block, blockSize, getBlockOffset(&disk->superBlock, source));
+            if (rc == 0) rc = verifyChecksums(disk, source, block, blockSize);
+            if (rc == 0) rc = writeDataBlocks(disk, target, block, blockSize);
+        }
+        if (++k == old[o].blockCount) { o++; k = 0; }
+        if (++j == run[r].blockCount) { r++; j = 0; }
     }
-    int foundInode = -1;
-    Inode ino;
-    for (int i = 0; i < superBlock.inodeCount; i++) {
-        if (readInode(fp, &superBlock, i, &ino) == 0) {
-            if (ino.isUsed == 1) {
-                if (strncmp(ino.fileName, fileName, MAX_NAME_LEN) == 0) {
-                    foundInode = i;
-                    break;
-                }
-            }
+    if (rc == 0) {
+        int64_t total = fe->logicalStart[fe->count];
+        int n = sliceExtents(fe, 0, first, frags);
+        for (int r = 0; r < runCount; r++) {
+            appendFragment(frags, &n, run[r].startBlock, run[r].blockCount);
+        }
+        Fragment *tail = malloc((fe->count + 1) * sizeof(Fragment));
+        int tailCount = tail ? sliceExtents(fe, first + count, total - first - count, tail) : 0;
+        for (int t = 0; t < tailCount; t++) {
+            appendFragment(frags, &n, tail[t].startBlock, tail[t].blockCount);
+        }
+        free(tail);
+        int64_t *starts = realloc(fe->logicalStart, (n + 1) * sizeof(int64_t));
+        if (starts) {
+            releaseFragments(disk, old, oldCount);
+            free(fe->frags);
+            fe->frags = frags;
+            fe->count = n;
+            fe->logicalStart = starts;
+            computeLogicalStarts(fe);
+            frags = NULL;
+        } else {
+            rc = -1;
         }
     }
-    if (foundInode < 0) {
-        fprintf(stderr, "Nie ma takiego pliku '%s' na dysku.\n", fileName);
-        fclose(fp);
+    if (rc < 0) {
+        releaseFragments(disk, run, runCount);
+        errno = EIO;
+    }
+    free(run);
+    free(old);
+    free(frags);
+    free(block);
+    return rc;
+}
+
+/* Zapisuje zmienioną listę fragmentów do i-węzła; stary łańcuch zostanie zwolniony po myfsSync. */
+int myfsStoreExtents(MyfsFile *file) {
+    MyfsMount *mount = file->mount;
+    Disk *disk = &mount->disk;
+    Inode updated = disk->inodes[file->inode];
+    int needed = mount->deferredCount + file->fe.extentBlockCount;
+    if (needed > mount->deferredCapacity) {
+        Fragment *grown = realloc(mount->deferred, needed * 2 * sizeof(Fragment));
+        if (!grown) return -1;
+        mount->deferred = grown;
+        mount->deferredCapacity = needed * 2;
+    }
+    if (setFileExtents(disk, &updated, file->fe.frags, file->fe.count) < 0) {
+        errno = ENOSPC;
         return -1;
     }
-    FILE *fOut = fopen(outFile, "wb");
-    if (!fOut) {
-        fprintf(stderr, "Nie można utworzyć pliku wyjściowego %s\n", outFile);
-        fclose(fp);
+    for (int n = 0; n < file->fe.extentBlockCount; n++) {
+        Fragment one = { file->fe.extentBlocks[n], 1 };
+        mount->deferred[mount->deferredCount++] = one;
+    }
+    disk->inodes[file->inode] = updated;
+    markInodeDirty(disk, file->inode);
+    mount->generation++;
+    return myfsRefresh(file);
+}
+
+/* Przenosi dane pliku z i-węzła do bloku, zanim plik przerośnie INLINE_MAX. */
+int myfsUninline(MyfsFile *file) {
+    Disk *disk = &file->mount->disk;
+    Inode *ino = &disk->inodes[file->inode];
+    if (ino->fileSize > 0 &&
+        (myfsGrow(file, 1) < 0 || writeDataBlocks(disk, file->fe.frags[0].startBlock, INLINE_DATA(ino),
+                                                   ino->fileSize) < 0)) {
         return -1;
     }
-    long bytesLeft = ino.fileSize;
-    char *buf = malloc(BLOCK_SIZE);
+    ino->flags &= ~INODE_INLINE;
+    return myfsStoreExtents(file);
+}
 
-    for (int f = 0; f < ino.fragmentsCount; f++) {
-        int start = ino.fragments[f].startBlock;
-        int cnt   = ino.fragments[f].blockCount;
-        for (int b = 0; b < cnt; b++) {
-            if (bytesLeft <= 0) break;
-            size_t toRead = (bytesLeft > BLOCK_SIZE) ? BLOCK_SIZE : bytesLeft;
-            long off = getBlockOffset(&superBlock, start + b);
-            fseek(fp, off, SEEK_SET);
-            size_t rr = fread(buf, 1, toRead, fp);
-            fwrite(buf, 1, rr, fOut);
-            bytesLeft -= rr;
+/*
+ * Przygotowuje bajty [offset, end) pliku do zapisu: dokłada dziurę i bloki
+ * na końcu, daje własne bloki w miejsce współdzielonych i dziur, i zapisuje
+ * nową listę fragmentów. Nie zapisuje jeszcze danych, więc po ENOSPC
+ * zmienione są tylko niezatwierdzone metadane w pamięci (także przy
+ * --mmap - mapDisk nie daje pisać do metadanych przez mapowanie).
+ */
+int myfsReserve(MyfsFile *file, int64_t offset, int64_t end) {
+    Disk *disk = &file->mount->disk;
+    Inode *ino = &disk->inodes[file->inode];
+    int blockSize = disk->superBlock.blockSize;
+    if (end <= offset ||
+        (end <= INLINE_MAX && ((ino->flags & INODE_INLINE) || (ino->fileSize == 0 && file->fe.count == 0)))) {
+        return 0;
+    }
+    if (myfsRefresh(file) < 0 || ((ino->flags & INODE_INLINE) && myfsUninline(file) < 0)) {
+        return -1;
+    }
+    int64_t dataBlocks = (ino->fileSize + blockSize - 1) / blockSize;
+    int64_t firstBlock = offset / blockSize;
+    int64_t lastBlock = (end - 1) / blockSize;
+    int changed = 0;
+    int rc = 0;
+    if (firstBlock > file->fe.logicalStart[file->fe.count]) {
+        /* Całe bloki przed offset zostają dziurą. */
+        rc = myfsAppendHole(file, firstBlock - file->fe.logicalStart[file->fe.count]);
+        changed = rc == 0;
+    }
+    if (rc == 0 && lastBlock + 1 > file->fe.logicalStart[file->fe.count]) {
+        rc = myfsGrow(file, lastBlock + 1 - file->fe.logicalStart[file->fe.count]);
+        changed = rc == 0;
+    }
+    for (int64_t b = firstBlock; rc == 0 && b <= lastBlock && b < dataBlocks; ) {
+        int f = findExtent(&file->fe, b);
+        int hole = file->fe.frags[f].startBlock == HOLE_BLOCK;
+        if (!hole && !disk->refCounts) {
+            b = file->fe.logicalStart[f + 1];
+            continue;
+        }
+        int64_t physical = file->fe.frags[f].startBlock + (b - file->fe.logicalStart[f]);
+        int64_t count = 0;
+        while (b + count <= lastBlock && b + count < file->fe.logicalStart[f + 1] &&
+               (hole || disk->refCounts[physical + count])) {
+            count++;
+        }
+        if (count > 0) {
+            rc = myfsUnshare(file, b, count, offset, end);
+            changed = 1;
         }
-        if (bytesLeft <= 0) break;
+        b += count > 0 ? count : 1;
     }
-    free(buf);
-
-    fclose(fOut);
-    fclose(fp);
-    printf("Skopiowano plik '%s' (inode=%d) z FS do '%s'.\n", fileName, foundInode, outFile);
-    return 0;
+    if (changed && myfsStoreExtents(file) < 0) rc = -1;
+    return rc;
 }
-int removeFile(const char *diskName, const char *fileName) {
-    FILE *fp = fopen(diskName, "rb+");
-    if (!fp) {
-        fprintf(stderr, "Nie można otworzyć %s\n", diskName);
+
+ssize_t myfsPwrite(MyfsFile *file, const void *buf, size_t len, int64_t offset) {
+    Disk *disk = &file->mount->disk;
+    Inode *ino = &disk->inodes[file->inode];
+    int blockSize = disk->superBlock.blockSize;
+    if (!file->writable) {
+        errno = EBADF;
         return -1;
     }
-    SuperBlock superBlock;
-    if (readSuperBlock(fp, &superBlock) < 0) {
-        fclose(fp);
+    if (ino->flags & INODE_COMPRESSED) {
+        errno = ENOTSUP;
         return -1;
     }
-    int foundInode = -1;
-    Inode ino;
-    for (int i = 0; i < superBlock.inodeCount; i++) {
-        if (readInode(fp, &superBlock, i, &ino) == 0) {
-            if (ino.isUsed == 1) {
-                if (strncmp(ino.fileName, fileName, MAX_NAME_LEN) == 0) {
-                    foundInode = i;
-                    break;
-                }
-            }
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len == 0) return 0;
+    if (myfsRefresh(file) < 0) return -1;
+    int64_t end = offset + len;
+    if (end <= INLINE_MAX && ((ino->flags & INODE_INLINE) || (ino->fileSize == 0 && file->fe.count == 0))) {
+        if (!(ino->flags & INODE_INLINE)) {
+            memset(ino->fragments, 0, sizeof(ino->fragments));
+            ino->flags |= INODE_INLINE;
         }
+        memcpy(INLINE_DATA(ino) + offset, buf, len);
+        if (end > ino->fileSize) ino->fileSize = end;
+        markInodeDirty(disk, file->inode);
+        return len;
     }
-    if (foundInode < 0) {
-        fprintf(stderr, "Nie znaleziono pliku '%s'.\n", fileName);
-        fclose(fp);
+    if (myfsReserve(file, offset, end) < 0) {
+        if (errno != ENOSPC) errno = EIO;
         return -1;
     }
-    unsigned char *blockMap = calloc(superBlock.blockCount, 1);
-    loadBlockMap(fp, &superBlock, blockMap);
 
-    int totalBlocksFreed = 0;
-    for (int f = 0; f < ino.fragmentsCount; f++) {
-        int start = ino.fragments[f].startBlock;
-        int cnt   = ino.fragments[f].blockCount;
-        for (int b = start; b < start + cnt; b++) {
-            blockMap[b] = 0;
+    int64_t dataBlocks = (ino->fileSize + blockSize - 1) / blockSize;
+    int64_t lastBlock = (end - 1) / blockSize;
+    int64_t perBuffer = COPY_BUF_SIZE / blockSize;
+    char *bounce = malloc(COPY_BUF_SIZE);
+    int rc = bounce ? 0 : -1;
+    for (int64_t pos = offset; rc == 0 && pos < end; ) {
+        int64_t block = pos / blockSize;
+        int f = findExtent(&file->fe, block);
+        int64_t into = block - file->fe.logicalStart[f];
+        int64_t count = file->fe.frags[f].blockCount - into;
+        if (count > lastBlock - block + 1) count = lastBlock - block + 1;
+        if (count > perBuffer) count = perBuffer;
+        int64_t physical = file->fe.frags[f].startBlock + into;
+        size_t skip = pos - block * blockSize;
+        size_t n = count * blockSize - skip < (size_t)(end - pos) ? count * blockSize - skip : (size_t)(end - pos);
+        /* Częściowo nadpisywane bloki brzegowe trzeba najpierw wczytać (nowe są zerami). */
+        int64_t edges[2] = { 0, count - 1 };
+        int partial[2] = { skip > 0, skip + n < (size_t)count * blockSize };
+        for (int e = 0; rc == 0 && e < 2; e++) {
+            if (!partial[e] || (e == 1 && count == 1 && partial[0])) continue;
+            char *data = bounce + edges[e] * blockSize;
+            if (block + edges[e] < dataBlocks) {
+                rc = diskRead(disk, data, blockSize, getBlockOffset(&disk->superBlock, physical + edges[e]));
+                if (rc == 0) rc = verifyChecksums(disk, physical + edges[e], data, blockSize);
+            } else {
+                memset(data, 0, blockSize);
+            }
         }
-        totalBlocksFreed += cnt;
+        if (rc == 0) {
+            memcpy(bounce + skip, (const char *)buf + (pos - offset), n);
+            rc = writeDataBlocks(disk, physical, bounce, count * blockSize);
+        }
+        pos += n;
     }
-    superBlock.freeBlocks += totalBlocksFreed;
-    Inode empty;
-    memset(&empty, 0, sizeof(empty));
-    writeInode(fp, &superBlock, foundInode, &empty);
-    saveBlockMap(fp, &superBlock, blockMap);
-    writeSuperBlock(fp, &superBlock);
-
-    free(blockMap);
-    fclose(fp);
-    printf("Plik '%s' (inode=%d) usunięty.\n", fileName, foundInode);
-    return 0;
-}
-int listAllFiles(const char *diskName) {
-    FILE *fp = fopen(diskName, "rb");
-    if (!fp) {
-        fprintf(stderr, "Nie można otworzyć %s\n", diskName);
-        return -1;
+    free(bounce);
+    if (rc == 0 && end > ino->fileSize) {
+        ino->fileSize = end;
+        markInodeDirty(disk, file->inode);
     }
-    SuperBlock superBlock;
-    if (readSuperBlock(fp, &superBlock) < 0) {
-        fclose(fp);
+    if (rc < 0) {
+        if (errno != ENOSPC) errno = EIO;
         return -1;
     }
-    printf("Katalog:\n");
-    for (int i = 0; i < superBlock.inodeCount; i++) {
-        Inode ino;
-        if (readInode(fp, &superBlock, i, &ino) == 0) {
-            if (ino.isUsed == 1) {
-                printf("  inode=%d, nazwa='%s', rozmiar=%d bajtów, fragmentsCount=%d\n",
-                       i, ino.fileName, ino.fileSize, ino.fragmentsCount);
-            }
+    return len;
+}
+
+void myfsFillStat(Disk *disk, int idx, MyfsStat *st) {
+    const Inode *ino = &disk->inodes[idx];
+    memset(st, 0, sizeof(*st));
+    memcpy(st->name, ino->fileName, MYFS_NAME_LEN);
+    st->name[MYFS_NAME_LEN - 1] = '\0';
+    st->inode = idx;
+    st->size = ino->fileSize;
+    st->fragments = ino->fragmentsCount;
+    st->compressed = (ino->flags & INODE_COMPRESSED) != 0;
+    FileExtents fe;
+    if (ino->fragmentsCount <= MAX_FRAGS) {
+        for (int f = 0; f < ino->fragmentsCount; f++) {
+            if (ino->fragments[f].startBlock != HOLE_BLOCK) st->blocks += ino->fragments[f].blockCount;
         }
+    } else if (loadFileExtents(disk, ino, &fe) == 0) {
+        for (int f = 0; f < fe.count; f++) {
+            if (fe.frags[f].startBlock != HOLE_BLOCK) st->blocks += fe.frags[f].blockCount;
+        }
+        freeFileExtents(&fe);
     }
-    fclose(fp);
+}
+
+int myfsFstat(MyfsFile *file, MyfsStat *st) {
+    myfsFillStat(&file->mount->disk, file->inode, st);
     return 0;
 }
 
-int listFiles(const char *diskName) {
-        FILE *fp = fopen(diskName, "rb");
-    if (!fp) {
-        fprintf(stderr, "Nie można otworzyć %s\n", diskName);
+int myfsStat(MyfsMount *mount, const char *name, MyfsStat *st) {
+    int idx = findFile(&mount->disk, name, NULL);
+    if (idx < 0) {
+        errno = ENOENT;
         return -1;
     }
-    SuperBlock superBlock;
-    if (readSuperBlock(fp, &superBlock) < 0) {
-        fclose(fp);
-        return -1;
-    }
-    printf("Katalog:\n");
-    for (int i = 0; i < superBlock.inodeCount; i++) {
-        Inode ino;
-        if (readInode(fp, &superBlock, i, &ino) == 0) {
-            if (ino.isUsed == 1) {
-                if (ino.fileName[0] != '.') {
-                    printf("  inode=%d, nazwa='%s', rozmiar=%d bajtów, fragmentsCount=%d\n",
-                       i, ino.fileName, ino.fileSize, ino.fragmentsCount);
-                }
-            }
+    myfsFillStat(&mount->disk, idx, st);
+    return 0;
+}
+
+int myfsReaddir(MyfsMount *mount, int *cursor, MyfsStat *st) {
+    const SuperBlock *superBlock = &mount->disk.superBlock;
+    for (int i = *cursor; i < superBlock->inodesInitialized; i++) {
+        if (mount->disk.inodes[i].isUsed == 1) {
+            myfsFillStat(&mount->disk, i, st);
+            *cursor = i + 1;
+            return 1;
         }
     }
-    fclose(fp);
+    *cursor = superBlock->inodesInitialized;
     return 0;
 }
-int printMap(const char *diskName) {
-    FILE *fp = fopen(diskName, "rb");
-    if (!fp) {
-        fprintf(stderr, "Nie można otworzyć pliku dysku\n");
+
+#if !defined(MYFS_LIBRARY)
+/*
+ * append i write-at: dane z srcFile ("-" oznacza stdin) trafiają do
+ * pliku fileName od offset (append: od końca pliku) przez myfsPwrite.
+ * Przepisywane są tylko dotknięte bloki, plik rośnie najpierw w miejscu
+ * za ostatnim fragmentem, a dopiero potem nowymi fragmentami. Przy
+ * błędzie metadane nie są zatwierdzane, a że w obu trybach (pread
+ * i --mmap) są zmieniane tylko w pamięci, obraz zostaje z metadanymi
+ * sprzed polecenia. Dla zwykłego pliku źródłowego
+ * całe miejsce jest rezerwowane (myfsReserve) przed zapisem danych, więc
+ * brak miejsca niczego nie zmienia. Istniejące, niewspółdzielone bloki
+ * są jednak nadpisywane w miejscu, więc błąd zapisu w trakcie (albo brak
+ * miejsca przy danych ze stdin) może zostawić w nich część nowych danych.
+ */
+int writeToFile(const char *diskName, const char *fileName, const char *srcFile, int64_t offset, int append) {
+    int fromStdin = strcmp(srcFile, "-") == 0;
+    int srcFd = fromStdin ? dup(STDIN_FILENO) : open(srcFile, O_RDONLY);
+    if (srcFd < 0) {
+        fprintf(stderr, "Nie mogę otworzyć pliku źródłowego %s\n", srcFile);
         return -1;
     }
-    SuperBlock superBlock;
-    if (readSuperBlock(fp, &superBlock) < 0) {
-        fclose(fp);
+    if (fromStdin) srcFile = "stdin";
+    MyfsMount *mount = myfsMount(diskName, MYFS_RDWR);
+    if (!mount) {
+        close(srcFd);
         return -1;
     }
-
-    printf("STRUKTURA DYSKU '%s':\n", diskName);
-    printf("Offset superbloku: %ld\n", 0L);
-    printf("Offset tabeli i-węzłów: %d\n", superBlock.inodeTableOffset);
-    printf("Offset bitmapy bloków: %d\n", superBlock.blockBitmapOffset);
-    printf("Offset danych: %d\n", superBlock.dataOffset);
-
-    unsigned char *blockMap = calloc(superBlock.blockCount, 1);
-    loadBlockMap(fp, &superBlock, blockMap);
-
-    Inode *inodes = calloc(superBlock.inodeCount, sizeof(Inode));
-    for (int i = 0; i < superBlock.inodeCount; i++) {
-        readInode(fp, &superBlock, i, &inodes[i]);
-    }
-
-    int *ownerOfBlock = malloc(superBlock.blockCount * sizeof(int));
-    for (int b = 0; b < superBlock.blockCount; b++) {
-        ownerOfBlock[b] = -1; 
-    }
-    for (int i = 0; i < superBlock.inodeCount; i++) {
-        if (inodes[i].isUsed == 1) {
-            for (int f = 0; f < inodes[i].fragmentsCount; f++) {
-                int start = inodes[i].fragments[f].startBlock;
-                int cnt   = inodes[i].fragments[f].blockCount;
-                for (int b = start; b < start + cnt; b++) {
-                    ownerOfBlock[b] = i;
-                }
-            }
-        }
+    MyfsFile *file = myfsOpen(mount, fileName, MYFS_RDWR);
+    MyfsStat st;
+    char *buf = malloc(COPY_BUF_SIZE);
+    int rc = (file && buf) ? 0 : -1;
+    if (!file) {
+        fprintf(stderr, "Nie ma takiego pliku '%s' na dysku.\n", fileName);
+    } else if (myfsFstat(file, &st) == 0 && st.compressed) {
+        fprintf(stderr, "Plik '%s' jest skompresowany i nie można go zmieniać.\n", fileName);
+        rc = -1;
     }
-    printf("Mapa bloków:\n");
-    int start = 0;
-    int currentState  = blockMap[0];
-    int currentOwner  = ownerOfBlock[0];
-    for (int i = 1; i < superBlock.blockCount; i++) {
-        int st   = blockMap[i];
-        int own  = ownerOfBlock[i];
-        if (st != currentState || own != currentOwner) {
-            if (currentState == 0) {
-                printf("Bloki [%d..%d] -> WOLNE\n", start, i - 1);
-            } else {
-                if (currentOwner >= 0) {
-                    printf("Bloki [%d..%d] -> ZAJĘTE (plik='%s')\n",
-                           start, i - 1, inodes[currentOwner].fileName);
-                } else {
-                    printf("Bloki [%d..%d] -> ZAJĘTE (nieznany plik)\n", start, i - 1);
-                }
-            }
-            start         = i;
-            currentState  = st;
-            currentOwner  = own;
-        }
+    if (rc == 0 && append) offset = st.size;
+    struct stat srcSt;
+    if (rc == 0 && fstat(srcFd, &srcSt) == 0 && S_ISREG(srcSt.st_mode) &&
+        myfsReserve(file, offset, offset + srcSt.st_size) < 0) {
+        fprintf(stderr, errno == ENOSPC ? "Brak miejsca na dysku, plik '%s' nie został zmieniony.\n"
+                                        : "Błąd zapisu do pliku '%s' na dysku, plik nie został zmieniony.\n",
+                fileName);
+        rc = -1;
     }
-    if (currentState == 0) {
-        printf("Bloki [%d..%d] -> WOLNE\n", start, superBlock.blockCount - 1);
-    } else {
-        if (currentOwner >= 0) {
-            printf("Bloki [%d..%d] -> ZAJĘTE (plik='%s')\n",
-                   start, superBlock.blockCount - 1,
-                   inodes[currentOwner].fileName);
+    int64_t written = 0;
+    int64_t started = phaseStart();
+    while (rc == 0) {
+        ssize_t n = readFull(srcFd, buf, COPY_BUF_SIZE);
+        if (n < 0) {
+            fprintf(stderr, "Błąd odczytu pliku %s.\n", srcFile);
+            rc = -1;
+        } else if (n > 0 && myfsPwrite(file, buf, n, offset + written) < 0) {
+            fprintf(stderr, errno == ENOSPC ? "Brak miejsca na dysku po zapisaniu %" PRId64 " bajtów; "
+                                              "nadpisane bloki mogą już zawierać nowe dane.\n"
+                                            : "Błąd zapisu do pliku na dysku po zapisaniu %" PRId64 " bajtów; "
+                                              "nadpisane bloki mogą już zawierać nowe dane.\n",
+                    written);
+            rc = -1;
         } else {
-            printf("Bloki [%d..%d] -> ZAJĘTE (nieznany plik)\n", 
-                   start, superBlock.blockCount - 1);
+            written += n;
+            if (n < COPY_BUF_SIZE) break;
         }
     }
-
-    printf("Wolne przestrzenie: %ld bajtów\n", 
-           (long)superBlock.freeBlocks * BLOCK_SIZE);
-
-    free(blockMap);
-    free(ownerOfBlock);
-    free(inodes);
-    fclose(fp);
-    return 0;
-}
-
-int removeDisk(const char *diskName) {
-    if (unlink(diskName) == 0) {
-        printf("Plik dysku '%s' usunięty.\n", diskName);
-        return 0;
-    } else {
-        perror("unlink");
+    phaseEnd(PHASE_TRANSFER, started);
+    free(buf);
+    close(srcFd);
+    if (rc == 0) myfsFstat(file, &st);
+    if (file) myfsClose(file);
+    if (rc < 0) {
+        /* Bez commitDisk nic z i-węzłów, katalogu ani bitmapy nie trafia do obrazu. */
+        closeDisk(&mount->disk);
+        free(mount->deferred);
+        free(mount);
         return -1;
     }
-}
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, 
-            "Użycie: %s <polecenie> [argumenty]\n"
-            "Dostępne polecenia:\n"
-            "  create <diskFile> <diskSize>\n"
-            "  copyin <diskFile> <srcFile> <destName>\n"
-            "  copyout <diskFile> <fileName> <outFile>\n"
-            "  ls <diskFile>\n"
-            "  ls -a <diskFile>\n"
-            "  rm <diskFile> <fileName>\n"
-            "  map <diskFile>\n"
-            "  rmdisk <diskFile>\n",
-            argv[0]);
-        return 1;
+    if (myfsUnmount(mount) < 0) {
+        fprintf(stderr, "Błąd zatwierdzania zmian na dysku '%s'.\n", diskName);
+        return -1;
     }
+    printf("Zapisano %" PRId64 " bajtów do pliku '%s' od pozycji %" PRId64 " (rozmiar=%" PRId64 ").\n",
+           written, fileName, offset, st.size);
+    return 0;
+}
 
+int runCommand(int argc, char *argv[]) {
     const char *cmd = argv[1];
 
     if (strcmp(cmd, "create") == 0) {
         if (argc < 4) {
-            fprintf(stderr, "Użycie: create <diskFile> <diskSize>\n");
+            fprintf(stderr, "Użycie: create <diskFile> <diskSize> [blockSize] [inodeCount]\n");
             return 1;
         }
         const char *diskFile = argv[2];
-        int diskSize = atoi(argv[3]);
-        return formatDisk(diskFile, diskSize);
+        int64_t diskSize = 0;
+        int64_t blockSize = DEFAULT_BLOCK_SIZE;
+        int64_t inodeCount = 0;
+        if (parseSize(argv[3], &diskSize) < 0 ||
+            (argc > 4 && parseSize(argv[4], &blockSize) < 0) ||
+            (argc > 5 && parseSize(argv[5], &inodeCount) < 0) ||
+            blockSize > MAX_BLOCK_SIZE || inodeCount > MAX_INODE_COUNT) {
+            fprintf(stderr, "Niepoprawny rozmiar dysku, bloku lub liczba i-węzłów.\n");
+            return 1;
+        }
+        return formatDisk(diskFile, diskSize, (int)blockSize, (int)inodeCount);
 
     } else if (strcmp(cmd, "copyin") == 0) {
         if (argc < 5) {
-            fprintf(stderr, "Użycie: copyin <diskFile> <srcFile> <destName>\n");
+            fprintf(stderr, "Użycie: copyin <diskFile> <srcFile|-> <destName>\n");
             return 1;
         }
         return copyIn(argv[2], argv[3], argv[4]);
 
+    } else if (strcmp(cmd, "copyin-many") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Użycie: copyin-many <diskFile> <srcFile>...\n");
+            return 1;
+        }
+        return copyInMany(argv[2], &argv[3], argc - 3);
+
     } else if (strcmp(cmd, "copyout") == 0) {
         if (argc < 5) {
             fprintf(stderr, "Użycie: copyout <diskFile> <fileName> <outFile>\n");
@@ -628,6 +6069,21 @@ int main(int argc, char *argv[]) {
         }
         return copyOut(argv[2], argv[3], argv[4]);
 
+    } else if (strcmp(cmd, "append") == 0) {
+        if (argc < 5) {
+            fprintf(stderr, "Użycie: append <diskFile> <fileName> <srcFile|->\n");
+            return 1;
+        }
+        return writeToFile(argv[2], argv[3], argv[4], 0, 1);
+
+    } else if (strcmp(cmd, "write-at") == 0) {
+        int64_t offset = 0;
+        if (argc < 6 || parseSize(argv[4], &offset) < 0) {
+            fprintf(stderr, "Użycie: write-at <diskFile> <fileName> <offset> <srcFile|->\n");
+            return 1;
+        }
+        return writeToFile(argv[2], argv[3], argv[5], offset, 0);
+
     } else if (strcmp(cmd, "ls") == 0) {
         if (argc < 3) {
             fprintf(stderr, "Użycie: ls <diskFile>\n");
@@ -655,6 +6111,43 @@ int main(int argc, char *argv[]) {
         }
         return printMap(argv[2]);
 
+    } else if (strcmp(cmd, "frag") == 0) {
+        if (argc < 3 || (argc > 3 && strcmp(argv[3], "json") != 0)) {
+            fprintf(stderr, "Użycie: frag <diskFile> [json]\n");
+            return 1;
+        }
+        return fragReport(argv[2], argc > 3);
+
+    } else if (strcmp(cmd, "batch") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Użycie: batch <diskFile> [scriptFile]\n");
+            return 1;
+        }
+        return runBatch(argv[2], argc > 3 ? argv[3] : NULL);
+
+    } else if (strcmp(cmd, "defrag") == 0) {
+        int64_t maxSeconds = 0, maxBytes = 0;
+        if (argc < 3 || (argc > 3 && parseSize(argv[3], &maxSeconds) < 0) ||
+            (argc > 4 && parseSize(argv[4], &maxBytes) < 0)) {
+            fprintf(stderr, "Użycie: defrag <diskFile> [maxSeconds] [maxBytes]\n");
+            return 1;
+        }
+        return defragDisk(argv[2], maxSeconds, maxBytes);
+
+    } else if (strcmp(cmd, "fsck") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Użycie: fsck <diskFile>\n");
+            return 1;
+        }
+        return checkDisk(argv[2]);
+
+    } else if (strcmp(cmd, "upgrade") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Użycie: upgrade <diskFile>\n");
+            return 1;
+        }
+        return upgradeDisk(argv[2]);
+
     } else if (strcmp(cmd, "rmdisk") == 0) {
         if (argc < 3) {
             fprintf(stderr, "Użycie: rmdisk <diskFile>\n");
@@ -667,4 +6160,84 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[]) {
+    initCrc32c();
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--mmap") == 0) {
+            globalDiskFlags |= DISK_MMAP;
+        } else if (strcmp(argv[1], "--dedup") == 0) {
+            globalDiskFlags |= DISK_DEDUP;
+        } else if (strcmp(argv[1], "--compress") == 0) {
+            globalDiskFlags |= DISK_COMPRESS;
+        } else if (strcmp(argv[1], "--stats") == 0 || strcmp(argv[1], "--stats=text") == 0) {
+            globalStatsFormat = STATS_TEXT;
+        } else if (strcmp(argv[1], "--stats=json") == 0) {
+            globalStatsFormat = STATS_JSON;
+        } else if (strncmp(argv[1], "--queue-depth=", 14) == 0) {
+            globalQueueDepth = atoi(argv[1] + 14);
+            if (globalQueueDepth < 1 || globalQueueDepth > MAX_IO_QUEUE_DEPTH) {
+                fprintf(stderr, "Głębokość kolejki musi być z zakresu 1..%d\n", MAX_IO_QUEUE_DEPTH);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Nieznana opcja: %s\n", argv[1]);
+            return 1;
+        }
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc > 1 && strcmp(argv[1], "stats") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Użycie: stats <polecenie> [argumenty]\n");
+            return 1;
+        }
+        if (globalStatsFormat == STATS_OFF) globalStatsFormat = STATS_TEXT;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc < 2) {
+        fprintf(stderr, 
+            "Użycie: %s [--mmap] [--dedup] [--compress] [--queue-depth=N] [--stats[=json]] <polecenie> [argumenty]\n"
+            "Dostępne polecenia:\n"
+            "  create <diskFile> <diskSize> [blockSize] [inodeCount]\n"
+            "  copyin <diskFile> <srcFile|-> <destName>\n"
+            "  copyin-many <diskFile> <srcFile>...\n"
+            "  copyout <diskFile> <fileName> <outFile>\n"
+            "  append <diskFile> <fileName> <srcFile|->\n"
+            "  write-at <diskFile> <fileName> <offset> <srcFile|->\n"
+            "  ls <diskFile>\n"
+            "  ls -a <diskFile>\n"
+            "  rm <diskFile> <fileName>\n"
+            "  map <diskFile>\n"
+            "  frag <diskFile> [json]\n"
+            "  upgrade <diskFile>\n"
+            "  defrag <diskFile> [maxSeconds] [maxBytes]\n"
+            "  fsck <diskFile>\n"
+            "  batch <diskFile> [scriptFile]  (polecenia po jednym w linii, nazwy ze spacjami w \"...\")\n"
+            "  rmdisk <diskFile>\n"
+            "  stats <polecenie> [argumenty]\n"
+            "Opcje:\n"
+            "  --mmap  operuj na zmapowanym obrazie dysku (mmap) zamiast pread/pwrite\n"
+            "  --dedup  copyin współdzieli bloki o tej samej zawartości co już zapisane\n"
+            "  --compress  copyin zapisuje plik skompresowany (kawałkami po %d KiB)\n"
+            "  --queue-depth=N  liczba operacji kopiowania w locie naraz (domyślnie %d)\n"
+            "  --stats[=json]  po poleceniu wypisz na stderr liczniki i histogramy czasów faz\n"
+            "                  (polecenie stats to samo co --stats)\n",
+            argv[0], COMPRESS_CHUNK >> 10, IO_QUEUE_DEPTH);
+        return 1;
+    }
+
+    int64_t started = nowNanos();
+    int rc = runCommand(argc, argv);
+    if (globalStatsFormat != STATS_OFF) {
+        fflush(stdout);
+        printStats(argv[1], rc, nowNanos() - started);
+    }
+    return rc;
+}
+
+#endif
@@ -16,9 +16,10 @@ sleep 5
 echo
 echo "=== [2] Generujemy 10 plików (~500 KB każdy) ==="
 sleep 1
+# Losowa treść, a nie zera z mkfile - bloki samych zer copyin zapisuje jako dziury.
 for i in `seq 1 11`; do
     echo "Tworzenie file${i}.bin (500 KB)"
-    ./mkfile file${i}.bin 512000
+    dd if=/dev/urandom of=file${i}.bin bs=1000 count=512 2>/dev/null
 done
 sleep 5
 
@@ -69,7 +70,7 @@ sleep 5
 echo
 echo "=== [5] Generujemy plik bigfile.bin (ok. 1.6 MB) i wgrywamy go na dysk ==="
 sleep 1
-./mkfile bigfile.bin 1600000
+dd if=/dev/urandom of=bigfile.bin bs=1000 count=1600 2>/dev/null
 sleep 2
 
 echo
@@ -109,7 +110,7 @@ sleep 5
 echo
 echo "=== [8] Tworzymy plik ukryty (.secret 1KB) i wgrywamy go na dysk ==="
 sleep 1
-./mkfile .secret 1024
+dd if=/dev/urandom of=.secret bs=1024 count=1 2>/dev/null
 echo "--- copy .secret => '.secret' ---"
 ./manager copyin disk .secret .secret
 sleep 5